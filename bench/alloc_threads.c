@@ -0,0 +1,122 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * Allocation throughput with fibres on several workers.  Each fibre keeps a
+ * window of live objects of assorted small sizes, and over and over replaces
+ * the oldest with a new one, yielding every so often so that fibres move
+ * between workers and free what was allocated elsewhere.  Each line of output
+ * is one allocator and number of workers:
+ *
+ *   alloc workers ops seconds ns/op
+ *
+ * where an operation is one allocation and one deallocation.
+ */
+
+#define STACK_SIZE (64 * 1024)
+#define FIBRES 16
+#define WINDOW 64
+#define OPS_PER_FIBRE 200000
+#define YIELD_EVERY 256
+
+static struct alloc *bench_alloc;
+static long fibres_left;
+static struct fibre *fibres_waiter;
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_churn(void *arg)
+{
+	char *window[WINDOW];
+	size_t sizes[WINDOW];
+	unsigned long seed = (unsigned long)(uintptr_t)arg;
+	long i;
+
+	for (i = 0; i < WINDOW; i++) {
+		window[i] = NULL;
+		sizes[i] = 0;
+	}
+	for (i = 0; i < OPS_PER_FIBRE; i++) {
+		size_t slot = (size_t)i % WINDOW;
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		if (window[slot] != NULL) {
+			deallocate_with(bench_alloc, window[slot], sizes[slot]);
+		}
+		sizes[slot] = 8 + (seed >> 33) % 248;
+		window[slot] = allocate_with(bench_alloc, sizes[slot]);
+		window[slot][0] = (char)i;
+		if (i % YIELD_EVERY == 0) {
+			fibre_yield();
+		}
+	}
+	for (i = 0; i < WINDOW; i++) {
+		deallocate_with(bench_alloc, window[i], sizes[i]);
+	}
+	if (__atomic_sub_fetch(&fibres_left, 1, __ATOMIC_ACQ_REL) == 0) {
+		fibre_wake(fibres_waiter);
+	}
+}
+
+static
+void
+bench_run(const char *name, struct alloc *alloc, size_t nworkers)
+{
+	double start, secs;
+	long i;
+
+	bench_alloc = alloc;
+	fibre_init(&mmap_alloc, STACK_SIZE, nworkers);
+	fibres_left = FIBRES;
+	fibres_waiter = fibre_self();
+
+	start = now();
+	for (i = 0; i < FIBRES; i++) {
+		fibre_go(bench_churn, (void *)(uintptr_t)(i + 1));
+	}
+	fibre_wait();
+	secs = now() - start;
+	fibre_return();
+
+	eprintf("%s\t%lu\t%ld\t%.6f\t%.1f\n", name, nworkers,
+		(long)FIBRES * OPS_PER_FIBRE, secs,
+		secs * 1e9 / ((double)FIBRES * OPS_PER_FIBRE));
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("alloc\tworkers\tops\tseconds\tns/op\n");
+	bench_run("sys", &sys_alloc, 1);
+	bench_run("thread", &thread_alloc, 1);
+	bench_run("sys", &sys_alloc, 4);
+	bench_run("thread", &thread_alloc, 4);
+
+	log_finish();
+	return 0;
+}
@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+#include "epoch.h"
+#include "ctable.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * A read-mostly workload on a shared table, from fibres on several workers:
+ * one operation in WRITE_EVERY sets a key and the rest look one up.  The
+ * concurrent table is compared with an ordinary table behind a mutex.  Each
+ * line of output is one kind of table and number of workers:
+ *
+ *   table workers ops seconds ns/op
+ */
+
+#define STACK_SIZE (64 * 1024)
+#define KEYS 100000
+#define FIBRES 16
+#define OPS_PER_FIBRE 500000
+#define WRITE_EVERY 100
+#define YIELD_EVERY 1024
+
+static struct ctable bench_ctable;
+static struct table bench_table;
+static pthread_mutex_t bench_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int bench_locked;
+static long fibres_left;
+static struct fibre *fibres_waiter;
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_reader(void *arg)
+{
+	unsigned long seed = (unsigned long)(uintptr_t)arg;
+	z64 sum = 0, value;
+	long i;
+
+	for (i = 0; i < OPS_PER_FIBRE; i++) {
+		struct tkey key;
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		key = table_key_z64((z64)((seed >> 33) % KEYS));
+		if (bench_locked) {
+			pthread_mutex_lock(&bench_table_lock);
+			if (i % WRITE_EVERY == 0) {
+				table_set_z64(&bench_table, key, i);
+			} else if (table_try_get_z64(&bench_table, key, &value) == 0) {
+				sum += value;
+			}
+			pthread_mutex_unlock(&bench_table_lock);
+		} else if (i % WRITE_EVERY == 0) {
+			ctable_set_z64(&bench_ctable, key, i);
+		} else if (ctable_try_get_z64(&bench_ctable, key, &value) == 0) {
+			sum += value;
+		}
+		if (i % YIELD_EVERY == 0) {
+			fibre_yield();
+		}
+	}
+	if (sum < 0) {
+		log_info("bench", "sum is negative\n");
+	}
+	if (__atomic_sub_fetch(&fibres_left, 1, __ATOMIC_ACQ_REL) == 0) {
+		fibre_wake(fibres_waiter);
+	}
+}
+
+static
+void
+bench_run(const char *name, int locked, size_t nworkers)
+{
+	double start, secs;
+	long i;
+
+	bench_locked = locked;
+	ctable_init(&bench_ctable, &thread_alloc);
+	table_init(&bench_table, &sys_alloc, KEYS);
+	for (i = 0; i < KEYS; i++) {
+		ctable_set_z64(&bench_ctable, table_key_z64(i), i);
+		table_set_z64(&bench_table, table_key_z64(i), i);
+	}
+
+	fibre_init(&mmap_alloc, STACK_SIZE, nworkers);
+	fibres_left = FIBRES;
+	fibres_waiter = fibre_self();
+	start = now();
+	for (i = 0; i < FIBRES; i++) {
+		fibre_go(bench_reader, (void *)(uintptr_t)(i + 1));
+	}
+	fibre_wait();
+	secs = now() - start;
+	fibre_return();
+
+	ctable_finish(&bench_ctable);
+	table_finish(&bench_table);
+	eprintf("%s\t%lu\t%ld\t%.6f\t%.1f\n", name, nworkers,
+		(long)FIBRES * OPS_PER_FIBRE, secs,
+		secs * 1e9 / ((double)FIBRES * OPS_PER_FIBRE));
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("table\tworkers\tops\tseconds\tns/op\n");
+	bench_run("mutex", 1, 1);
+	bench_run("ctable", 0, 1);
+	bench_run("mutex", 1, 4);
+	bench_run("ctable", 0, 4);
+
+	log_finish();
+	return 0;
+}
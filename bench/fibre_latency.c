@@ -0,0 +1,156 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * An FP_HIGH fibre stands in for the user interface: it sleeps for a couple
+ * of milliseconds at a time, like something waiting for keystrokes, and
+ * measures how late it wakes up.  Meanwhile FP_BACKGROUND fibres grind through
+ * chunks of work, either yielding after every chunk or only when
+ * fibre_maybe_yield says they should.  In the last run, FP_NORMAL fibres also
+ * yield to each other constantly, so that the background fibres only get
+ * anywhere by aging.  Everything runs on one worker.  Each line of output is
+ * one method:
+ *
+ *   method wakeups avg_late_us max_late_us background_chunks aged budget_misses
+ */
+
+#define STACK_SIZE (64 * 1024)
+#define RUN_MS 300
+#define SLEEP_MS 2
+#define BACKGROUND_FIBRES 4
+#define NORMAL_FIBRES 2
+#define CHUNK 20000
+
+static int running;
+static int use_maybe_yield;
+static long wakeups, late_ns, max_late_ns;
+static long background_chunks;
+
+static
+long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+void
+spin(long n)
+{
+	volatile long i;
+
+	for (i = 0; i < n; i++)
+		;
+}
+
+static
+void
+bench_interactive(void *arg)
+{
+	(void)arg;
+	fibre_set_prio(FP_HIGH);
+	while (running) {
+		long deadline = fibre_clock() + SLEEP_MS;
+		long late;
+
+		fibre_sleep_until(deadline);
+		late = now_ns() - deadline * 1000000;
+		wakeups++;
+		late_ns += late;
+		if (late > max_late_ns) {
+			max_late_ns = late;
+		}
+	}
+}
+
+static
+void
+bench_background(void *arg)
+{
+	(void)arg;
+	fibre_set_prio(FP_BACKGROUND);
+	fibre_yield();
+	while (running) {
+		spin(CHUNK);
+		background_chunks++;
+		if (use_maybe_yield) {
+			fibre_maybe_yield();
+		} else {
+			fibre_yield();
+		}
+	}
+}
+
+static
+void
+bench_normal(void *arg)
+{
+	(void)arg;
+	while (running) {
+		spin(CHUNK / 10);
+		fibre_yield();
+	}
+}
+
+static
+void
+bench_run(const char *method, int maybe, int normal_fibres)
+{
+	struct fibre_stats stats;
+	int i;
+
+	running = 1;
+	use_maybe_yield = maybe;
+	wakeups = late_ns = max_late_ns = background_chunks = 0;
+
+	fibre_init(&mmap_alloc, STACK_SIZE, 1);
+	fibre_go(bench_interactive, NULL);
+	for (i = 0; i < BACKGROUND_FIBRES; i++) {
+		fibre_go(bench_background, NULL);
+	}
+	for (i = 0; i < normal_fibres; i++) {
+		fibre_go(bench_normal, NULL);
+	}
+	fibre_sleep(RUN_MS);
+	running = 0;
+	fibre_get_stats(&stats);
+	fibre_return();
+
+	eprintf("%s\t%ld\t%.1f\t%.1f\t%ld\t%ld\t%ld\n",
+		method, wakeups,
+		wakeups == 0 ? 0.0 : (double)late_ns / (double)wakeups / 1e3,
+		(double)max_late_ns / 1e3,
+		background_chunks, stats.fstat_aged, stats.fstat_budget_misses);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("method\twakeups\tavg_late_us\tmax_late_us\t"
+		"background_chunks\taged\tbudget_misses\n");
+	bench_run("yield", 0, 0);
+	bench_run("maybe_yield", 1, 0);
+	bench_run("maybe_yield+normal", 1, NORMAL_FIBRES);
+
+	log_finish();
+	return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * The memory cost of many idle fibres, like one watcher per open buffer.  Each
+ * watcher starts, does a little work and then waits to be told about a
+ * change.  Once they are all waiting, the resident set size of the process is
+ * compared with what it was before they started, and then they are all woken
+ * up and allowed to return.  Everything runs on one worker.  Each line of
+ * output is one stack size:
+ *
+ *   stack_kib fibres rss_mib bytes_per_fibre stack_used seconds
+ *
+ * where stack_used is the most of its stack any watcher had touched.
+ */
+
+#define WATCHERS 100000
+
+static struct fibre **watchers;
+static long watchers_started, watchers_left;
+static struct fibre *watchers_waiter;
+
+static
+long
+resident_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long size, resident = 0;
+
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+unsigned long
+bench_checksum(const long *buf, long n)
+{
+	unsigned long sum = 0;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		sum = sum * 31 + (unsigned long)buf[i];
+	}
+	return sum;
+}
+
+static
+void
+bench_watcher(void *arg)
+{
+	long i = (long)(intptr_t)arg;
+	long buf[64];
+	long j;
+
+	/* a little stack, standing in for looking at the buffer */
+	for (j = 0; j < 64; j++) {
+		buf[j] = i + j;
+	}
+	watchers[i] = fibre_self();
+	if (++watchers_started == WATCHERS) {
+		fibre_wake(watchers_waiter);
+	}
+	fibre_wait();
+	if (bench_checksum(buf, 64) == 0) {
+		log_info("bench", "watcher %ld has a checksum of zero\n", i);
+	}
+	if (--watchers_left == 0) {
+		fibre_wake(watchers_waiter);
+	}
+}
+
+static
+void
+bench_watchers(size_t stack_size)
+{
+	struct fibre_run_stats stats;
+	long before, after, used = 0;
+	double start, secs;
+	long i;
+
+	fibre_init(&mmap_alloc, stack_size, 1);
+	watchers = allocarray_with(&sys_alloc, WATCHERS, sizeof *watchers);
+	watchers_started = 0;
+	watchers_left = WATCHERS;
+	watchers_waiter = fibre_self();
+
+	before = resident_bytes();
+	start = now();
+	for (i = 0; i < WATCHERS; i++) {
+		fibre_go(bench_watcher, (void *)(intptr_t)i);
+	}
+	/* the last watcher to start wakes us up */
+	fibre_wait();
+	secs = now() - start;
+	after = resident_bytes();
+
+	for (i = 0; i < WATCHERS; i++) {
+		fibre_get_run_stats(watchers[i], &stats);
+		if (stats.frs_stack_used > used) {
+			used = stats.frs_stack_used;
+		}
+	}
+	for (i = 0; i < WATCHERS; i++) {
+		fibre_wake(watchers[i]);
+	}
+	fibre_wait();
+	fibre_return();
+	deallocarray_with(&sys_alloc, watchers, WATCHERS, sizeof *watchers);
+
+	eprintf("%lu\t%d\t%.1f\t%ld\t%ld\t%.6f\n",
+		stack_size / 1024, WATCHERS,
+		(double)(after - before) / (1024.0 * 1024.0),
+		(after - before) / WATCHERS, used, secs);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("stack_kib\tfibres\trss_mib\tbytes_per_fibre\t"
+		"stack_used\tseconds\n");
+	bench_watchers(16 * 1024);
+	bench_watchers(4 * 1024 * 1024);
+
+	log_finish();
+	return 0;
+}
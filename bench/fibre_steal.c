@@ -0,0 +1,119 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * One fibre spawns many short fibres without ever yielding, so that every
+ * other worker only gets work by stealing it.  The gap between spawns sets the
+ * spawn rate.  Each line of output is one run:
+ *
+ *   workers interval spawns steals parks seconds spawns/s steals/s
+ */
+
+#define STACK_SIZE (64 * 1024)
+#define FIBRES_PER_RUN 20000
+#define WORK_PER_FIBRE 2000
+
+static long spawn_interval;
+
+static
+void
+spin(long n)
+{
+	volatile long i;
+
+	for (i = 0; i < n; i++)
+		;
+}
+
+static
+void
+bench_worker(void *arg)
+{
+	(void)arg;
+	spin(WORK_PER_FIBRE);
+}
+
+static
+void
+bench_producer(void *arg)
+{
+	long i;
+
+	(void)arg;
+	for (i = 0; i < FIBRES_PER_RUN; i++) {
+		fibre_go(bench_worker, NULL);
+		spin(spawn_interval);
+	}
+}
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_run(size_t nworkers, long interval)
+{
+	struct fibre_stats stats;
+	double start, secs;
+
+	spawn_interval = interval;
+	start = now();
+	fibre_init(&mmap_alloc, STACK_SIZE, nworkers);
+	fibre_go(bench_producer, NULL);
+	fibre_return();
+	secs = now() - start;
+	fibre_get_stats(&stats);
+
+	eprintf("%lu\t%ld\t%ld\t%ld\t%ld\t%.6f\t%.0f\t%.0f\n",
+		nworkers, interval,
+		stats.fstat_fibre_go_calls, stats.fstat_steals, stats.fstat_parks,
+		secs,
+		(double)stats.fstat_fibre_go_calls / secs,
+		(double)stats.fstat_steals / secs);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const long intervals[] = {0, 100, 1000, 10000};
+	size_t nworkers = 0;
+	size_t i;
+
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	if (argc > 1) {
+		nworkers = (size_t)strtoul(argv[1], NULL, 10);
+	}
+	if (nworkers == 0) {
+		nworkers = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	eprintf("workers\tinterval\tspawns\tsteals\tparks\tseconds\tspawns/s\tsteals/s\n");
+	for (i = 0; i < sizeof intervals / sizeof intervals[0]; i++) {
+		bench_run(nworkers, intervals[i]);
+	}
+
+	log_finish();
+	return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * The basic costs of the scheduler, all on one worker:
+ *
+ *  - switch: the main fibre and one other fibre yield back and forth, so each
+ *    operation is a round trip of two switches.
+ *  - spawn: the main fibre starts a fibre that returns straight away, and
+ *    yields to let it run, so each operation is a fibre_go, a switch to the
+ *    new fibre, its fibre_return and a switch back.
+ *  - fanout: many fibres all yield in turn, while the main fibre waits for
+ *    them to finish, so each operation is one yield from one fibre to the
+ *    next, with every fibre's stack being touched.
+ *
+ * Each line of output is one test:
+ *
+ *   test fibres ops seconds ns/op
+ */
+
+#define STACK_SIZE (16 * 1024)
+#define SWITCH_ROUNDS 1000000
+#define SPAWNS 200000
+#define FANOUT_YIELDS 2000000
+
+static long rounds;
+static long yields_each;
+static long fanout_left;
+static struct fibre *fanout_waiter;
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+report(const char *test, long fibres, long ops, double secs)
+{
+	eprintf("%s\t%ld\t%ld\t%.6f\t%.1f\n",
+		test, fibres, ops, secs, secs * 1e9 / (double)ops);
+}
+
+static
+void
+bench_yielder(void *arg)
+{
+	long i;
+
+	(void)arg;
+	for (i = 0; i < rounds; i++) {
+		fibre_yield();
+	}
+}
+
+static
+void
+bench_switch(void)
+{
+	double start, secs;
+	long i;
+
+	rounds = SWITCH_ROUNDS;
+	fibre_init(&mmap_alloc, STACK_SIZE, 1);
+	fibre_go(bench_yielder, NULL);
+	fibre_yield();
+
+	start = now();
+	for (i = 0; i < SWITCH_ROUNDS; i++) {
+		fibre_yield();
+	}
+	secs = now() - start;
+	fibre_return();
+
+	report("switch", 2, SWITCH_ROUNDS, secs);
+}
+
+static
+void
+bench_nothing(void *arg)
+{
+	(void)arg;
+}
+
+static
+void
+bench_spawn(void)
+{
+	double start, secs;
+	long i;
+
+	fibre_init(&mmap_alloc, STACK_SIZE, 1);
+	/* get a stack into the pool, so that this measures reuse */
+	fibre_go(bench_nothing, NULL);
+	fibre_yield();
+
+	start = now();
+	for (i = 0; i < SPAWNS; i++) {
+		fibre_go(bench_nothing, NULL);
+		fibre_yield();
+	}
+	secs = now() - start;
+	fibre_return();
+
+	report("spawn", 1, SPAWNS, secs);
+}
+
+static
+void
+bench_fanout_fibre(void *arg)
+{
+	long i;
+
+	(void)arg;
+	for (i = 0; i < yields_each; i++) {
+		fibre_yield();
+	}
+	if (--fanout_left == 0) {
+		fibre_wake(fanout_waiter);
+	}
+}
+
+static
+void
+bench_fanout(long fibres)
+{
+	double start, secs;
+	long i;
+
+	yields_each = FANOUT_YIELDS / fibres;
+	if (yields_each < 4) {
+		yields_each = 4;
+	}
+
+	fibre_init(&mmap_alloc, STACK_SIZE, 1);
+	fanout_left = fibres;
+	fanout_waiter = fibre_self();
+	for (i = 0; i < fibres; i++) {
+		fibre_go(bench_fanout_fibre, NULL);
+	}
+
+	start = now();
+	fibre_wait();
+	secs = now() - start;
+	fibre_return();
+
+	report("fanout", fibres, fibres * yields_each, secs);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("test\tfibres\tops\tseconds\tns/op\n");
+	bench_switch();
+	bench_spawn();
+	bench_fanout(10);
+	bench_fanout(1000);
+	bench_fanout(100000);
+
+	log_finish();
+	return 0;
+}
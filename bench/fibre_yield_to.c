@@ -0,0 +1,96 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+/*
+ * The main fibre repeatedly hands off to a fibre that does nothing but wait to
+ * be woken.  Each round is one hand-off to the waiting fibre and one switch
+ * back when it waits again.  The hand-off is done either by waking the fibre
+ * and yielding, which passes it through the ready queues, or with a directed
+ * fibre_yield_to.  Everything runs on one worker so that nothing is stolen.
+ * Each line of output is one method:
+ *
+ *   method rounds seconds ns/round
+ */
+
+#define STACK_SIZE (64 * 1024)
+#define ROUNDS 1000000
+
+static struct fibre *waiter;
+
+static
+void
+bench_waiter(void *arg)
+{
+	long i;
+
+	(void)arg;
+	waiter = fibre_self();
+	for (i = 0; i < ROUNDS; i++) {
+		fibre_wait();
+	}
+}
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_run(const char *method, int directed)
+{
+	double start, secs;
+	long i;
+
+	fibre_init(&mmap_alloc, STACK_SIZE, 1);
+	fibre_go(bench_waiter, NULL);
+	/* let it start up and wait for the first time */
+	fibre_yield();
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++) {
+		if (directed) {
+			fibre_yield_to(waiter);
+		} else {
+			fibre_wake(waiter);
+			fibre_yield();
+		}
+	}
+	secs = now() - start;
+	fibre_return();
+
+	eprintf("%s\t%d\t%.6f\t%.1f\n",
+		method, ROUNDS, secs, secs * 1e9 / ROUNDS);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("method\trounds\tseconds\tns/round\n");
+	bench_run("wake+yield", 0);
+	bench_run("yield_to", 1);
+
+	log_finish();
+	return 0;
+}
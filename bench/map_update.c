@@ -0,0 +1,159 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+#include "map.h"
+
+/*
+ * Persistent maps against mutable tables.  Each map or table is filled with
+ * some number of keys, every key is looked up once, and then keys are changed
+ * one at a time, with a map taking a snapshot before each change as something
+ * like undo would.  Doing the same with a table means copying the whole table
+ * for each snapshot, which is only tried on the smaller size.  Each line of
+ * output is one kind of container and size:
+ *
+ *   kind entries build_ns get_ns update_ns
+ *
+ * where each is the mean time per key, and update_ns includes the snapshot,
+ * or is zero where it was not tried.
+ */
+
+#define UPDATES 100000
+#define TABLE_UPDATES 1000
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_map(long entries)
+{
+	struct map map, snapshot;
+	double start, build, get, update;
+	z64 sum = 0;
+	long i;
+
+	map_init(&map, &sys_alloc);
+	start = now();
+	for (i = 0; i < entries; i++) {
+		map_set_z64(&map, table_key_z64(i), i);
+	}
+	build = now() - start;
+
+	start = now();
+	for (i = 0; i < entries; i++) {
+		sum += map_get_z64(&map, table_key_z64(i));
+	}
+	get = now() - start;
+
+	start = now();
+	for (i = 0; i < UPDATES; i++) {
+		map_copy(&snapshot, &map);
+		map_set_z64(&map, table_key_z64(i % entries), -i);
+		map_finish(&snapshot);
+	}
+	update = now() - start;
+	map_finish(&map);
+
+	if (sum != (z64)entries * (entries - 1) / 2) {
+		abort_with_error("map lookups summed to %ld\n", (long)sum);
+	}
+	eprintf("map\t%ld\t%.1f\t%.1f\t%.1f\n", entries,
+		build * 1e9 / (double)entries, get * 1e9 / (double)entries, update * 1e9 / UPDATES);
+}
+
+/*
+ * There is no table_copy, so a snapshot of a table is a new table with every
+ * pair copied into it.
+ */
+static
+struct table *
+bench_table_copy(struct table *table)
+{
+	struct table *copy = table_create(&sys_alloc, table->t_size);
+	struct table_cursor tc;
+	struct tkey key;
+	union object value;
+
+	table_cursor_init(&tc, table);
+	while (table_cursor_next(&tc, &key, &value) == 0) {
+		table_set_z64(copy, key, object_as_z64(&value));
+	}
+	table_cursor_finish(&tc);
+	return copy;
+}
+
+static
+void
+bench_table(long entries)
+{
+	struct table table;
+	struct table *snapshot;
+	double start, build, get, update = 0;
+	z64 sum = 0;
+	long i;
+
+	table_init(&table, &sys_alloc, 0);
+	start = now();
+	for (i = 0; i < entries; i++) {
+		table_set_z64(&table, table_key_z64(i), i);
+	}
+	build = now() - start;
+
+	start = now();
+	for (i = 0; i < entries; i++) {
+		sum += table_get_z64(&table, table_key_z64(i));
+	}
+	get = now() - start;
+
+	if (entries <= 1000) {
+		start = now();
+		for (i = 0; i < TABLE_UPDATES; i++) {
+			snapshot = bench_table_copy(&table);
+			table_set_z64(&table, table_key_z64(i % entries), -i);
+			table_destroy(snapshot);
+		}
+		update = (now() - start) * 1e9 / TABLE_UPDATES;
+	}
+	table_finish(&table);
+
+	if (sum != (z64)entries * (entries - 1) / 2) {
+		abort_with_error("table lookups summed to %ld\n", (long)sum);
+	}
+	eprintf("table\t%ld\t%.1f\t%.1f\t%.1f\n", entries,
+		build * 1e9 / (double)entries, get * 1e9 / (double)entries, update);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("kind\tentries\tbuild_ns\tget_ns\tupdate_ns\n");
+	bench_table(1000);
+	bench_map(1000);
+	bench_table(1000000);
+	bench_map(1000000);
+
+	log_finish();
+	return 0;
+}
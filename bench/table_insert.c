@@ -0,0 +1,77 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+
+/*
+ * The latency of single insertions into a table that grows from empty to
+ * millions of keys, with incremental resizing and without it.  What matters
+ * is the worst insertion, which without incremental resizing is the one that
+ * rehashes the whole table.  Each line of output is one way of resizing:
+ *
+ *   resize entries seconds mean_ns max_us
+ */
+
+#define ENTRIES 4000000
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_inserts(const char *name, size_t incremental_min)
+{
+	struct table table;
+	double start, before, after, worst = 0;
+	long i;
+
+	table_init(&table, &sys_alloc, 0);
+	table.t_incremental_min = incremental_min;
+
+	start = now();
+	for (i = 0; i < ENTRIES; i++) {
+		before = now();
+		table_set_z64(&table, table_key_z64(i), i);
+		after = now();
+		if (after - before > worst) {
+			worst = after - before;
+		}
+	}
+	after = now();
+	table_finish(&table);
+
+	eprintf("%s\t%d\t%.3f\t%.1f\t%.1f\n", name, ENTRIES, after - start,
+		(after - start) * 1e9 / ENTRIES, worst * 1e6);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("resize\tentries\tseconds\tmean_ns\tmax_us\n");
+	bench_inserts("whole", SIZE_MAX);
+	bench_inserts("incremental", TABLE_INCREMENTAL_MIN);
+
+	log_finish();
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+
+/*
+ * Table lookups at different sizes.  A table of integer keys is filled, and
+ * then keys that are in it and keys that are not are looked up in a
+ * scrambled order, so that big tables miss the cache like they would in real
+ * use.  Each line of output is one size:
+ *
+ *   entries insert_ns hit_ns miss_ns
+ */
+
+#define LOOKUPS 4000000
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static
+void
+bench_table(long entries)
+{
+	struct table table;
+	double start, insert, hit, miss;
+	unsigned long seed = 1;
+	z64 sum = 0, value;
+	long i;
+
+	table_init(&table, &sys_alloc, 0);
+	start = now();
+	for (i = 0; i < entries; i++) {
+		table_set_z64(&table, table_key_z64(i), i);
+	}
+	insert = now() - start;
+
+	start = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		sum += table_get_z64(&table,
+			table_key_z64((z64)((seed >> 33) % (unsigned long)entries)));
+	}
+	hit = now() - start;
+
+	start = now();
+	for (i = 0; i < LOOKUPS; i++) {
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		if (table_try_get_z64(&table, table_key_z64(
+				-1 - (z64)((seed >> 33) % (unsigned long)entries)),
+				&value) == 0) {
+			sum += value;
+		}
+	}
+	miss = now() - start;
+
+	if (sum < 0) {
+		log_info("bench", "sum is negative\n");
+	}
+	table_finish(&table);
+
+	eprintf("%ld\t%.1f\t%.1f\t%.1f\n", entries,
+		insert * 1e9 / (double)entries,
+		hit * 1e9 / LOOKUPS, miss * 1e9 / LOOKUPS);
+}
+
+int
+main(void)
+{
+	log_init();
+	log_set_loglevel(LOG_WARNING);
+
+	eprintf("entries\tinsert_ns\thit_ns\tmiss_ns\n");
+	bench_table(10);
+	bench_table(1000);
+	bench_table(1000000);
+
+	log_finish();
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including alloc_slab.h"
+#endif
+#ifndef VINE_SLAB_POOL_H_INCLUDED
+#error "Must include slab_pool.h before including alloc_slab.h"
+#endif
+#ifdef VINE_ALLOC_SLAB_H_INCLUDED
+#error "May not include alloc_slab.h more than once"
+#endif
+#define VINE_ALLOC_SLAB_H_INCLUDED
+/*
+ * A general-purpose allocator built out of slab pools, one for each size
+ * class.  Up to 128 bytes the classes are multiples of 16, and above that
+ * there are four classes to each power of two, up to SLAB_ALLOC_MAX_SIZE.
+ * Anything bigger goes to sa_large.  Because deallocation is given the size,
+ * nothing needs to be stored beside an object to say which class it is in.
+ *
+ * Memory is not zeroed, and a slab_alloc must only be used by one thread at
+ * a time.
+ */
+#define SLAB_ALLOC_CLASSES 32
+#define SLAB_ALLOC_MAX_SIZE 8192ul
+struct slab_alloc {
+	struct alloc sa_alloc;
+	struct alloc *sa_large;
+	struct slab_pool sa_pools[SLAB_ALLOC_CLASSES];
+};
+extern void slab_alloc_init(struct slab_alloc *, struct alloc *large);
+extern void slab_alloc_finish(struct slab_alloc *);
+extern size_t slab_alloc_class(size_t);
+extern size_t slab_alloc_class_size(size_t);
@@ -0,0 +1,99 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including ctable.h"
+#endif
+#ifndef VINE_HASH_H_INCLUDED
+#error "Must include hash.h before including ctable.h"
+#endif
+#ifndef VINE_OBJECT_H_INCLUDED
+#error "Must include object.h before including ctable.h"
+#endif
+#ifndef VINE_TABLE_H_INCLUDED
+#error "Must include table.h before including ctable.h"
+#endif
+#ifndef VINE_EPOCH_H_INCLUDED
+#error "Must include epoch.h before including ctable.h"
+#endif
+#ifdef VINE_CTABLE_H_INCLUDED
+#error "May not include ctable.h more than once"
+#endif
+#define VINE_CTABLE_H_INCLUDED
+/*
+ * A hash table that any number of threads can use at once.  Keys are spread
+ * over CTABLE_SHARDS shards by the top bits of their hashes, and each shard is
+ * a chained hash table with its own lock, which is only taken to change it.
+ * Lookups take no locks and write nothing shared, so they scale with the
+ * number of threads reading.
+ *
+ * Nodes are never changed once a reader might see them: setting a key that is
+ * already there replaces its node, and a shard that grows copies its nodes
+ * into new buckets.  What is replaced is retired with epoch_retire, and freed
+ * once no lookup can still be using it, so ct_alloc must be safe to use from
+ * any thread, like sys_alloc or thread_alloc.
+ *
+ * Like a table, a ctable does not own the objects in it, so a string given to
+ * ctable_set_cstr must not change or be freed while the table might return it.
+ */
+#define CTABLE_SHARDS 64
+struct ctable_node {
+	struct ctable_node *cn_next;
+	struct tkey cn_key;
+	union object cn_value;
+};
+struct ctable_buckets {
+	size_t cb_count;
+	struct ctable_node *cb_heads[1];
+};
+/*
+ * Every lookup reads cs_buckets, which only changes when the shard grows, and
+ * everything else is written by whoever holds cs_lock.  So they are kept on
+ * separate cache lines, and each shard starts on a line of its own, so that
+ * writers do not slow down readers of the same shard or of its neighbours.
+ * That holds as long as the struct ctable is itself suitably aligned, which
+ * static and automatic ones are.
+ */
+#define CTABLE_SHARD_ALIGN 64
+struct ctable_shard {
+	struct ctable_buckets *cs_buckets;
+	pthread_mutex_t cs_lock __attribute__((aligned(CTABLE_SHARD_ALIGN)));
+	size_t cs_size;
+	struct epoch_limbo cs_limbo;
+} __attribute__((aligned(CTABLE_SHARD_ALIGN)));
+struct ctable {
+	struct alloc *ct_alloc;
+	struct ctable_shard ct_shards[CTABLE_SHARDS];
+};
+extern void ctable_init(struct ctable *, struct alloc *);
+extern void ctable_finish(struct ctable *);
+extern size_t ctable_size(struct ctable *);
+extern int ctable_remove(struct ctable *, struct tkey);
+/* see table_try_get_XXX */
+extern int ctable_try_get_u8(struct ctable *, struct tkey, u8 *);
+extern int ctable_try_get_u16(struct ctable *, struct tkey, u16 *);
+extern int ctable_try_get_u32(struct ctable *, struct tkey, u32 *);
+extern int ctable_try_get_u64(struct ctable *, struct tkey, u64 *);
+extern int ctable_try_get_z8(struct ctable *, struct tkey, z8 *);
+extern int ctable_try_get_z16(struct ctable *, struct tkey, z16 *);
+extern int ctable_try_get_z32(struct ctable *, struct tkey, z32 *);
+extern int ctable_try_get_z64(struct ctable *, struct tkey, z64 *);
+extern int ctable_try_get_int(struct ctable *, struct tkey, int *);
+extern int ctable_try_get_cstr(struct ctable *, struct tkey, const char **);
+extern u8  ctable_get_u8(struct ctable *, struct tkey);
+extern u16 ctable_get_u16(struct ctable *, struct tkey);
+extern u32 ctable_get_u32(struct ctable *, struct tkey);
+extern u64 ctable_get_u64(struct ctable *, struct tkey);
+extern z8  ctable_get_z8(struct ctable *, struct tkey);
+extern z16 ctable_get_z16(struct ctable *, struct tkey);
+extern z32 ctable_get_z32(struct ctable *, struct tkey);
+extern z64 ctable_get_z64(struct ctable *, struct tkey);
+extern int ctable_get_int(struct ctable *, struct tkey);
+extern const char *ctable_get_cstr(struct ctable *, struct tkey);
+extern void ctable_set_u8(struct ctable *, struct tkey, u8);
+extern void ctable_set_u16(struct ctable *, struct tkey, u16);
+extern void ctable_set_u32(struct ctable *, struct tkey, u32);
+extern void ctable_set_u64(struct ctable *, struct tkey, u64);
+extern void ctable_set_z8(struct ctable *, struct tkey, z8);
+extern void ctable_set_z16(struct ctable *, struct tkey, z16);
+extern void ctable_set_z32(struct ctable *, struct tkey, z32);
+extern void ctable_set_z64(struct ctable *, struct tkey, z64);
+extern void ctable_set_int(struct ctable *, struct tkey, int);
+extern void ctable_set_cstr(struct ctable *, struct tkey, const char *);
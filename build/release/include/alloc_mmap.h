@@ -0,0 +1,32 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including alloc_mmap.h"
+#endif
+#ifdef VINE_ALLOC_MMAP_H_INCLUDED
+#error "May not include alloc_mmap.h more than once"
+#endif
+#define VINE_ALLOC_MMAP_H_INCLUDED
+/*
+ * Memory straight from mmap, a whole number of pages at a time, for big
+ * buffers that may grow a lot.  mmap_alloc is a page_alloc with no flags.
+ *
+ * Mappings of at least pa_huge_min bytes are made a whole number of huge
+ * pages.  With PAGE_ALLOC_HUGETLB they come from the preallocated huge page
+ * pool if it has room, and with PAGE_ALLOC_THP they are aligned to a huge page
+ * and the kernel is asked to back them with transparent huge pages.  Either
+ * way, a big buffer takes far fewer TLB entries.  With PAGE_ALLOC_POPULATE,
+ * pages are faulted in when they are mapped rather than when they are first
+ * touched.
+ */
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2ul * 1024 * 1024)
+#endif
+#define PAGE_ALLOC_POPULATE 0x1
+#define PAGE_ALLOC_HUGETLB  0x2
+#define PAGE_ALLOC_THP      0x4
+struct page_alloc {
+	struct alloc pa_alloc;
+	int pa_flags;
+	size_t pa_huge_min;
+};
+extern void page_alloc_init(struct page_alloc *, int flags, size_t huge_min);
+extern size_t page_alloc_size(struct page_alloc *, size_t);
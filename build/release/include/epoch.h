@@ -0,0 +1,29 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including epoch.h"
+#endif
+#ifdef VINE_EPOCH_H_INCLUDED
+#error "May not include epoch.h more than once"
+#endif
+#define VINE_EPOCH_H_INCLUDED
+/*
+ * Epoch-based reclamation, for data structures that are read without locks.
+ * A reader brackets each access with epoch_enter and epoch_leave, and a
+ * writer that unlinks something a reader might still be looking at gives it
+ * to epoch_retire instead of freeing it.  It is freed by epoch_reclaim once
+ * every thread that was reading when it was retired has stopped.
+ *
+ * Epochs belong to threads, not fibres, so a fibre must not yield between
+ * epoch_enter and epoch_leave.  Sections can be nested.
+ */
+struct epoch_retired;
+struct epoch_limbo {
+	struct epoch_retired *el_head;
+	size_t el_count;
+};
+extern void epoch_enter(void);
+extern void epoch_leave(void);
+extern void epoch_limbo_init(struct epoch_limbo *);
+extern void epoch_limbo_finish(struct epoch_limbo *);
+extern void epoch_retire(struct epoch_limbo *, struct alloc *, void *, size_t);
+extern void epoch_retire_with(struct epoch_limbo *, struct alloc *, void *, size_t, void (*)(struct alloc *, void *, size_t));
+extern size_t epoch_reclaim(struct epoch_limbo *);
@@ -0,0 +1,125 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including fibre.h"
+#endif
+#ifndef VINE_TIMER_WHEEL_H_INCLUDED
+#error "Must include timer_wheel.h before including fibre.h"
+#endif
+#ifdef VINE_FIBRE_H_INCLUDED
+#error "May not include fibre.h more than once"
+#endif
+#define VINE_FIBRE_H_INCLUDED
+enum fibre_prio {
+	/* a fibre used for ui or other interactive functionality */
+	FP_HIGH,
+	/* any other fibre */
+	FP_NORMAL,
+	/* a fibre used for non-latency-sensitive background tasks */
+	FP_BACKGROUND,
+	/* the number of priority levels */
+	FP_NUM_PRIOS
+};
+#define FIBRE_DEPTH_BUCKETS 16
+/* stack sizes are rounded up to a power of two from 16KiB to 32MiB */
+#define FIBRE_MIN_STACK_SIZE (16ul * 1024)
+#define FIBRE_STACK_CLASSES 12
+/* times are in nanoseconds */
+struct fibre_stats {
+	/* stacks mapped, and stacks reused from the stack pool */
+	long int fstat_stack_allocs;
+	long int fstat_stack_reuses;
+	long int fstat_fibre_go_calls;
+	/* fibres taken from another worker's ready deque */
+	long int fstat_steals;
+	/* times a worker found nothing to do and went to sleep */
+	long int fstat_parks;
+	long int fstat_switches;
+	/* the longest any fibre has run without switching */
+	long int fstat_max_slice_ns;
+	/* how long fibres of each priority were ready before they ran */
+	long int fstat_queue_wait_ns[FP_NUM_PRIOS];
+	long int fstat_queue_waits[FP_NUM_PRIOS];
+	long int fstat_queue_wait_max_ns[FP_NUM_PRIOS];
+	/*
+	 * How deep ready deques were when fibres were put on them: element i
+	 * counts depths from 2^i up to 2^(i+1), and the last element counts
+	 * everything deeper.
+	 */
+	long int fstat_depths[FIBRE_DEPTH_BUCKETS];
+	/* fibres run ahead of higher priorities because they had waited */
+	long int fstat_aged;
+	/* FP_HIGH fibres that waited longer than the latency budget */
+	long int fstat_budget_misses;
+	/* the deepest that a fibre has used a stack of each size class */
+	long int fstat_stack_high_water[FIBRE_STACK_CLASSES];
+};
+/* the share of the statistics belonging to one fibre */
+struct fibre_run_stats {
+	long int frs_run_ns;
+	/* times it has been switched to */
+	long int frs_switches;
+	long int frs_max_slice_ns;
+	/* bytes of its stack that it has touched so far */
+	long int frs_stack_used;
+};
+extern void fibre_init(struct alloc *alloc, size_t stack_size, size_t nworkers);
+extern void fibre_finish(void);
+extern void fibre_return(void);
+extern int fibre_yield(void);
+struct fibre;
+struct fibre_join {
+	void *fj_result;
+	struct fibre *fj_waiter;
+};
+extern void fibre_go(void (*)(void *), void *);
+extern void fibre_go_join(struct fibre_join *, void *(*)(void *), void *);
+extern void fibre_go_sized(void (*)(void *), void *, size_t stack_size);
+extern void fibre_go_join_sized(struct fibre_join *, void *(*)(void *), void *,
+	size_t stack_size);
+extern void *fibre_join(struct fibre_join *);
+extern struct fibre *fibre_self(void);
+extern void fibre_wait(void);
+extern void fibre_wake(struct fibre *);
+extern int fibre_yield_to(struct fibre *);
+/* in nanoseconds, see fibre_set_latency_budget */
+#define FIBRE_DEFAULT_LATENCY_BUDGET 4000000L
+extern void fibre_set_prio(enum fibre_prio);
+extern void fibre_set_latency_budget(long ns);
+extern int fibre_should_yield(void);
+extern int fibre_maybe_yield(void);
+/* times are milliseconds of fibre_clock */
+#define FIBRE_NO_DEADLINE (-1L)
+struct fibre_timer {
+	struct timer ft_timer;
+	void (*ft_func)(void *);
+	void *ft_arg;
+	int ft_state;
+};
+extern long fibre_clock(void);
+extern void fibre_timer_init(struct fibre_timer *);
+extern void fibre_timer_start(struct fibre_timer *, long, void (*)(void *), void *);
+extern int fibre_timer_cancel(struct fibre_timer *);
+extern int fibre_sleep(long ms);
+extern int fibre_sleep_until(long deadline);
+/* returned by cancellation points once the fibre has been cancelled */
+#define FIBRE_CANCELLED (-1)
+struct fibre_cancel_scope {
+	struct fibre_cancel_scope *fcs_parent;
+	struct fibre *fcs_fibre;
+	long fcs_deadline;
+	int fcs_cancelled;
+	int fcs_lock;
+	struct fibre_timer fcs_timer;
+};
+extern void fibre_cancel_scope_init(struct fibre_cancel_scope *, long deadline);
+extern void fibre_cancel_scope_enter(struct fibre_cancel_scope *);
+extern int fibre_cancel_scope_exit(struct fibre_cancel_scope *);
+extern void fibre_cancel(struct fibre_cancel_scope *);
+extern int fibre_cancelled(void);
+extern void fibre_wait_cancellable(void (*)(void *), void *);
+/* fibre-local storage, looked up directly by key */
+#define FIBRE_LOCAL_SLOTS 8
+extern size_t fibre_local_key_create(void (*destructor)(void *));
+extern void *fibre_local_get(size_t key);
+extern void fibre_local_set(size_t key, void *value);
+extern void fibre_get_stats(struct fibre_stats *);
+extern void fibre_get_run_stats(struct fibre *, struct fibre_run_stats *);
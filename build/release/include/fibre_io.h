@@ -0,0 +1,26 @@
+#ifndef VINE_FIBRE_H_INCLUDED
+#error "Must include fibre.h before including fibre_io.h"
+#endif
+#ifdef VINE_FIBRE_IO_H_INCLUDED
+#error "May not include fibre_io.h more than once"
+#endif
+#define VINE_FIBRE_IO_H_INCLUDED
+/*
+ * Waiting for file descriptors without blocking the worker.  A fibre that
+ * waits for a file descriptor sleeps until it is ready, while its worker goes
+ * on running other fibres.  Workers with nothing else to do poll for readiness
+ * instead of going to sleep.  Only one fibre may wait on a given file
+ * descriptor at a time.
+ */
+extern int fibre_wait_readable(int fd);
+extern int fibre_wait_writable(int fd);
+extern ssize_t fibre_read(int fd, void *buf, size_t len);
+extern ssize_t fibre_write(int fd, const void *buf, size_t len);
+/* for the scheduler */
+extern void fibre_io_init(void);
+extern void fibre_io_finish(void);
+extern int fibre_io_waiting(void);
+extern int fibre_io_claim_poller(void);
+extern void fibre_io_release_poller(void);
+extern void fibre_io_poll(int timeout_ms);
+extern void fibre_io_interrupt(void);
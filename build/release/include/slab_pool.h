@@ -0,0 +1,56 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including slab_pool.h"
+#endif
+#ifdef VINE_SLAB_POOL_H_INCLUDED
+#error "May not include slab_pool.h more than once"
+#endif
+#define VINE_SLAB_POOL_H_INCLUDED
+/*
+ * A slab is a power-of-two number of pages, aligned to its own size, with this
+ * header at the start and objects after it.  Objects that have never been
+ * used are handed out from slab_fresh onwards, and destroyed objects are
+ * chained through their first word on slab_free.  Objects destroyed by other
+ * threads are chained the same way on slab_remote, which is pushed onto
+ * atomically, until the pool collects them.
+ */
+struct slab_pool;
+struct slab {
+	struct slab *slab_next, *slab_prev;
+	struct slab_pool *slab_pool;
+	void *slab_free;
+	char *slab_fresh;
+	size_t slab_inuse;
+	void *slab_remote;
+	struct slab *slab_remote_next;
+};
+/*
+ * Each slab is on exactly one of three lists: sp_partial if it has both used
+ * and unused objects, sp_full if it has no unused objects, and sp_empty if it
+ * has no used objects.  Objects come from partial slabs before empty ones, so
+ * that empty slabs stay empty and can be given back.
+ *
+ * A pool is used by one thread at a time, except that any thread may call
+ * slab_object_destroy_remote.  Slabs with objects on slab_remote are on
+ * sp_remote, through slab_remote_next.
+ */
+struct slab_pool {
+	size_t sp_align, sp_size;
+	void (*sp_init)(void *ptr);
+	void (*sp_finish)(void *ptr);
+	/* the size of each slab, and where its first object is */
+	size_t sp_slab_size, sp_first;
+	size_t sp_per_slab;
+	struct slab *sp_partial, *sp_full, *sp_empty;
+	size_t sp_nempty;
+	struct slab *sp_remote;
+	/* slabs mapped and unmapped and objects destroyed remotely over the
+	 * pool's lifetime */
+	long int sp_maps, sp_unmaps, sp_remote_frees;
+};
+extern void slab_pool_init(struct slab_pool *, size_t, size_t, void (*)(void *), void (*)(void *));
+extern void slab_pool_finish(struct slab_pool *);
+extern void *slab_object_create(struct slab_pool *);
+extern void slab_object_destroy(struct slab_pool *, void *);
+extern void slab_object_destroy_remote(struct slab_pool *, void *);
+extern size_t slab_pool_collect(struct slab_pool *);
+extern size_t slab_pool_slab_size(size_t, size_t);
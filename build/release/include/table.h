@@ -0,0 +1,120 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including table.h"
+#endif
+#ifndef VINE_HASH_H_INCLUDED
+#error "Must include hash.h before including table.h"
+#endif
+#ifndef VINE_OBJECT_H_INCLUDED
+#error "Must include object.h before including table.h"
+#endif
+#ifdef VINE_TABLE_H_INCLUDED
+#error "May not include table.h more than once"
+#endif
+#define VINE_TABLE_H_INCLUDED
+struct tkey {
+	union object tk_obj;
+	u64 tk_hash;
+};
+struct tpair {
+	struct tkey tkv_key;
+	union object tkv_value;
+};
+/*
+ * An open-addressed hash table.  t_ctrl has a byte for each of the
+ * t_capacity slots in t_pairs, saying whether the slot is in use, see
+ * table.c.
+ *
+ * A table with at least t_incremental_min slots grows incrementally: the
+ * t_old_ slots are kept until every key in them has been moved, from
+ * t_old_next onwards, a few at a time.  t_incremental_min can be set to
+ * SIZE_MAX after table_init to always grow all at once.
+ */
+#define TABLE_INCREMENTAL_MIN 16384ul
+struct table {
+	size_t t_size, t_capacity;
+	u8 *t_ctrl;
+	struct tpair *t_pairs;
+	struct alloc *t_alloc;
+	u8 *t_old_ctrl;
+	struct tpair *t_old_pairs;
+	size_t t_old_capacity, t_old_next;
+	size_t t_incremental_min;
+};
+extern struct table *table_create(struct alloc *, size_t initial_size);
+extern void table_finish(struct table *table);
+extern void table_destroy(struct table *table);
+extern void table_init(struct table *table, struct alloc *alloc, size_t initial_size);
+extern int table_equal(struct table *, struct table *);
+extern int table_remove(struct table *, struct tkey);
+extern struct table *table_build_from_pairs(struct alloc *, const struct tpair *, size_t);
+/* see table_cursor_init */
+struct table_cursor {
+	struct table *tc_table;
+	u64 tc_next;
+	int tc_done;
+	struct tkey *tc_keys;
+	size_t tc_nkeys, tc_capkeys, tc_key;
+};
+extern void table_cursor_init(struct table_cursor *, struct table *);
+extern void table_cursor_finish(struct table_cursor *);
+extern int table_cursor_next(struct table_cursor *, struct tkey *, union object *);
+/* getting values from a table may fail for two reasons:
+ * - the key might be missing
+ * - the value might be of a different type
+ * in the first case, table_try_get_XXX returns -1
+ * in the second case, table_try_get_XXX returns the type that IS there
+ */
+extern int table_try_get_u8(struct table *, struct tkey, u8 *);
+extern int table_try_get_u16(struct table *, struct tkey, u16 *);
+extern int table_try_get_u32(struct table *, struct tkey, u32 *);
+extern int table_try_get_u64(struct table *, struct tkey, u64 *);
+extern int table_try_get_z8(struct table *, struct tkey, z8 *);
+extern int table_try_get_z16(struct table *, struct tkey, z16 *);
+extern int table_try_get_z32(struct table *, struct tkey, z32 *);
+extern int table_try_get_z64(struct table *, struct tkey, z64 *);
+extern int table_try_get_int(struct table *, struct tkey, int *);
+extern int table_try_get_cstr(struct table *, struct tkey, const char **);
+extern u8  table_get_u8(struct table *, struct tkey);
+extern u16 table_get_u16(struct table *, struct tkey);
+extern u32 table_get_u32(struct table *, struct tkey);
+extern u64 table_get_u64(struct table *, struct tkey);
+extern z8  table_get_z8(struct table *, struct tkey);
+extern z16 table_get_z16(struct table *, struct tkey);
+extern z32 table_get_z32(struct table *, struct tkey);
+extern z64 table_get_z64(struct table *, struct tkey);
+extern int table_get_int(struct table *, struct tkey);
+extern const char *table_get_cstr(struct table *, struct tkey);
+extern void table_set_u8(struct table *, struct tkey, u8);
+extern void table_set_u16(struct table *, struct tkey, u16);
+extern void table_set_u32(struct table *, struct tkey, u32);
+extern void table_set_u64(struct table *, struct tkey, u64);
+extern void table_set_z8(struct table *, struct tkey, z8);
+extern void table_set_z16(struct table *, struct tkey, z16);
+extern void table_set_z32(struct table *, struct tkey, z32);
+extern void table_set_z64(struct table *, struct tkey, z64);
+extern void table_set_int(struct table *, struct tkey, int);
+extern void table_set_cstr(struct table *, struct tkey, const char *);
+extern struct tkey table_key_u8(u8);
+extern struct tkey table_key_u16(u16);
+extern struct tkey table_key_u32(u32);
+extern struct tkey table_key_u64(u64);
+extern struct tkey table_key_z8(z8);
+extern struct tkey table_key_z16(z16);
+extern struct tkey table_key_z32(z32);
+extern struct tkey table_key_z64(z64);
+extern struct tkey table_key_int(int);
+extern struct tkey table_key_cstr(const char *);
+extern struct tkey table_key(union object);
+struct table_object {
+	struct object_vtable *to_vtable;
+	struct table to_table;
+};
+extern void table_object_init(struct table_object *, struct alloc *, size_t);
+extern void object_init_as_table(union object *, struct alloc *, size_t);
+extern union object object_from_table(struct alloc *, size_t);
+extern int vobject_is_table(struct object_vtable **);
+extern int object_is_table(union object *);
+extern struct table *vobject_as_table(struct object_vtable **);
+extern struct table *object_as_table(union object *);
+extern int vobject_try_as_table(struct object_vtable **, struct table **);
+extern int object_try_as_table(union object *, struct table **);
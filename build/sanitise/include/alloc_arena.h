@@ -0,0 +1,41 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including alloc_arena.h"
+#endif
+#ifdef VINE_ALLOC_ARENA_H_INCLUDED
+#error "May not include alloc_arena.h more than once"
+#endif
+#define VINE_ALLOC_ARENA_H_INCLUDED
+/*
+ * An arena hands out memory by bumping a pointer through a chain of blocks,
+ * and takes it all back at once, either by rewinding to a mark or by being
+ * reset.  Only the most recent allocation can be grown in place or given back
+ * on its own: deallocating anything else does nothing until the arena is
+ * rewound past it.
+ *
+ * Blocks are kept when the arena is rewound, so that an arena used for the
+ * same job over and over settles down to never mapping anything.  Memory is
+ * not zeroed, and an arena must only be used by one thread at a time.
+ */
+struct arena_block;
+struct arena_alloc {
+	struct alloc aa_alloc;
+	/* the first block, and the one being allocated from */
+	struct arena_block *aa_first, *aa_block;
+	char *aa_cur, *aa_end;
+	/* the most recent allocation, or NULL */
+	char *aa_last;
+	size_t aa_block_size;
+};
+/* everything allocated after a mark is freed by rewinding to it */
+struct arena_mark {
+	struct arena_block *am_block;
+	char *am_cur;
+};
+extern void arena_alloc_init(struct arena_alloc *, size_t block_size);
+extern void arena_alloc_finish(struct arena_alloc *);
+extern void arena_mark(struct arena_alloc *, struct arena_mark *);
+extern void arena_rewind(struct arena_alloc *, struct arena_mark *);
+extern void arena_reset(struct arena_alloc *);
+extern void arena_trim(struct arena_alloc *);
+extern struct arena_alloc *arena_fibre_default(void);
+extern void arena_set_fibre_default(struct arena_alloc *);
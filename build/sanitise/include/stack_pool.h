@@ -0,0 +1,39 @@
+#ifndef VINE_ALLOC_H_INCLUDED
+#error "Must include alloc.h before including stack_pool.h"
+#endif
+#ifdef VINE_STACK_POOL_H_INCLUDED
+#error "May not include stack_pool.h more than once"
+#endif
+#define VINE_STACK_POOL_H_INCLUDED
+/*
+ * A pool of fibre stacks of one size.  Every stack has a guard page below it,
+ * so that running off the end of a stack faults instead of scribbling over
+ * whatever is mapped next to it.  Stacks are carved out of large mappings, and
+ * only take memory for the pages that are actually touched.  Stacks given back
+ * to the pool keep their address space for reuse, but their pages are handed
+ * back to the kernel.
+ */
+struct stack_chunk;
+struct stack_pool {
+	size_t stp_size;
+	size_t stp_guard;
+	struct alloc *stp_alloc;
+	char **stp_free;
+	size_t stp_nfree, stp_capfree;
+	/* the mappings stacks are carved from, and the uncarved part of the
+	 * newest one */
+	struct stack_chunk *stp_chunks;
+	char *stp_next, *stp_end;
+	/* the number of stacks carved, and how many times one was reused */
+	long int stp_maps, stp_reuses;
+	/* the most of any stack that was in use when it was put back, of
+	 * those that were measured, see stack_pool_put */
+	size_t stp_high_water;
+	unsigned long stp_puts;
+	pthread_mutex_t stp_lock;
+};
+extern void stack_pool_init(struct stack_pool *, struct alloc *, size_t);
+extern void stack_pool_finish(struct stack_pool *);
+extern char *stack_pool_get(struct stack_pool *);
+extern void stack_pool_put(struct stack_pool *, char *);
+extern size_t stack_pool_used(struct stack_pool *, char *);
@@ -10,7 +10,9 @@ struct alloc {
 };
 extern struct alloc sys_alloc;
 extern struct alloc mmap_alloc;
+extern struct alloc thread_alloc;
 extern void *allocate_with(struct alloc *, size_t);
+extern void *allocate_zeroed_with(struct alloc *, size_t);
 extern void *reallocate_with(struct alloc *, void *, size_t, size_t);
 extern void *try_allocate_with(struct alloc *, size_t);
 extern void *try_reallocate_with(struct alloc *, void *, size_t, size_t);
@@ -0,0 +1,39 @@
+//require alloc.h
+//provide alloc_stats.h
+/*
+ * Wraps another allocator and counts what goes through it, so that each
+ * subsystem can be given its own stats_alloc and be held to account for its
+ * share of memory.  Counters are updated with relaxed atomics, so it can be
+ * left on in production builds.  Bucket i of the histogram holds allocations
+ * of more than 2^(i-1) and at most 2^i bytes, and the last holds everything
+ * bigger.
+ *
+ * Optionally, allocations are also counted by call site, which is the first
+ * STATS_ALLOC_SITE_DEPTH return addresses above the allocator.  This needs a
+ * backtrace for every allocation, so it is only for tracking something down.
+ */
+#define STATS_ALLOC_BUCKETS 24
+#define STATS_ALLOC_SITE_DEPTH 4
+#define STATS_ALLOC_SITES 256
+struct stats_alloc_site {
+	void *sas_frames[STATS_ALLOC_SITE_DEPTH];
+	long int sas_allocs;
+	long int sas_bytes;
+};
+struct stats_alloc {
+	struct alloc sta_alloc;
+	struct alloc *sta_inner;
+	const char *sta_name;
+	long int sta_live, sta_peak;
+	long int sta_allocs, sta_deallocs, sta_reallocs, sta_failures;
+	long int sta_bucket_allocs[STATS_ALLOC_BUCKETS];
+	long int sta_bucket_live[STATS_ALLOC_BUCKETS];
+	long int sta_started_ns;
+	/* NULL unless call sites are being counted */
+	struct stats_alloc_site *sta_sites;
+	long int sta_sites_dropped;
+	pthread_mutex_t sta_sites_lock;
+};
+extern void stats_alloc_init(struct stats_alloc *, struct alloc *inner, const char *name, int track_sites);
+extern void stats_alloc_finish(struct stats_alloc *);
+extern void stats_alloc_report(struct stats_alloc *);
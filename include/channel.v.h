@@ -0,0 +1,42 @@
+//require slab_pool.h
+//provide channel.h
+/*
+ * A channel carries fixed-size messages from fibres to fibres, in order.  A
+ * bounded channel holds at most its capacity of messages and senders wait for
+ * room when it is full; an unbounded one never makes senders wait.  Receivers
+ * wait for a message when it is empty.  Messages are buffered in segments
+ * allocated from a slab pool belonging to the channel.
+ */
+#define CHANNEL_UNBOUNDED ((size_t)-1)
+enum channel_status {
+	CHANNEL_OK,
+	CHANNEL_CLOSED,
+	CHANNEL_TIMEDOUT,
+	CHANNEL_CANCELLED
+};
+struct channel_segment;
+struct channel_waiter;
+struct channel_waitq {
+	struct channel_waiter *cwq_head, *cwq_tail;
+};
+struct channel {
+	size_t ch_elem_size;
+	size_t ch_capacity;
+	/* the number of messages in one segment */
+	size_t ch_seg_slots;
+	size_t ch_count;
+	/* messages are taken from the head segment and added to the tail */
+	struct channel_segment *ch_head, *ch_tail;
+	size_t ch_head_pos, ch_tail_pos;
+	struct slab_pool ch_segments;
+	struct channel_waitq ch_senders, ch_receivers;
+	int ch_closed;
+	pthread_mutex_t ch_lock;
+};
+extern void channel_init(struct channel *, size_t elem_size, size_t capacity);
+extern void channel_finish(struct channel *);
+extern int channel_send(struct channel *, const void *);
+extern size_t channel_recv(struct channel *, void *, size_t);
+extern int channel_send_until(struct channel *, const void *, long deadline);
+extern int channel_recv_until(struct channel *, void *, size_t, size_t *, long deadline);
+extern void channel_close(struct channel *);
@@ -1,3 +1,5 @@
 //provide fibre_switch.h
 struct fibre_ctx;
 extern void fibre_switch(struct fibre_ctx *old, struct fibre_ctx *new);
+extern void fibre_save_fpu(struct fibre_ctx *ctx);
+extern void fibre_entry(void);
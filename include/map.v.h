@@ -0,0 +1,76 @@
+//require alloc.h
+//require hash.h
+//require object.h
+//require table.h
+//provide map.h
+/*
+ * A persistent hash map: a hash array mapped trie whose nodes never change
+ * once they are made.  Changing a map makes new copies of the nodes on the
+ * path to the key, O(log32 n) of them, and shares every other node with the
+ * map it was changed from.  So map_copy takes a snapshot in O(1), and a
+ * snapshot can be read from any thread while the map goes on changing.
+ *
+ * A struct map is a handle on a root node, and map_set_XXX and map_remove
+ * move the handle to a new root.  Nodes are reference counted, and m_alloc
+ * must be safe to use from every thread that has a copy.  Like a table, a map
+ * does not own the objects in it.
+ */
+struct map_node;
+struct map {
+	struct map_node *m_root;
+	size_t m_size;
+	struct alloc *m_alloc;
+	/* the hash is only worked out when it is needed; see map_hash */
+	u64 m_hash;
+	int m_hashed;
+};
+extern void map_init(struct map *, struct alloc *);
+extern void map_finish(struct map *);
+extern void map_copy(struct map *, struct map *);
+extern int map_equal(struct map *, struct map *);
+extern u64 map_hash(struct map *);
+extern int map_try_get(struct map *, struct tkey, union object *);
+extern void map_set(struct map *, struct tkey, union object);
+extern int map_remove(struct map *, struct tkey);
+/* see table_try_get_XXX */
+extern int map_try_get_u8(struct map *, struct tkey, u8 *);
+extern int map_try_get_u16(struct map *, struct tkey, u16 *);
+extern int map_try_get_u32(struct map *, struct tkey, u32 *);
+extern int map_try_get_u64(struct map *, struct tkey, u64 *);
+extern int map_try_get_z8(struct map *, struct tkey, z8 *);
+extern int map_try_get_z16(struct map *, struct tkey, z16 *);
+extern int map_try_get_z32(struct map *, struct tkey, z32 *);
+extern int map_try_get_z64(struct map *, struct tkey, z64 *);
+extern int map_try_get_int(struct map *, struct tkey, int *);
+extern int map_try_get_cstr(struct map *, struct tkey, const char **);
+extern u8  map_get_u8(struct map *, struct tkey);
+extern u16 map_get_u16(struct map *, struct tkey);
+extern u32 map_get_u32(struct map *, struct tkey);
+extern u64 map_get_u64(struct map *, struct tkey);
+extern z8  map_get_z8(struct map *, struct tkey);
+extern z16 map_get_z16(struct map *, struct tkey);
+extern z32 map_get_z32(struct map *, struct tkey);
+extern z64 map_get_z64(struct map *, struct tkey);
+extern int map_get_int(struct map *, struct tkey);
+extern const char *map_get_cstr(struct map *, struct tkey);
+extern void map_set_u8(struct map *, struct tkey, u8);
+extern void map_set_u16(struct map *, struct tkey, u16);
+extern void map_set_u32(struct map *, struct tkey, u32);
+extern void map_set_u64(struct map *, struct tkey, u64);
+extern void map_set_z8(struct map *, struct tkey, z8);
+extern void map_set_z16(struct map *, struct tkey, z16);
+extern void map_set_z32(struct map *, struct tkey, z32);
+extern void map_set_z64(struct map *, struct tkey, z64);
+extern void map_set_int(struct map *, struct tkey, int);
+extern void map_set_cstr(struct map *, struct tkey, const char *);
+struct map_object {
+	struct object_vtable *mo_vtable;
+	struct map mo_map;
+};
+extern void object_init_as_map(union object *, struct map *);
+extern int vobject_is_map(struct object_vtable **);
+extern int object_is_map(union object *);
+extern struct map *vobject_as_map(struct object_vtable **);
+extern struct map *object_as_map(union object *);
+extern int vobject_try_as_map(struct object_vtable **, struct map **);
+extern int object_try_as_map(union object *, struct map **);
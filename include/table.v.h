@@ -10,16 +10,45 @@ struct tpair {
 	struct tkey tkv_key;
 	union object tkv_value;
 };
+/*
+ * An open-addressed hash table.  t_ctrl has a byte for each of the
+ * t_capacity slots in t_pairs, saying whether the slot is in use, see
+ * table.c.
+ *
+ * A table with at least t_incremental_min slots grows incrementally: the
+ * t_old_ slots are kept until every key in them has been moved, from
+ * t_old_next onwards, a few at a time.  t_incremental_min can be set to
+ * SIZE_MAX after table_init to always grow all at once.
+ */
+#define TABLE_INCREMENTAL_MIN 16384ul
 struct table {
 	size_t t_size, t_capacity;
+	u8 *t_ctrl;
 	struct tpair *t_pairs;
 	struct alloc *t_alloc;
+	u8 *t_old_ctrl;
+	struct tpair *t_old_pairs;
+	size_t t_old_capacity, t_old_next;
+	size_t t_incremental_min;
 };
 extern struct table *table_create(struct alloc *, size_t initial_size);
 extern void table_finish(struct table *table);
 extern void table_destroy(struct table *table);
 extern void table_init(struct table *table, struct alloc *alloc, size_t initial_size);
 extern int table_equal(struct table *, struct table *);
+extern int table_remove(struct table *, struct tkey);
+extern struct table *table_build_from_pairs(struct alloc *, const struct tpair *, size_t);
+/* see table_cursor_init */
+struct table_cursor {
+	struct table *tc_table;
+	u64 tc_next;
+	int tc_done;
+	struct tkey *tc_keys;
+	size_t tc_nkeys, tc_capkeys, tc_key;
+};
+extern void table_cursor_init(struct table_cursor *, struct table *);
+extern void table_cursor_finish(struct table_cursor *);
+extern int table_cursor_next(struct table_cursor *, struct tkey *, union object *);
 /* getting values from a table may fail for two reasons:
  * - the key might be missing
  * - the value might be of a different type
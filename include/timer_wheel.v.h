@@ -0,0 +1,32 @@
+//provide timer_wheel.h
+/*
+ * A hierarchical timing wheel.  Time is measured in whole ticks.  Each level
+ * has TIMER_WHEEL_SLOTS slots, and each slot of a level spans as many ticks as
+ * the whole of the level below it.  Timers sit in the lowest level that can
+ * hold them, and are moved down a level each time the level below comes round
+ * to them.  Adding and removing a timer is O(1), and so is expiry, amortised
+ * over the ticks that pass.
+ *
+ * Timers are intrusive, and the wheel does no locking of its own.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1ul << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 6
+struct timer {
+	struct timer *tm_next, *tm_prev;
+	unsigned long tm_expires;
+};
+struct timer_wheel {
+	/* every tick before this one has been expired */
+	unsigned long tw_now;
+	size_t tw_count;
+	/* which slots of each level have any timers in them */
+	unsigned long tw_occupied[TIMER_WHEEL_LEVELS];
+	/* the heads of circular lists */
+	struct timer tw_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+extern void timer_wheel_init(struct timer_wheel *, unsigned long now);
+extern void timer_wheel_add(struct timer_wheel *, struct timer *);
+extern void timer_wheel_remove(struct timer_wheel *, struct timer *);
+extern struct timer *timer_wheel_advance(struct timer_wheel *, unsigned long now);
+extern int timer_wheel_next(struct timer_wheel *, unsigned long *);
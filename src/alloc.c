@@ -26,6 +26,20 @@ try_allocate_with(struct alloc *alloc, size_t m)
 	return alloc->alloc_vtable->avt_allocate(alloc, m);
 }
 
+/*
+ * Not every allocator zeroes what it hands out, and zeroing memory that is
+ * about to be overwritten anyway is wasted work, so callers that need zeroes
+ * must ask for them.
+ */
+void *
+allocate_zeroed_with(struct alloc *alloc, size_t m)
+{
+	void *p = allocate_with(alloc, m);
+
+	memset(p, 0, m);
+	return p;
+}
+
 void *
 reallocate_with(struct alloc *alloc, void *q, size_t m, size_t n)
 {
@@ -0,0 +1,245 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "abort.h"
+#include "checked.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "alloc_arena.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+
+#define ARENA_ALIGN 16
+
+/*
+ * Blocks are chained in both directions: back so that a rewind knows where it
+ * is, and forward so that blocks kept after a rewind can be used again.
+ */
+struct arena_block {
+	struct arena_block *ab_prev, *ab_next;
+	size_t ab_size;
+};
+#define ARENA_BLOCK_HEADER_SIZE \
+	((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static
+char *
+arena_block_data(struct arena_block *block)
+{
+	return (char *)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+static
+char *
+arena_block_end(struct arena_block *block)
+{
+	return (char *)block + block->ab_size;
+}
+
+/*
+ * Moves on to a block with room for 'm' bytes: the next block if it is big
+ * enough, or else a new block put in before it.
+ */
+static
+void
+arena_next_block(struct arena_alloc *aa, size_t m)
+{
+	struct arena_block *next = aa->aa_block->ab_next;
+	size_t size;
+
+	if (next == NULL ||
+			(size_t)(arena_block_end(next) - arena_block_data(next)) < m) {
+		size = align_sz(add_sz(m, ARENA_BLOCK_HEADER_SIZE), PAGE_SIZE);
+		if (size < aa->aa_block_size) {
+			size = aa->aa_block_size;
+		}
+		next = allocate_with(&mmap_alloc, size);
+		next->ab_size = size;
+		next->ab_prev = aa->aa_block;
+		next->ab_next = aa->aa_block->ab_next;
+		if (next->ab_next != NULL) {
+			next->ab_next->ab_prev = next;
+		}
+		aa->aa_block->ab_next = next;
+		log_debug("alloc_arena", "Mapped a %lu byte block at %p\n",
+			size, (void *)next);
+	}
+
+	aa->aa_block = next;
+	aa->aa_cur = arena_block_data(next);
+	aa->aa_end = arena_block_end(next);
+}
+
+static
+void *
+arena_allocate(struct alloc *alloc, size_t m)
+{
+	struct arena_alloc *aa = (struct arena_alloc *)alloc;
+
+	m = align_sz(m, ARENA_ALIGN);
+	if ((size_t)(aa->aa_end - aa->aa_cur) < m) {
+		arena_next_block(aa, m);
+	}
+	aa->aa_last = aa->aa_cur;
+	aa->aa_cur += m;
+	return aa->aa_last;
+}
+
+static
+void *
+arena_reallocate(struct alloc *alloc, void *q, size_t m, size_t n)
+{
+	struct arena_alloc *aa = (struct arena_alloc *)alloc;
+	char *p;
+
+	if (q == aa->aa_last) {
+		if ((size_t)(aa->aa_end - aa->aa_last) >= align_sz(n, ARENA_ALIGN)) {
+			aa->aa_cur = aa->aa_last + align_sz(n, ARENA_ALIGN);
+			return q;
+		}
+	} else if (n <= m) {
+		return q;
+	}
+	p = arena_allocate(alloc, n);
+	memcpy(p, q, m < n ? m : n);
+	return p;
+}
+
+static
+void
+arena_deallocate(struct alloc *alloc, void *p, size_t n)
+{
+	struct arena_alloc *aa = (struct arena_alloc *)alloc;
+
+	(void)n;
+	if (p == aa->aa_last) {
+		aa->aa_cur = aa->aa_last;
+		aa->aa_last = NULL;
+	}
+}
+
+static
+struct alloc_vtable
+arena_alloc_vtable = {
+	&arena_allocate,
+	&arena_reallocate,
+	&arena_deallocate
+};
+
+/*
+ * Blocks are mapped 'block_size' bytes at a time, rounded up to a whole
+ * number of pages, or bigger if a single allocation needs it.
+ */
+void
+arena_alloc_init(struct arena_alloc *aa, size_t block_size)
+{
+	aa->aa_alloc.alloc_vtable = &arena_alloc_vtable;
+	aa->aa_block_size = align_sz(block_size, PAGE_SIZE);
+	aa->aa_first = allocate_with(&mmap_alloc, aa->aa_block_size);
+	aa->aa_first->ab_prev = NULL;
+	aa->aa_first->ab_next = NULL;
+	aa->aa_first->ab_size = aa->aa_block_size;
+	arena_reset(aa);
+}
+
+void
+arena_alloc_finish(struct arena_alloc *aa)
+{
+	struct arena_block *block = aa->aa_first;
+
+	while (block != NULL) {
+		struct arena_block *next = block->ab_next;
+		deallocate_with(&mmap_alloc, block, block->ab_size);
+		block = next;
+	}
+}
+
+void
+arena_mark(struct arena_alloc *aa, struct arena_mark *mark)
+{
+	mark->am_block = aa->aa_block;
+	mark->am_cur = aa->aa_cur;
+}
+
+/*
+ * Frees everything allocated since 'mark', which must have been taken since
+ * the arena was last reset or rewound to an earlier mark.  Marks nest, so
+ * rewinding to one mark and then to an earlier one is fine, but not the other
+ * way around.
+ */
+void
+arena_rewind(struct arena_alloc *aa, struct arena_mark *mark)
+{
+	aa->aa_block = mark->am_block;
+	aa->aa_cur = mark->am_cur;
+	aa->aa_end = arena_block_end(mark->am_block);
+	aa->aa_last = NULL;
+}
+
+/*
+ * Frees everything in the arena at once.  However many blocks have been used,
+ * this takes the same time, as the blocks are kept for reuse.
+ */
+void
+arena_reset(struct arena_alloc *aa)
+{
+	aa->aa_block = aa->aa_first;
+	aa->aa_cur = arena_block_data(aa->aa_first);
+	aa->aa_end = arena_block_end(aa->aa_first);
+	aa->aa_last = NULL;
+}
+
+/*
+ * Gives back the blocks beyond the one being allocated from, for after a
+ * reset that followed unusually heavy use.
+ */
+void
+arena_trim(struct arena_alloc *aa)
+{
+	struct arena_block *block = aa->aa_block->ab_next;
+
+	aa->aa_block->ab_next = NULL;
+	while (block != NULL) {
+		struct arena_block *next = block->ab_next;
+		log_debug("alloc_arena", "Unmapping the block at %p\n",
+			(void *)block);
+		deallocate_with(&mmap_alloc, block, block->ab_size);
+		block = next;
+	}
+}
+
+/*
+ * Each fibre can have a default arena, for temporaries that code deep inside
+ * some job can allocate without the arena being passed all the way down.  It
+ * is kept in fibre-local storage, so a new fibre starts without one.  The
+ * arena still belongs to whoever set it, and is not touched when the fibre
+ * returns.
+ */
+static pthread_once_t arena_fibre_once = PTHREAD_ONCE_INIT;
+static size_t arena_fibre_key;
+
+static
+void
+arena_fibre_key_create(void)
+{
+	arena_fibre_key = fibre_local_key_create(NULL);
+}
+
+struct arena_alloc *
+arena_fibre_default(void)
+{
+	pthread_once(&arena_fibre_once, &arena_fibre_key_create);
+	return fibre_local_get(arena_fibre_key);
+}
+
+void
+arena_set_fibre_default(struct arena_alloc *aa)
+{
+	pthread_once(&arena_fibre_once, &arena_fibre_key_create);
+	fibre_local_set(arena_fibre_key, aa);
+}
@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,60 +14,223 @@
 #include "eprintf.h"
 #include "abort.h"
 #include "alloc.h"
+#include "alloc_mmap.h"
 #include "log.h"
+#include "checked.h"
 
-static void *
-mmap_allocate(struct alloc *a, size_t m)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* the settings used for mmap_alloc, which is a plain struct alloc */
+static
+struct page_alloc
+mmap_page_alloc = {{NULL}, 0, 0};
+
+static
+struct page_alloc *
+page_alloc_of(struct alloc *a)
+{
+	if (a == &mmap_alloc) {
+		return &mmap_page_alloc;
+	}
+	return (struct page_alloc *)a;
+}
+
+static
+int
+page_alloc_is_huge(struct page_alloc *pa, size_t n)
+{
+	return (pa->pa_flags & (PAGE_ALLOC_HUGETLB|PAGE_ALLOC_THP)) != 0 &&
+		n >= pa->pa_huge_min;
+}
+
+/*
+ * The size of the mapping made for 'n' bytes.  Deallocation is only given the
+ * size that was asked for, so this must depend on nothing else.
+ */
+size_t
+page_alloc_size(struct page_alloc *pa, size_t n)
+{
+	if (n == 0) {
+		n = 1;
+	}
+	if (page_alloc_is_huge(pa, n)) {
+		return align_sz(n, HUGE_PAGE_SIZE);
+	}
+	return align_sz(n, PAGE_SIZE);
+}
+
+/*
+ * Maps 'size' bytes, aligned to a huge page if transparent huge pages are
+ * wanted, by mapping a huge page more than needed and trimming either side.
+ */
+static
+char *
+page_map(struct page_alloc *pa, size_t size, int huge)
 {
-	void *p;
-	p = mmap(NULL, m, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
-		-1, 0);
+	int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+	size_t extra = 0;
+	char *p, *aligned;
+
+	if (pa->pa_flags & PAGE_ALLOC_POPULATE) {
+		flags |= MAP_POPULATE;
+	}
+	if (huge && (pa->pa_flags & PAGE_ALLOC_HUGETLB)) {
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE, flags|MAP_HUGETLB,
+			-1, 0);
+		if (p != MAP_FAILED) {
+			return p;
+		}
+		/* usually because no huge pages have been set aside */
+		log_debug("alloc_mmap", "Could not map %lu bytes of huge pages: "
+			"%s\n", size, strerror(errno));
+	}
+	if (huge && (pa->pa_flags & PAGE_ALLOC_THP)) {
+		extra = HUGE_PAGE_SIZE - PAGE_SIZE;
+	}
+
+	p = mmap(NULL, size + extra, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) {
+		log_warning("alloc_mmap", "Could not map %lu bytes: %s\n",
+			size, strerror(errno));
+		return NULL;
+	}
+	if (extra == 0) {
+		return p;
+	}
+
+	aligned = align_ptr(p, HUGE_PAGE_SIZE);
+	if (aligned != p) {
+		munmap(p, (size_t)(aligned - p));
+	}
+	if (aligned + size != p + size + extra) {
+		munmap(aligned + size, (size_t)(p + extra - aligned));
+	}
+	if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+		log_debug("alloc_mmap", "Could not ask for huge pages at %p: "
+			"%s\n", (void *)aligned, strerror(errno));
+	}
+	return aligned;
+}
+
+static
+void *
+page_allocate(struct alloc *a, size_t m)
+{
+	struct page_alloc *pa = page_alloc_of(a);
+	size_t size = page_alloc_size(pa, m);
+	void *p = page_map(pa, size, page_alloc_is_huge(pa, m));
+
+	if (p == NULL) {
+		return NULL;
+	}
 #ifdef USE_VALGRIND
 	VALGRIND_MALLOCLIKE_BLOCK(p, m, 0, 0);
 #endif
-	log_debug("alloc_mmap", "Allocating %lu bytes at %p\n", m, p);
-	(void)a;
+	log_debug("alloc_mmap", "Allocating %lu bytes at %p\n", size, p);
 	return p;
 }
 
-static void *
-mmap_reallocate(struct alloc *a, void *q, size_t m, size_t n)
+static
+void
+page_unmap(void *p, size_t size)
+{
+	if (munmap(p, size) != 0) {
+		abort_with_error("munmap failed with arguments %p and %lu\n",
+			p, size);
+	}
+}
+
+/*
+ * Mappings are grown or shrunk in place if there is room, and otherwise moved,
+ * which only rewrites page tables.  A mapping that mremap will not resize,
+ * like one of huge pages resized to a size that is not a whole number of huge
+ * pages, is copied instead.
+ */
+static
+void *
+page_reallocate(struct alloc *a, void *q, size_t m, size_t n)
 {
-	void *p = mremap(q, m, n, 0 /* |MREMAP_MAYMOVE */);
+	struct page_alloc *pa = page_alloc_of(a);
+	size_t old_size = page_alloc_size(pa, m);
+	size_t new_size = page_alloc_size(pa, n);
+	char *p;
+
+	if (old_size == new_size) {
 #ifdef USE_VALGRIND
-	VALGRIND_RESIZEINPLACE_BLOCK(p, m, n, 0);
+		VALGRIND_RESIZEINPLACE_BLOCK(q, m, n, 0);
+#endif
+		return q;
+	}
+
+	p = mremap(q, old_size, new_size, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED) {
+		log_debug("alloc_mmap", "Could not remap %lu bytes at %p to %lu "
+			"bytes: %s\n", old_size, q, new_size, strerror(errno));
+		p = page_map(pa, new_size, page_alloc_is_huge(pa, n));
+		if (p == NULL) {
+			return NULL;
+		}
+		memcpy(p, q, m < n ? m : n);
+		page_unmap(q, old_size);
+	} else if (new_size > old_size) {
+		if (page_alloc_is_huge(pa, n) && (pa->pa_flags & PAGE_ALLOC_THP)) {
+			madvise(p, new_size, MADV_HUGEPAGE);
+		}
+		if (pa->pa_flags & PAGE_ALLOC_POPULATE) {
+			/* older kernels do not have this, and that is fine */
+			madvise(p + old_size, new_size - old_size,
+				MADV_POPULATE_WRITE);
+		}
+	}
+#ifdef USE_VALGRIND
+	if (p == q) {
+		VALGRIND_RESIZEINPLACE_BLOCK(q, m, n, 0);
+	} else {
+		VALGRIND_FREELIKE_BLOCK(q, 0);
+		VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+	}
 #endif
-	(void)a;
 	log_debug("alloc_mmap", "Reallocating %lu -> %lu bytes at %p to %p\n",
-		m, n, q, p);
+		old_size, new_size, q, (void *)p);
 	return p;
 }
 
-static void
-mmap_deallocate(struct alloc *a, void *p, size_t n)
+static
+void
+page_deallocate(struct alloc *a, void *p, size_t n)
 {
-	int r;
-	log_debug("alloc_mmap", "Deallocating %lu bytes at %p\n", n, p);
-	r = munmap(p, n);
+	struct page_alloc *pa = page_alloc_of(a);
+	size_t size = page_alloc_size(pa, n);
+
+	log_debug("alloc_mmap", "Deallocating %lu bytes at %p\n", size, p);
+	page_unmap(p, size);
 #ifdef USE_VALGRIND
 	VALGRIND_FREELIKE_BLOCK(p, 0);
 #endif
-	if (r != 0) {
-		abort_with_error(
-			"munmap failed with arguments %p and %lu",
-			p,
-			n);
-	}
-	(void)a;
 }
 
 static
 struct alloc_vtable
-mmap_alloc_vtable = {
-	&mmap_allocate,
-	&mmap_reallocate,
-	&mmap_deallocate
+page_alloc_vtable = {
+	&page_allocate,
+	&page_reallocate,
+	&page_deallocate
 };
 
+/*
+ * 'flags' is any of the PAGE_ALLOC_ flags, and 'huge_min' is the smallest
+ * allocation to use huge pages for, which should be at least HUGE_PAGE_SIZE,
+ * since anything smaller would be rounded up to one.
+ */
+void
+page_alloc_init(struct page_alloc *pa, int flags, size_t huge_min)
+{
+	pa->pa_alloc.alloc_vtable = &page_alloc_vtable;
+	pa->pa_flags = flags;
+	pa->pa_huge_min = huge_min;
+}
+
 struct alloc
-mmap_alloc = {&mmap_alloc_vtable};
+mmap_alloc = {&page_alloc_vtable};
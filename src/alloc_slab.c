@@ -0,0 +1,141 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "slab_pool.h"
+#include "alloc_slab.h"
+
+/* the classes up to here go up in steps of 16 */
+#define SLAB_ALLOC_SMALL_MAX 128ul
+#define SLAB_ALLOC_SMALL_CLASSES 8
+#define SLAB_ALLOC_STEPS_LOG2 2
+
+/*
+ * Returns the index of the smallest class holding 'n' bytes, which must be at
+ * most SLAB_ALLOC_MAX_SIZE.
+ */
+size_t
+slab_alloc_class(size_t n)
+{
+	size_t p, step;
+
+	if (n <= SLAB_ALLOC_SMALL_MAX) {
+		return n == 0 ? 0 : (n - 1) / 16;
+	}
+	/* 2^p < n <= 2^(p+1), split into four steps */
+	p = (size_t)(63 - __builtin_clzl(n - 1));
+	step = 1ul << (p - SLAB_ALLOC_STEPS_LOG2);
+	return SLAB_ALLOC_SMALL_CLASSES + ((p - 7) << SLAB_ALLOC_STEPS_LOG2)
+		+ (n - (1ul << p) - 1) / step;
+}
+
+size_t
+slab_alloc_class_size(size_t class)
+{
+	size_t p, k;
+
+	if (class < SLAB_ALLOC_SMALL_CLASSES) {
+		return (class + 1) * 16;
+	}
+	class -= SLAB_ALLOC_SMALL_CLASSES;
+	p = 7 + (class >> SLAB_ALLOC_STEPS_LOG2);
+	k = class & ((1ul << SLAB_ALLOC_STEPS_LOG2) - 1);
+	return (1ul << p) + ((k + 1) << (p - SLAB_ALLOC_STEPS_LOG2));
+}
+
+static
+void *
+slab_allocate(struct alloc *alloc, size_t m)
+{
+	struct slab_alloc *sa = (struct slab_alloc *)alloc;
+
+	if (m > SLAB_ALLOC_MAX_SIZE) {
+		return try_allocate_with(sa->sa_large, m);
+	}
+	return slab_object_create(&sa->sa_pools[slab_alloc_class(m)]);
+}
+
+static
+void
+slab_deallocate(struct alloc *alloc, void *p, size_t n)
+{
+	struct slab_alloc *sa = (struct slab_alloc *)alloc;
+
+	if (n > SLAB_ALLOC_MAX_SIZE) {
+		deallocate_with(sa->sa_large, p, n);
+		return;
+	}
+	slab_object_destroy(&sa->sa_pools[slab_alloc_class(n)], p);
+}
+
+/*
+ * Stays put if both sizes are in the same class, or both are large enough to
+ * be given to sa_large, which can then do as it likes.
+ */
+static
+void *
+slab_reallocate(struct alloc *alloc, void *q, size_t m, size_t n)
+{
+	struct slab_alloc *sa = (struct slab_alloc *)alloc;
+	void *p;
+
+	if (m > SLAB_ALLOC_MAX_SIZE && n > SLAB_ALLOC_MAX_SIZE) {
+		return try_reallocate_with(sa->sa_large, q, m, n);
+	}
+	if (m <= SLAB_ALLOC_MAX_SIZE && n <= SLAB_ALLOC_MAX_SIZE &&
+			slab_alloc_class(m) == slab_alloc_class(n)) {
+		return q;
+	}
+
+	p = slab_allocate(alloc, n);
+	if (p == NULL) {
+		return NULL;
+	}
+	memcpy(p, q, m < n ? m : n);
+	slab_deallocate(alloc, q, m);
+	return p;
+}
+
+static
+struct alloc_vtable
+slab_alloc_vtable = {
+	&slab_allocate,
+	&slab_reallocate,
+	&slab_deallocate
+};
+
+/*
+ * Objects are aligned to 16 bytes, like those from malloc.
+ */
+void
+slab_alloc_init(struct slab_alloc *sa, struct alloc *large)
+{
+	size_t i;
+
+	sa->sa_alloc.alloc_vtable = &slab_alloc_vtable;
+	sa->sa_large = large;
+	for (i = 0; i < SLAB_ALLOC_CLASSES; i++) {
+		slab_pool_init(&sa->sa_pools[i], 16, slab_alloc_class_size(i),
+			NULL, NULL);
+	}
+}
+
+/*
+ * Everything allocated from 'sa_large' must already have been deallocated.
+ * Anything else still allocated is thrown away.
+ */
+void
+slab_alloc_finish(struct slab_alloc *sa)
+{
+	size_t i;
+
+	for (i = 0; i < SLAB_ALLOC_CLASSES; i++) {
+		slab_pool_finish(&sa->sa_pools[i]);
+	}
+}
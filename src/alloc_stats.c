@@ -0,0 +1,324 @@
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "alloc_stats.h"
+
+/* the call sites with the most bytes allocated that are reported */
+#define STATS_ALLOC_REPORT_SITES 10
+
+static
+long
+stats_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+size_t
+stats_bucket(size_t n)
+{
+	size_t bucket;
+
+	if (n <= 1) {
+		return 0;
+	}
+	bucket = (size_t)(64 - __builtin_clzl(n - 1));
+	return bucket < STATS_ALLOC_BUCKETS ? bucket : STATS_ALLOC_BUCKETS - 1;
+}
+
+static
+void
+stats_add(long int *counter, long int n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sites live in an open-addressed table that never grows.  Once it is full,
+ * allocations from new sites are only counted in sta_sites_dropped.
+ */
+static
+void
+stats_count_site(struct stats_alloc *sta, size_t n)
+{
+	/* one frame for this function and one for stats_allocate */
+	void *frames[STATS_ALLOC_SITE_DEPTH + 2];
+	void **site_frames = frames + 2;
+	uintptr_t hash = 0;
+	size_t i, probes;
+	int depth;
+
+	depth = backtrace(frames, STATS_ALLOC_SITE_DEPTH + 2) - 2;
+	for (i = 0; i < STATS_ALLOC_SITE_DEPTH; i++) {
+		if ((int)i >= depth) {
+			site_frames[i] = NULL;
+		}
+		hash = (hash ^ (uintptr_t)site_frames[i]) * 0x100000001b3ul;
+	}
+
+	pthread_mutex_lock(&sta->sta_sites_lock);
+	for (probes = 0; probes < STATS_ALLOC_SITES; probes++) {
+		struct stats_alloc_site *site =
+			&sta->sta_sites[(hash + probes) % STATS_ALLOC_SITES];
+		if (site->sas_allocs == 0) {
+			memcpy(site->sas_frames, site_frames,
+				sizeof site->sas_frames);
+		} else if (memcmp(site->sas_frames, site_frames,
+				sizeof site->sas_frames) != 0) {
+			continue;
+		}
+		site->sas_allocs++;
+		site->sas_bytes += (long int)n;
+		break;
+	}
+	if (probes == STATS_ALLOC_SITES) {
+		sta->sta_sites_dropped++;
+	}
+	pthread_mutex_unlock(&sta->sta_sites_lock);
+}
+
+static
+void
+stats_count_live(struct stats_alloc *sta, size_t n, long int sign)
+{
+	long int live = __atomic_add_fetch(&sta->sta_live, sign * (long int)n,
+		__ATOMIC_RELAXED);
+	long int peak = __atomic_load_n(&sta->sta_peak, __ATOMIC_RELAXED);
+
+	stats_add(&sta->sta_bucket_live[stats_bucket(n)], sign * (long int)n);
+	while (live > peak && !__atomic_compare_exchange_n(&sta->sta_peak,
+			&peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static
+void *
+stats_allocate(struct alloc *alloc, size_t m)
+{
+	struct stats_alloc *sta = (struct stats_alloc *)alloc;
+	void *p = try_allocate_with(sta->sta_inner, m);
+
+	if (p == NULL) {
+		stats_add(&sta->sta_failures, 1);
+		return NULL;
+	}
+	stats_add(&sta->sta_allocs, 1);
+	stats_add(&sta->sta_bucket_allocs[stats_bucket(m)], 1);
+	stats_count_live(sta, m, 1);
+	if (sta->sta_sites != NULL) {
+		stats_count_site(sta, m);
+	}
+	return p;
+}
+
+static
+void *
+stats_reallocate(struct alloc *alloc, void *q, size_t m, size_t n)
+{
+	struct stats_alloc *sta = (struct stats_alloc *)alloc;
+	void *p = try_reallocate_with(sta->sta_inner, q, m, n);
+
+	if (p == NULL) {
+		stats_add(&sta->sta_failures, 1);
+		return NULL;
+	}
+	stats_add(&sta->sta_reallocs, 1);
+	stats_count_live(sta, m, -1);
+	stats_count_live(sta, n, 1);
+	return p;
+}
+
+static
+void
+stats_deallocate(struct alloc *alloc, void *p, size_t n)
+{
+	struct stats_alloc *sta = (struct stats_alloc *)alloc;
+
+	deallocate_with(sta->sta_inner, p, n);
+	stats_add(&sta->sta_deallocs, 1);
+	stats_count_live(sta, n, -1);
+}
+
+static
+struct alloc_vtable
+stats_alloc_vtable = {
+	&stats_allocate,
+	&stats_reallocate,
+	&stats_deallocate
+};
+
+static
+void
+stats_alloc_report_hook(void *arg)
+{
+	stats_alloc_report(arg);
+}
+
+/*
+ * 'name' is used in the report, which is logged when log_finish is called
+ * unless stats_alloc_finish is called first.  If 'track_sites' is nonzero,
+ * allocations are counted by call site as well.
+ */
+void
+stats_alloc_init(struct stats_alloc *sta, struct alloc *inner,
+	const char *name, int track_sites)
+{
+	size_t i;
+
+	sta->sta_alloc.alloc_vtable = &stats_alloc_vtable;
+	sta->sta_inner = inner;
+	sta->sta_name = name;
+	sta->sta_live = sta->sta_peak = 0;
+	sta->sta_allocs = sta->sta_deallocs = 0;
+	sta->sta_reallocs = sta->sta_failures = 0;
+	for (i = 0; i < STATS_ALLOC_BUCKETS; i++) {
+		sta->sta_bucket_allocs[i] = 0;
+		sta->sta_bucket_live[i] = 0;
+	}
+	sta->sta_started_ns = stats_clock_ns();
+	sta->sta_sites = NULL;
+	sta->sta_sites_dropped = 0;
+	pthread_mutex_init(&sta->sta_sites_lock, NULL);
+	if (track_sites) {
+		sta->sta_sites = allocarray_with(&sys_alloc,
+			STATS_ALLOC_SITES, sizeof *sta->sta_sites);
+		for (i = 0; i < STATS_ALLOC_SITES; i++) {
+			sta->sta_sites[i].sas_allocs = 0;
+		}
+	}
+	log_at_finish(&stats_alloc_report_hook, sta);
+}
+
+/*
+ * Logs a final report, in which anything still allocated counts as leaked.
+ */
+void
+stats_alloc_finish(struct stats_alloc *sta)
+{
+	log_cancel_at_finish(&stats_alloc_report_hook, sta);
+	stats_alloc_report(sta);
+	if (sta->sta_sites != NULL) {
+		deallocarray_with(&sys_alloc, sta->sta_sites,
+			STATS_ALLOC_SITES, sizeof *sta->sta_sites);
+	}
+	pthread_mutex_destroy(&sta->sta_sites_lock);
+}
+
+/*
+ * Frames are logged as an offset into the object they are in, which is what
+ * addr2line wants.
+ */
+static
+void
+stats_report_site(struct stats_alloc *sta, struct stats_alloc_site *site)
+{
+	size_t i;
+
+	log_info("alloc_stats", "%s: %ld bytes in %ld allocations from:\n",
+		sta->sta_name, site->sas_bytes, site->sas_allocs);
+	for (i = 0; i < STATS_ALLOC_SITE_DEPTH; i++) {
+		Dl_info info;
+		if (site->sas_frames[i] == NULL) {
+			break;
+		}
+		if (dladdr(site->sas_frames[i], &info) != 0 &&
+				info.dli_fname != NULL) {
+			log_info("alloc_stats", "    %s+0x%lx\n", info.dli_fname,
+				(unsigned long)((char *)site->sas_frames[i] -
+					(char *)info.dli_fbase));
+		} else {
+			log_info("alloc_stats", "    %p\n", site->sas_frames[i]);
+		}
+	}
+}
+
+static
+void
+stats_report_sites(struct stats_alloc *sta)
+{
+	struct stats_alloc_site *reported[STATS_ALLOC_REPORT_SITES];
+	size_t i, j, nreported = 0;
+
+	/* the sites with the most bytes, by insertion into a short list */
+	pthread_mutex_lock(&sta->sta_sites_lock);
+	for (i = 0; i < STATS_ALLOC_SITES; i++) {
+		struct stats_alloc_site *site = &sta->sta_sites[i];
+		if (site->sas_allocs == 0) {
+			continue;
+		}
+		for (j = nreported; j > 0; j--) {
+			if (reported[j - 1]->sas_bytes >= site->sas_bytes) {
+				break;
+			}
+			if (j < STATS_ALLOC_REPORT_SITES) {
+				reported[j] = reported[j - 1];
+			}
+		}
+		if (j < STATS_ALLOC_REPORT_SITES) {
+			reported[j] = site;
+			if (nreported < STATS_ALLOC_REPORT_SITES) {
+				nreported++;
+			}
+		}
+	}
+	for (i = 0; i < nreported; i++) {
+		stats_report_site(sta, reported[i]);
+	}
+	if (sta->sta_sites_dropped != 0) {
+		log_info("alloc_stats", "%s: %ld allocations from sites that "
+			"did not fit in the table\n",
+			sta->sta_name, sta->sta_sites_dropped);
+	}
+	pthread_mutex_unlock(&sta->sta_sites_lock);
+}
+
+void
+stats_alloc_report(struct stats_alloc *sta)
+{
+	long int allocs = __atomic_load_n(&sta->sta_allocs, __ATOMIC_RELAXED);
+	long int live = __atomic_load_n(&sta->sta_live, __ATOMIC_RELAXED);
+	double secs = (double)(stats_clock_ns() - sta->sta_started_ns) / 1e9;
+	size_t i;
+
+	log_info("alloc_stats", "%s: %ld bytes live, %ld bytes at peak\n",
+		sta->sta_name, live,
+		__atomic_load_n(&sta->sta_peak, __ATOMIC_RELAXED));
+	log_info("alloc_stats", "%s: %ld allocations (%.0f/s), "
+		"%ld deallocations, %ld reallocations, %ld failures\n",
+		sta->sta_name, allocs, secs > 0 ? (double)allocs / secs : 0.0,
+		__atomic_load_n(&sta->sta_deallocs, __ATOMIC_RELAXED),
+		__atomic_load_n(&sta->sta_reallocs, __ATOMIC_RELAXED),
+		__atomic_load_n(&sta->sta_failures, __ATOMIC_RELAXED));
+	for (i = 0; i < STATS_ALLOC_BUCKETS; i++) {
+		long int n = __atomic_load_n(&sta->sta_bucket_allocs[i],
+			__ATOMIC_RELAXED);
+		if (n != 0) {
+			log_info("alloc_stats", "%s: up to %lu bytes: "
+				"%ld allocations, %ld bytes live\n",
+				sta->sta_name, 1ul << i, n,
+				__atomic_load_n(&sta->sta_bucket_live[i],
+					__ATOMIC_RELAXED));
+		}
+	}
+	if (sta->sta_sites != NULL) {
+		stats_report_sites(sta);
+	}
+	if (live != 0) {
+		log_warning("alloc_stats", "%s: %ld bytes leaked or not yet "
+			"freed\n", sta->sta_name, live);
+	}
+}
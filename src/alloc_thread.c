@@ -0,0 +1,291 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VINE_NO_POISON
+#include "alloc.h"
+#undef VINE_NO_POISON
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "slab_pool.h"
+#include "alloc_slab.h"
+
+/*
+ * thread_alloc is a general-purpose allocator for use from any number of
+ * threads.  Objects up to SLAB_ALLOC_MAX_SIZE come in the size classes of
+ * slab_alloc, and each thread has a heap with a slab pool of its own for each
+ * class, and a cache of free objects in front of each pool, so allocation
+ * never takes a lock.  The size given to deallocate is
+ * all that says which class an object is in, so objects have no headers.
+ * Bigger objects go straight to malloc.
+ *
+ * An object can be deallocated on a different thread to the one it was
+ * allocated on, which is just as well, as fibres move between threads.  Such
+ * an object is handed back to the slab it came from with
+ * slab_object_destroy_remote, which is lock-free, and the thread that owns the
+ * slab takes it back along with any others the next time that pool runs out of
+ * partial slabs.  The common case, an object deallocated on the
+ * thread that allocated it, touches nothing shared at all.
+ *
+ * When a thread exits, its heap is abandoned rather than destroyed, because
+ * objects from it may still be in use elsewhere.  The next thread to need a
+ * heap adopts an abandoned one if there is one.
+ *
+ * Nothing is zeroed, see allocate_zeroed_with.
+ */
+
+/* roughly how many bytes of one class move between a cache and a pool at once */
+#define THREAD_ALLOC_BATCH_BYTES (16 * 1024)
+#define THREAD_ALLOC_MIN_BATCH 4
+#define THREAD_ALLOC_MAX_BATCH 64
+
+/*
+ * Objects are handed out of and back to th_cache, in front of the pools,
+ * which is cheaper than going to the slabs each time.  The cache only ever
+ * holds objects from this heap's own pools.
+ */
+struct thread_cache_list {
+	void *tcl_head;
+	size_t tcl_count;
+};
+
+struct thread_heap {
+	struct thread_heap *th_next;
+	struct thread_cache_list th_cache[SLAB_ALLOC_CLASSES];
+	struct slab_pool th_pools[SLAB_ALLOC_CLASSES];
+};
+
+/* the size of each slab of each class, which is the same in every heap */
+static size_t thread_alloc_slab_sizes[SLAB_ALLOC_CLASSES];
+static size_t thread_alloc_batches[SLAB_ALLOC_CLASSES];
+static struct thread_heap *thread_heaps_abandoned;
+static pthread_mutex_t thread_heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_alloc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_alloc_key;
+static __thread struct thread_heap *thread_heap;
+
+static void thread_heap_abandon(void *);
+
+static
+void
+thread_alloc_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < SLAB_ALLOC_CLASSES; i++) {
+		size_t size = slab_alloc_class_size(i);
+		size_t batch = THREAD_ALLOC_BATCH_BYTES / size;
+
+		if (batch < THREAD_ALLOC_MIN_BATCH) {
+			batch = THREAD_ALLOC_MIN_BATCH;
+		} else if (batch > THREAD_ALLOC_MAX_BATCH) {
+			batch = THREAD_ALLOC_MAX_BATCH;
+		}
+		thread_alloc_slab_sizes[i] = slab_pool_slab_size(16, size);
+		thread_alloc_batches[i] = batch;
+	}
+	/* the key is only used to abandon a thread's heap when it exits */
+	if (pthread_key_create(&thread_alloc_key, &thread_heap_abandon) != 0) {
+		abort_with_error("Could not create the thread_alloc key\n");
+	}
+}
+
+static
+struct thread_heap *
+thread_heap_create(void)
+{
+	struct thread_heap *th;
+	size_t i;
+
+	pthread_once(&thread_alloc_once, &thread_alloc_init);
+	pthread_mutex_lock(&thread_heaps_lock);
+	th = thread_heaps_abandoned;
+	if (th != NULL) {
+		thread_heaps_abandoned = th->th_next;
+	}
+	pthread_mutex_unlock(&thread_heaps_lock);
+
+	if (th != NULL) {
+		log_debug("alloc_thread", "Adopted the heap at %p\n", (void *)th);
+	} else {
+		th = malloc(sizeof *th);
+		if (th == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < SLAB_ALLOC_CLASSES; i++) {
+			th->th_cache[i].tcl_head = NULL;
+			th->th_cache[i].tcl_count = 0;
+			slab_pool_init(&th->th_pools[i], 16,
+				slab_alloc_class_size(i), NULL, NULL);
+		}
+		log_debug("alloc_thread", "Created the heap at %p\n", (void *)th);
+	}
+	if (pthread_setspecific(thread_alloc_key, th) != 0) {
+		abort_with_error("Could not register a thread_alloc heap\n");
+	}
+	thread_heap = th;
+	return th;
+}
+
+/*
+ * Gives 'count' objects from the front of a cache list back to the pool.
+ */
+static
+void
+thread_cache_drain(struct thread_heap *th, size_t class, size_t count)
+{
+	struct thread_cache_list *list = &th->th_cache[class];
+
+	while (count-- > 0 && list->tcl_head != NULL) {
+		void *p = list->tcl_head;
+		list->tcl_head = *(void **)p;
+		list->tcl_count--;
+		slab_object_destroy(&th->th_pools[class], p);
+	}
+}
+
+static
+void
+thread_cache_fill(struct thread_heap *th, size_t class)
+{
+	struct thread_cache_list *list = &th->th_cache[class];
+	size_t i;
+
+	for (i = 0; i < thread_alloc_batches[class]; i++) {
+		void *p = slab_object_create(&th->th_pools[class]);
+		*(void **)p = list->tcl_head;
+		list->tcl_head = p;
+	}
+	list->tcl_count += thread_alloc_batches[class];
+}
+
+/*
+ * Objects deallocated by other threads keep arriving after the owner has
+ * gone, so they are collected here and then by whichever thread adopts the
+ * heap.
+ */
+static
+void
+thread_heap_abandon(void *arg)
+{
+	struct thread_heap *th = arg;
+	size_t i;
+
+	for (i = 0; i < SLAB_ALLOC_CLASSES; i++) {
+		thread_cache_drain(th, i, th->th_cache[i].tcl_count);
+		slab_pool_collect(&th->th_pools[i]);
+	}
+	pthread_mutex_lock(&thread_heaps_lock);
+	th->th_next = thread_heaps_abandoned;
+	thread_heaps_abandoned = th;
+	pthread_mutex_unlock(&thread_heaps_lock);
+	thread_heap = NULL;
+	log_debug("alloc_thread", "Abandoned the heap at %p\n", (void *)th);
+}
+
+static
+void *
+thread_allocate(struct alloc *a, size_t m)
+{
+	struct thread_heap *th = thread_heap;
+	struct thread_cache_list *list;
+	size_t class;
+	void *p;
+
+	(void)a;
+
+	if (m > SLAB_ALLOC_MAX_SIZE) {
+		return malloc(m);
+	}
+	if (th == NULL) {
+		th = thread_heap_create();
+		if (th == NULL) {
+			return NULL;
+		}
+	}
+
+	class = slab_alloc_class(m);
+	list = &th->th_cache[class];
+	if (list->tcl_head == NULL) {
+		thread_cache_fill(th, class);
+	}
+	p = list->tcl_head;
+	list->tcl_head = *(void **)p;
+	list->tcl_count--;
+	return p;
+}
+
+/*
+ * A thread that has never allocated anything has no heap, and everything it
+ * deallocates is remote.
+ */
+static
+void
+thread_deallocate(struct alloc *a, void *p, size_t n)
+{
+	struct thread_heap *th = thread_heap;
+	struct thread_cache_list *list;
+	struct slab *slab;
+	size_t class;
+
+	(void)a;
+
+	if (n > SLAB_ALLOC_MAX_SIZE) {
+		free(p);
+		return;
+	}
+
+	class = slab_alloc_class(n);
+	slab = (struct slab *)((uintptr_t)p &
+		~(uintptr_t)(thread_alloc_slab_sizes[class] - 1));
+	if (th == NULL || slab->slab_pool != &th->th_pools[class]) {
+		slab_object_destroy_remote(slab->slab_pool, p);
+		return;
+	}
+
+	list = &th->th_cache[class];
+	*(void **)p = list->tcl_head;
+	list->tcl_head = p;
+	if (++list->tcl_count > 2 * thread_alloc_batches[class]) {
+		thread_cache_drain(th, class, thread_alloc_batches[class]);
+	}
+}
+
+static
+void *
+thread_reallocate(struct alloc *a, void *q, size_t m, size_t n)
+{
+	void *p;
+
+	if (m > SLAB_ALLOC_MAX_SIZE && n > SLAB_ALLOC_MAX_SIZE) {
+		return realloc(q, n);
+	}
+	if (m <= SLAB_ALLOC_MAX_SIZE && n <= SLAB_ALLOC_MAX_SIZE &&
+			slab_alloc_class(m) == slab_alloc_class(n)) {
+		return q;
+	}
+
+	p = thread_allocate(a, n);
+	if (p == NULL) {
+		return NULL;
+	}
+	memcpy(p, q, m < n ? m : n);
+	thread_deallocate(a, q, m);
+	return p;
+}
+
+static
+struct alloc_vtable
+thread_alloc_vtable = {
+	&thread_allocate,
+	&thread_reallocate,
+	&thread_deallocate
+};
+
+struct alloc
+thread_alloc = {&thread_alloc_vtable};
@@ -0,0 +1,459 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "abort.h"
+#include "checked.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "alloc_buf.h"
+#include "slab_pool.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+#include "channel.h"
+
+/* segments are about this big unless messages are huge */
+#define CHANNEL_SEGMENT_SIZE 1024
+
+struct channel_segment {
+	struct channel_segment *cs_next;
+	char cs_data[1];
+};
+#define CHANNEL_SEGMENT_HEADER_SIZE offsetof(struct channel_segment, cs_data)
+
+/*
+ * A fibre waiting on a channel.  These live on the stack of the waiting fibre,
+ * and whoever claims one, by moving cw_state on from CW_WAITING, is the one
+ * that must wake it: either somebody who has made it worth trying again, its
+ * timer, or its being cancelled.  Only the first is done under the lock, so
+ * a waiter that timed out or was cancelled can still be on its queue, and is
+ * unlinked by whoever finds it there first, either somebody taking waiters
+ * off the queue or the fibre itself once it is awake.  The fibre always takes
+ * the lock before it goes, so the waiter is there for as long as anybody
+ * holding the lock can see it.
+ */
+enum channel_waiter_state {
+	CW_WAITING,
+	CW_WOKEN,
+	CW_TIMEDOUT,
+	CW_CANCELLED
+};
+struct channel_waiter {
+	struct channel_waiter *cw_next;
+	struct fibre *cw_fibre;
+	struct channel_waitq *cw_queue;
+	/* set by whoever claims it */
+	int cw_state;
+	/* whether it is on cw_queue, which is only looked at under the lock */
+	int cw_queued;
+	struct fibre_timer cw_timer;
+};
+
+static
+void
+channel_segment_init(void *ptr)
+{
+	(void)ptr;
+}
+
+static
+void
+channel_segment_finish(void *ptr)
+{
+	(void)ptr;
+}
+
+/*
+ * 'capacity' is the maximum number of messages buffered at once, or
+ * CHANNEL_UNBOUNDED.
+ */
+void
+channel_init(struct channel *ch, size_t elem_size, size_t capacity)
+{
+	size_t slots;
+
+	assert1(elem_size > 0);
+	assert1(capacity > 0);
+
+	if (elem_size < CHANNEL_SEGMENT_SIZE - CHANNEL_SEGMENT_HEADER_SIZE) {
+		slots = (CHANNEL_SEGMENT_SIZE - CHANNEL_SEGMENT_HEADER_SIZE) / elem_size;
+	} else {
+		slots = 1;
+	}
+	if (slots > capacity) {
+		slots = capacity;
+	}
+
+	ch->ch_elem_size = elem_size;
+	ch->ch_capacity = capacity;
+	ch->ch_seg_slots = slots;
+	ch->ch_count = 0;
+	ch->ch_head = NULL;
+	ch->ch_tail = NULL;
+	ch->ch_head_pos = 0;
+	ch->ch_tail_pos = 0;
+	slab_pool_init(&ch->ch_segments, __alignof__(struct channel_segment),
+		CHANNEL_SEGMENT_HEADER_SIZE + slots * elem_size,
+		&channel_segment_init, &channel_segment_finish);
+	ch->ch_senders.cwq_head = ch->ch_senders.cwq_tail = NULL;
+	ch->ch_receivers.cwq_head = ch->ch_receivers.cwq_tail = NULL;
+	ch->ch_closed = 0;
+	pthread_mutex_init(&ch->ch_lock, NULL);
+}
+
+/*
+ * Nobody may be waiting on the channel any more.  Any messages still in it are
+ * thrown away.
+ */
+void
+channel_finish(struct channel *ch)
+{
+	assert1(ch->ch_senders.cwq_head == NULL);
+	assert1(ch->ch_receivers.cwq_head == NULL);
+	slab_pool_finish(&ch->ch_segments);
+	pthread_mutex_destroy(&ch->ch_lock);
+}
+
+static
+int
+channel_waiter_claim(struct channel_waiter *w, int state)
+{
+	int expected = CW_WAITING;
+
+	return __atomic_compare_exchange_n(&w->cw_state, &expected, state,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static
+void
+channel_waitq_push(struct channel_waitq *q, struct channel_waiter *w)
+{
+	w->cw_next = NULL;
+	w->cw_queued = 1;
+	if (q->cwq_tail == NULL) {
+		q->cwq_head = w;
+	} else {
+		q->cwq_tail->cw_next = w;
+	}
+	q->cwq_tail = w;
+}
+
+/*
+ * Claims up to 'n' waiters on the queue and returns them as a list, to be
+ * woken with channel_wake_all once the lock has been dropped.  Waiters that
+ * have already been claimed some other way are unlinked and left alone.
+ */
+static
+struct channel_waiter *
+channel_waitq_take(struct channel_waitq *q, size_t n)
+{
+	struct channel_waiter *first = NULL;
+	struct channel_waiter **tail = &first;
+
+	while (n > 0 && q->cwq_head != NULL) {
+		struct channel_waiter *w = q->cwq_head;
+		q->cwq_head = w->cw_next;
+		if (q->cwq_head == NULL) {
+			q->cwq_tail = NULL;
+		}
+		w->cw_queued = 0;
+		if (!channel_waiter_claim(w, CW_WOKEN)) {
+			continue;
+		}
+		w->cw_next = NULL;
+		*tail = w;
+		tail = &w->cw_next;
+		n--;
+	}
+	return first;
+}
+
+static
+void
+channel_waitq_remove(struct channel_waitq *q, struct channel_waiter *w)
+{
+	struct channel_waiter **p = &q->cwq_head;
+	struct channel_waiter *prev = NULL;
+
+	while (*p != w) {
+		prev = *p;
+		p = &(*p)->cw_next;
+	}
+	*p = w->cw_next;
+	if (q->cwq_tail == w) {
+		q->cwq_tail = prev;
+	}
+}
+
+static
+void
+channel_wake_all(struct channel_waiter *w)
+{
+	while (w != NULL) {
+		/* once it is awake, 'w' may go away at any moment */
+		struct channel_waiter *next = w->cw_next;
+		fibre_wake(w->cw_fibre);
+		w = next;
+	}
+}
+
+/*
+ * The timer of a waiter and its cancellation race with anyone else who might
+ * claim it, and must not block, so they do not take the lock.
+ */
+static
+void
+channel_wait_abandon(struct channel_waiter *w, int state)
+{
+	/* once it is awake, 'w' may go away at any moment */
+	struct fibre *fibre = w->cw_fibre;
+
+	if (channel_waiter_claim(w, state)) {
+		fibre_wake(fibre);
+	}
+}
+
+static
+void
+channel_wait_timeout(void *arg)
+{
+	channel_wait_abandon(arg, CW_TIMEDOUT);
+}
+
+static
+void
+channel_wait_cancel(void *arg)
+{
+	channel_wait_abandon(arg, CW_CANCELLED);
+}
+
+/*
+ * Called with the lock held, and returns with it held again.  Returns
+ * CHANNEL_OK once it is worth trying again, CHANNEL_TIMEDOUT if 'deadline'
+ * passed first, or CHANNEL_CANCELLED if the fibre was cancelled first.
+ */
+static
+int
+channel_wait(struct channel *ch, struct channel_waitq *q, long deadline)
+{
+	struct channel_waiter w;
+
+	w.cw_fibre = fibre_self();
+	w.cw_queue = q;
+	w.cw_state = CW_WAITING;
+	channel_waitq_push(q, &w);
+	if (deadline != FIBRE_NO_DEADLINE) {
+		fibre_timer_init(&w.cw_timer);
+		fibre_timer_start(&w.cw_timer, deadline, channel_wait_timeout, &w);
+	}
+	pthread_mutex_unlock(&ch->ch_lock);
+
+	fibre_wait_cancellable(channel_wait_cancel, &w);
+	if (deadline != FIBRE_NO_DEADLINE) {
+		fibre_timer_cancel(&w.cw_timer);
+	}
+
+	pthread_mutex_lock(&ch->ch_lock);
+	if (w.cw_queued) {
+		channel_waitq_remove(q, &w);
+	}
+	switch (__atomic_load_n(&w.cw_state, __ATOMIC_ACQUIRE)) {
+	case CW_TIMEDOUT:
+		return CHANNEL_TIMEDOUT;
+	case CW_CANCELLED:
+		return CHANNEL_CANCELLED;
+	default:
+		return CHANNEL_OK;
+	}
+}
+
+static
+void
+channel_push(struct channel *ch, const void *msg)
+{
+	if (ch->ch_tail == NULL || ch->ch_tail_pos == ch->ch_seg_slots) {
+		struct channel_segment *seg = slab_object_create(&ch->ch_segments);
+		seg->cs_next = NULL;
+		if (ch->ch_tail == NULL) {
+			ch->ch_head = seg;
+		} else {
+			ch->ch_tail->cs_next = seg;
+		}
+		ch->ch_tail = seg;
+		ch->ch_tail_pos = 0;
+	}
+
+	memcpy(ch->ch_tail->cs_data + ch->ch_tail_pos * ch->ch_elem_size,
+		msg, ch->ch_elem_size);
+	ch->ch_tail_pos++;
+	ch->ch_count++;
+}
+
+/*
+ * Copies out as many as 'max' messages, a segment at a time.
+ */
+static
+size_t
+channel_pop_many(struct channel *ch, char *buf, size_t max)
+{
+	size_t n = 0;
+
+	while (n < max && ch->ch_count > 0) {
+		struct channel_segment *seg = ch->ch_head;
+		size_t run = ch->ch_seg_slots - ch->ch_head_pos;
+
+		if (run > max - n) {
+			run = max - n;
+		}
+		if (run > ch->ch_count) {
+			run = ch->ch_count;
+		}
+
+		memcpy(buf + n * ch->ch_elem_size,
+			seg->cs_data + ch->ch_head_pos * ch->ch_elem_size,
+			run * ch->ch_elem_size);
+		n += run;
+		ch->ch_head_pos += run;
+		ch->ch_count -= run;
+
+		if (ch->ch_count == 0) {
+			/* keep the last segment around and start it again */
+			assert1(seg == ch->ch_tail);
+			ch->ch_head_pos = 0;
+			ch->ch_tail_pos = 0;
+		} else if (ch->ch_head_pos == ch->ch_seg_slots) {
+			ch->ch_head = seg->cs_next;
+			ch->ch_head_pos = 0;
+			slab_object_destroy(&ch->ch_segments, seg);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Sends a copy of the message pointed to by 'msg', waiting for room if the
+ * channel is bounded and full.  Gives up if the channel is closed, if it is
+ * still full at 'deadline', which may be FIBRE_NO_DEADLINE, or if the fibre is
+ * cancelled, whether or not it would have had to wait.
+ */
+int
+channel_send_until(struct channel *ch, const void *msg, long deadline)
+{
+	struct channel_waiter *woken;
+	int status;
+
+	if (fibre_cancelled()) {
+		return CHANNEL_CANCELLED;
+	}
+
+	pthread_mutex_lock(&ch->ch_lock);
+	while (!ch->ch_closed && ch->ch_count >= ch->ch_capacity) {
+		status = channel_wait(ch, &ch->ch_senders, deadline);
+		if (status != CHANNEL_OK) {
+			pthread_mutex_unlock(&ch->ch_lock);
+			return status;
+		}
+	}
+	if (ch->ch_closed) {
+		pthread_mutex_unlock(&ch->ch_lock);
+		return CHANNEL_CLOSED;
+	}
+
+	channel_push(ch, msg);
+	woken = channel_waitq_take(&ch->ch_receivers, 1);
+	pthread_mutex_unlock(&ch->ch_lock);
+
+	channel_wake_all(woken);
+	return CHANNEL_OK;
+}
+
+/*
+ * Returns zero if the channel has been closed or the fibre was cancelled, in
+ * which case the message was not sent.
+ */
+int
+channel_send(struct channel *ch, const void *msg)
+{
+	return channel_send_until(ch, msg, FIBRE_NO_DEADLINE) == CHANNEL_OK;
+}
+
+/*
+ * Receives at least one and at most 'max' messages into 'buf', waiting for
+ * one if the channel is empty, and sets '*nrecv' to how many were received.
+ * Receiving everything that is already there at once saves taking the lock
+ * and waking up for each message.  Gives up if the channel is still empty at
+ * 'deadline', which may be FIBRE_NO_DEADLINE, if the fibre is cancelled,
+ * whether or not it would have had to wait, or once the channel has been
+ * closed and everything sent before that has been received.
+ */
+int
+channel_recv_until(struct channel *ch, void *buf, size_t max, size_t *nrecv,
+	long deadline)
+{
+	struct channel_waiter *woken;
+	size_t n;
+	int status;
+
+	assert1(max > 0);
+
+	*nrecv = 0;
+	if (fibre_cancelled()) {
+		return CHANNEL_CANCELLED;
+	}
+
+	pthread_mutex_lock(&ch->ch_lock);
+	while (!ch->ch_closed && ch->ch_count == 0) {
+		status = channel_wait(ch, &ch->ch_receivers, deadline);
+		if (status != CHANNEL_OK) {
+			pthread_mutex_unlock(&ch->ch_lock);
+			return status;
+		}
+	}
+
+	n = channel_pop_many(ch, buf, max);
+	/* each sender waiting for room has one message to send */
+	woken = channel_waitq_take(&ch->ch_senders, n);
+	pthread_mutex_unlock(&ch->ch_lock);
+
+	channel_wake_all(woken);
+	*nrecv = n;
+	return n == 0 ? CHANNEL_CLOSED : CHANNEL_OK;
+}
+
+/*
+ * Returns how many messages were received, which is zero only if the fibre was
+ * cancelled, or once the channel has been closed and everything sent before
+ * that has been received.
+ */
+size_t
+channel_recv(struct channel *ch, void *buf, size_t max)
+{
+	size_t n;
+
+	channel_recv_until(ch, buf, max, &n, FIBRE_NO_DEADLINE);
+	return n;
+}
+
+/*
+ * Closes the channel, waking everyone waiting on it.  Messages already sent
+ * can still be received, but nothing more can be sent.
+ */
+void
+channel_close(struct channel *ch)
+{
+	struct channel_waiter *senders, *receivers;
+
+	pthread_mutex_lock(&ch->ch_lock);
+	ch->ch_closed = 1;
+	senders = channel_waitq_take(&ch->ch_senders, (size_t)-1);
+	receivers = channel_waitq_take(&ch->ch_receivers, (size_t)-1);
+	pthread_mutex_unlock(&ch->ch_lock);
+
+	channel_wake_all(senders);
+	channel_wake_all(receivers);
+}
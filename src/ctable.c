@@ -0,0 +1,300 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "checked.h"
+#include "alloc.h"
+#include "types.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+#include "epoch.h"
+#include "ctable.h"
+
+#define CTABLE_SHARD_BITS 6
+#define CTABLE_MIN_BUCKETS 8
+
+static
+struct ctable_shard *
+ctable_shard(struct ctable *ct, struct tkey key)
+{
+	return &ct->ct_shards[key.tk_hash >> (64 - CTABLE_SHARD_BITS)];
+}
+
+static
+size_t
+ctable_buckets_size(size_t count)
+{
+	return sizeof(struct ctable_buckets) +
+		mul_sz(count - 1, sizeof(struct ctable_node *));
+}
+
+static
+struct ctable_buckets *
+ctable_buckets_create(struct alloc *alloc, size_t count)
+{
+	struct ctable_buckets *cb = allocate_with(alloc,
+		ctable_buckets_size(count));
+	size_t i;
+
+	cb->cb_count = count;
+	for (i = 0; i < count; i++) {
+		cb->cb_heads[i] = NULL;
+	}
+	return cb;
+}
+
+/*
+ * Frees a set of buckets along with every node on their chains.
+ */
+static
+void
+ctable_buckets_destroy(struct alloc *alloc, void *ptr, size_t size)
+{
+	struct ctable_buckets *cb = ptr;
+	size_t i;
+
+	for (i = 0; i < cb->cb_count; i++) {
+		struct ctable_node *cn = cb->cb_heads[i];
+		while (cn != NULL) {
+			struct ctable_node *next = cn->cn_next;
+			deallocate_with(alloc, cn, sizeof *cn);
+			cn = next;
+		}
+	}
+	deallocate_with(alloc, cb, size);
+}
+
+static
+struct ctable_node **
+ctable_bucket(struct ctable_buckets *cb, struct tkey key)
+{
+	return &cb->cb_heads[key.tk_hash & (cb->cb_count - 1)];
+}
+
+static
+int
+ctable_key_equal(struct tkey k1, struct tkey k2)
+{
+	return k1.tk_hash == k2.tk_hash && object_equal(k1.tk_obj, k2.tk_obj);
+}
+
+void
+ctable_init(struct ctable *ct, struct alloc *alloc)
+{
+	size_t i;
+
+	ct->ct_alloc = alloc;
+	for (i = 0; i < CTABLE_SHARDS; i++) {
+		struct ctable_shard *cs = &ct->ct_shards[i];
+		pthread_mutex_init(&cs->cs_lock, NULL);
+		cs->cs_buckets = ctable_buckets_create(alloc, CTABLE_MIN_BUCKETS);
+		cs->cs_size = 0;
+		epoch_limbo_init(&cs->cs_limbo);
+	}
+}
+
+/*
+ * Nothing may be using the table any more.
+ */
+void
+ctable_finish(struct ctable *ct)
+{
+	size_t i;
+
+	for (i = 0; i < CTABLE_SHARDS; i++) {
+		struct ctable_shard *cs = &ct->ct_shards[i];
+		struct ctable_buckets *cb = cs->cs_buckets;
+		ctable_buckets_destroy(ct->ct_alloc, cb,
+			ctable_buckets_size(cb->cb_count));
+		epoch_limbo_finish(&cs->cs_limbo);
+		pthread_mutex_destroy(&cs->cs_lock);
+	}
+}
+
+/*
+ * The number of keys, which is only a snapshot if other threads are changing
+ * the table.
+ */
+size_t
+ctable_size(struct ctable *ct)
+{
+	size_t i, size = 0;
+
+	for (i = 0; i < CTABLE_SHARDS; i++) {
+		size += __atomic_load_n(&ct->ct_shards[i].cs_size,
+			__ATOMIC_RELAXED);
+	}
+	return size;
+}
+
+/*
+ * Must be called between epoch_enter and epoch_leave.
+ */
+static
+struct ctable_node *
+ctable_find(struct ctable *ct, struct tkey key)
+{
+	struct ctable_shard *cs = ctable_shard(ct, key);
+	struct ctable_buckets *cb = __atomic_load_n(&cs->cs_buckets,
+		__ATOMIC_ACQUIRE);
+	struct ctable_node *cn = __atomic_load_n(ctable_bucket(cb, key),
+		__ATOMIC_ACQUIRE);
+
+	for (; cn != NULL; cn = __atomic_load_n(&cn->cn_next, __ATOMIC_ACQUIRE)) {
+		if (ctable_key_equal(cn->cn_key, key)) {
+			return cn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Doubles the buckets of a shard once it has more keys than buckets.
+ * The nodes are copied, as a lookup going through the old buckets must still
+ * find every key.  Nothing but the old buckets links to the old nodes any
+ * more, so they are all retired together, which costs one allocation rather
+ * than one per node.  The shard takes twice its memory until they are
+ * reclaimed.
+ */
+static
+void
+ctable_grow(struct ctable *ct, struct ctable_shard *cs)
+{
+	struct ctable_buckets *old = cs->cs_buckets;
+	struct ctable_buckets *cb;
+	size_t i;
+
+	if (cs->cs_size <= old->cb_count) {
+		return;
+	}
+	cb = ctable_buckets_create(ct->ct_alloc, mul_sz(old->cb_count, 2));
+	for (i = 0; i < old->cb_count; i++) {
+		struct ctable_node *cn;
+		for (cn = old->cb_heads[i]; cn != NULL; cn = cn->cn_next) {
+			struct ctable_node **head = ctable_bucket(cb, cn->cn_key);
+			struct ctable_node *copy = allocate_with(ct->ct_alloc,
+				sizeof *copy);
+			copy->cn_key = cn->cn_key;
+			copy->cn_value = cn->cn_value;
+			copy->cn_next = *head;
+			*head = copy;
+		}
+	}
+	__atomic_store_n(&cs->cs_buckets, cb, __ATOMIC_RELEASE);
+	epoch_retire_with(&cs->cs_limbo, ct->ct_alloc, old,
+		ctable_buckets_size(old->cb_count), &ctable_buckets_destroy);
+}
+
+/*
+ * Links a new node for 'key' with 'value' in place of any node there already
+ * was for it.
+ */
+static
+void
+ctable_put(struct ctable *ct, struct tkey key, union object value)
+{
+	struct ctable_shard *cs = ctable_shard(ct, key);
+	struct ctable_node *cn = allocate_with(ct->ct_alloc, sizeof *cn);
+	struct ctable_node **link;
+
+	cn->cn_key = key;
+	cn->cn_value = value;
+
+	pthread_mutex_lock(&cs->cs_lock);
+	link = ctable_bucket(cs->cs_buckets, key);
+	for (; *link != NULL; link = &(*link)->cn_next) {
+		if (ctable_key_equal((*link)->cn_key, key)) {
+			struct ctable_node *old = *link;
+			cn->cn_next = old->cn_next;
+			__atomic_store_n(link, cn, __ATOMIC_RELEASE);
+			epoch_retire(&cs->cs_limbo, ct->ct_alloc, old,
+				sizeof *old);
+			pthread_mutex_unlock(&cs->cs_lock);
+			return;
+		}
+	}
+	link = ctable_bucket(cs->cs_buckets, key);
+	cn->cn_next = *link;
+	__atomic_store_n(link, cn, __ATOMIC_RELEASE);
+	__atomic_store_n(&cs->cs_size, cs->cs_size + 1, __ATOMIC_RELAXED);
+	ctable_grow(ct, cs);
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+/*
+ * Returns -1 if the key is not in the table.
+ */
+int
+ctable_remove(struct ctable *ct, struct tkey key)
+{
+	struct ctable_shard *cs = ctable_shard(ct, key);
+	struct ctable_node **link;
+
+	pthread_mutex_lock(&cs->cs_lock);
+	link = ctable_bucket(cs->cs_buckets, key);
+	for (; *link != NULL; link = &(*link)->cn_next) {
+		if (ctable_key_equal((*link)->cn_key, key)) {
+			struct ctable_node *old = *link;
+			__atomic_store_n(link, old->cn_next, __ATOMIC_RELEASE);
+			__atomic_store_n(&cs->cs_size, cs->cs_size - 1,
+				__ATOMIC_RELAXED);
+			epoch_retire(&cs->cs_limbo, ct->ct_alloc, old,
+				sizeof *old);
+			pthread_mutex_unlock(&cs->cs_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&cs->cs_lock);
+	return -1;
+}
+
+#define DEFINE_CTABLE_GET_SET(name, type) \
+int \
+ctable_try_get_##name(struct ctable *ct, struct tkey key, type *value) \
+{ \
+	struct ctable_node *cn; \
+	int res = -1; \
+\
+	epoch_enter(); \
+	cn = ctable_find(ct, key); \
+	if (cn != NULL) { \
+		res = object_try_as_##name(&cn->cn_value, value); \
+	} \
+	epoch_leave(); \
+	return res; \
+} \
+type \
+ctable_get_##name(struct ctable *ct, struct tkey key) \
+{ \
+	type value; \
+	int res = ctable_try_get_##name(ct, key, &value); \
+	if (res != 0) { \
+		abort_with_error("ctable_get_" #name " failed: %d\n", res); \
+	} \
+	return value; \
+} \
+void \
+ctable_set_##name(struct ctable *ct, struct tkey key, type value) \
+{ \
+	union object obj; \
+\
+	object_init_from_##name(&obj, value); \
+	ctable_put(ct, key, obj); \
+}
+
+DEFINE_CTABLE_GET_SET(u8, u8)
+DEFINE_CTABLE_GET_SET(u16, u16)
+DEFINE_CTABLE_GET_SET(u32, u32)
+DEFINE_CTABLE_GET_SET(u64, u64)
+DEFINE_CTABLE_GET_SET(z8, z8)
+DEFINE_CTABLE_GET_SET(z16, z16)
+DEFINE_CTABLE_GET_SET(z32, z32)
+DEFINE_CTABLE_GET_SET(z64, z64)
+DEFINE_CTABLE_GET_SET(int, int)
+DEFINE_CTABLE_GET_SET(cstr, const char *)
@@ -0,0 +1,255 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "epoch.h"
+#include "checked.h"
+
+/*
+ * There is a global epoch, and each thread that has ever read has a record
+ * of the epoch it saw when it last entered a section.  The global epoch only
+ * moves on when every thread in a section has seen it, so once it is two
+ * past the epoch something was retired in, no thread can still be in a
+ * section that started before it was retired.
+ *
+ * Records are never freed.  A thread's record is marked free when it exits,
+ * for the next new thread to take over.
+ */
+
+/* records are written often by their own threads, so each has a cache line
+ * to itself */
+#define EPOCH_RECORD_ALIGN 64
+
+struct epoch_record {
+	struct epoch_record *er_next;
+	unsigned long er_epoch;
+	unsigned er_depth;
+	int er_active, er_in_use;
+};
+
+struct epoch_retired {
+	struct epoch_retired *ert_next;
+	struct alloc *ert_alloc;
+	void *ert_ptr;
+	size_t ert_size;
+	void (*ert_destroy)(struct alloc *, void *, size_t);
+	unsigned long ert_epoch;
+};
+
+static unsigned long epoch_global;
+static struct epoch_record *epoch_records;
+static pthread_mutex_t epoch_records_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static __thread struct epoch_record *epoch_record;
+
+static
+void
+epoch_record_release(void *arg)
+{
+	struct epoch_record *er = arg;
+
+	__atomic_store_n(&er->er_active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&er->er_in_use, 0, __ATOMIC_RELEASE);
+}
+
+static
+void
+epoch_init(void)
+{
+	if (pthread_key_create(&epoch_key, &epoch_record_release) != 0) {
+		abort_with_error("Could not create the epoch key\n");
+	}
+}
+
+static
+struct epoch_record *
+epoch_record_get(void)
+{
+	struct epoch_record *er;
+
+	pthread_once(&epoch_once, &epoch_init);
+	pthread_mutex_lock(&epoch_records_lock);
+	for (er = epoch_records; er != NULL; er = er->er_next) {
+		if (!__atomic_load_n(&er->er_in_use, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	if (er == NULL) {
+		char *p = allocate_with(&sys_alloc,
+			2 * EPOCH_RECORD_ALIGN - 1);
+		er = (struct epoch_record *)(void *)
+			align_ptr(p, EPOCH_RECORD_ALIGN);
+		er->er_active = 0;
+		er->er_next = epoch_records;
+		__atomic_store_n(&epoch_records, er, __ATOMIC_RELEASE);
+	}
+	er->er_depth = 0;
+	er->er_in_use = 1;
+	pthread_mutex_unlock(&epoch_records_lock);
+
+	if (pthread_setspecific(epoch_key, er) != 0) {
+		abort_with_error("Could not register an epoch record\n");
+	}
+	epoch_record = er;
+	return er;
+}
+
+/*
+ * The store of er_active and er_epoch must be seen by other threads before
+ * anything this thread reads in the section, hence the sequentially
+ * consistent exchange, which is cheaper than a store and a fence.
+ */
+void
+epoch_enter(void)
+{
+	struct epoch_record *er = epoch_record;
+
+	if (er == NULL) {
+		er = epoch_record_get();
+	}
+	if (er->er_depth++ != 0) {
+		return;
+	}
+	__atomic_store_n(&er->er_epoch,
+		__atomic_load_n(&epoch_global, __ATOMIC_RELAXED),
+		__ATOMIC_RELAXED);
+	(void)__atomic_exchange_n(&er->er_active, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+epoch_leave(void)
+{
+	struct epoch_record *er = epoch_record;
+
+	if (--er->er_depth == 0) {
+		__atomic_store_n(&er->er_active, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Moves the global epoch on if every thread in a section has seen it, and
+ * returns the global epoch.
+ */
+static
+unsigned long
+epoch_try_advance(void)
+{
+	unsigned long epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	struct epoch_record *er;
+
+	er = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+	for (; er != NULL; er = er->er_next) {
+		if (__atomic_load_n(&er->er_active, __ATOMIC_SEQ_CST) &&
+				__atomic_load_n(&er->er_epoch,
+					__ATOMIC_SEQ_CST) != epoch) {
+			return epoch;
+		}
+	}
+	if (__atomic_compare_exchange_n(&epoch_global, &epoch, epoch + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		epoch++;
+	}
+	return epoch;
+}
+
+/*
+ * A limbo list holds what has been retired but not yet freed.  It belongs to
+ * whoever retires things onto it, who must lock it if that is more than one
+ * thread.
+ */
+void
+epoch_limbo_init(struct epoch_limbo *el)
+{
+	el->el_head = NULL;
+	el->el_count = 0;
+}
+
+/*
+ * Frees everything on the limbo list whether or not it is safe to, for when
+ * nothing can be reading any of it any more.
+ */
+void
+epoch_limbo_finish(struct epoch_limbo *el)
+{
+	while (el->el_head != NULL) {
+		struct epoch_retired *ert = el->el_head;
+		el->el_head = ert->ert_next;
+		ert->ert_destroy(ert->ert_alloc, ert->ert_ptr, ert->ert_size);
+		deallocate_with(&sys_alloc, ert, sizeof *ert);
+	}
+	el->el_count = 0;
+}
+
+static
+void
+epoch_deallocate(struct alloc *alloc, void *ptr, size_t size)
+{
+	deallocate_with(alloc, ptr, size);
+}
+
+/*
+ * 'ptr', of 'size' bytes from 'alloc', will be freed once no reader can have
+ * it.  Every so often this tries to free what has been retired already.
+ */
+void
+epoch_retire(struct epoch_limbo *el, struct alloc *alloc, void *ptr,
+	size_t size)
+{
+	epoch_retire_with(el, alloc, ptr, size, &epoch_deallocate);
+}
+
+/*
+ * Like epoch_retire, but 'ptr' is freed by calling 'destroy' with the same
+ * arguments, so that something that owns other things can be retired along
+ * with them, for the cost of one retirement.
+ */
+void
+epoch_retire_with(struct epoch_limbo *el, struct alloc *alloc, void *ptr,
+	size_t size, void (*destroy)(struct alloc *, void *, size_t))
+{
+	struct epoch_retired *ert = allocate_with(&sys_alloc, sizeof *ert);
+
+	ert->ert_alloc = alloc;
+	ert->ert_ptr = ptr;
+	ert->ert_size = size;
+	ert->ert_destroy = destroy;
+	ert->ert_epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	ert->ert_next = el->el_head;
+	el->el_head = ert;
+	if (++el->el_count % 64 == 0) {
+		epoch_reclaim(el);
+	}
+}
+
+/*
+ * Frees what no reader can have any more, and returns how much that was.
+ * The list is newest first, so once one entry is safe to free, so are all
+ * the entries after it.
+ */
+size_t
+epoch_reclaim(struct epoch_limbo *el)
+{
+	unsigned long epoch = epoch_try_advance();
+	struct epoch_retired **link = &el->el_head;
+	size_t n = 0;
+
+	while (*link != NULL && (*link)->ert_epoch + 2 > epoch) {
+		link = &(*link)->ert_next;
+	}
+	while (*link != NULL) {
+		struct epoch_retired *ert = *link;
+		*link = ert->ert_next;
+		ert->ert_destroy(ert->ert_alloc, ert->ert_ptr, ert->ert_size);
+		deallocate_with(&sys_alloc, ert, sizeof *ert);
+		n++;
+	}
+	el->el_count -= n;
+	return n;
+}
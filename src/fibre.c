@@ -1,4 +1,6 @@
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,11 +9,14 @@
 
 #include "util.h"
 #include "alloc.h"
+#include "timer_wheel.h"
 #include "fibre.h"
 #include "eprintf.h"
 #include "abort.h"
 #include "log.h"
 #include "memory.h"
+#include "stack_pool.h"
+#include "fibre_io.h"
 
 #ifdef USE_VALGRIND
 #include <valgrind/valgrind.h>
@@ -19,20 +24,21 @@
 
 #include "fibre_switch.h"
 
-static struct {
-	long int fstat_stack_allocs;
-	long int fstat_fibre_go_calls;
-} fibre_stats = {0};
+static struct fibre_stats fibre_stats = {0};
+static void fibre_stats_reset(void);
+static void fibre_join_complete(struct fibre_join *);
 
 /*
  * This structure represents an execution context, namely it contains the
  * values for all callee-saved registers, and the stack pointer. Because we
  * switch fibres using a function call, the compiler takes care of saving
- * everything else.
+ * everything else.  The control bits of MXCSR and the x87 control word are
+ * callee-saved too, so they are kept here as well, but fibre_switch only
+ * loads them when they differ, which they almost never do.
  *
- * This struct will need to be extended with additional items over time. For
- * example, if/when fibre-local storage is implemented, there will need to be
- * pointer in this structure to that storage.
+ * It also holds the fibre's fibre-local storage, which is indexed directly by
+ * key, so that getting at it never needs a lookup.  fibre_switch does not
+ * touch it: it belongs to the fibre, not to whichever worker is running it.
  */
 struct fibre_ctx {
 	uint64_t fc_rsp;
@@ -42,7 +48,10 @@ struct fibre_ctx {
 	uint64_t fc_r12;
 	uint64_t fc_rbx;
 	uint64_t fc_rbp;
-	uint64_t reserved[9];
+	uint32_t fc_mxcsr;
+	uint16_t fc_fpucw;
+	uint16_t reserved;
+	void *fc_local[FIBRE_LOCAL_SLOTS];
 };
 
 enum fibre_state {
@@ -56,22 +65,34 @@ enum fibre_state {
 	FS_READY
 };
 
-enum fibre_prio {
-	/* a fibre used for ui or other interactive functionality */
-	FP_HIGH,
-	/* any other fibre */
-	FP_NORMAL,
-	/* a fibre used for non-latency-sensitive background tasks */
-	FP_BACKGROUND,
-	/* the number of priority levels */
-	FP_NUM_PRIOS
-};
+struct fibre_worker;
 
 /*
  * This structure represents a fibre. It includes the execution context (struct
  * fibre_ctx) along with the state of the fibre and a pointer to the fibre's
  * stack. This is everything you need to know whether a fibre can be switched
  * to and how to switch to it.
+ *
+ * f_oncpu is set while some worker is executing on the fibre's stack, which
+ * includes the short window after the fibre has been descheduled but before
+ * fibre_switch has finished saving its context.  A worker that wants to switch
+ * to a fibre must wait for f_oncpu to be clear.
+ *
+ * f_pin is the worker that the fibre is pinned to, or NULL if the fibre may
+ * run on any worker.
+ *
+ * A fibre runs either f_func or, if it was started by fibre_go_join, f_jfunc,
+ * whose result is handed over through f_join.
+ *
+ * f_ready_at is when the fibre was last made ready, or zero if it was not put
+ * on a ready queue, and f_run_ns, f_switches and f_max_slice_ns are its share
+ * of the statistics, see fibre_get_run_stats.
+ *
+ * f_cancel_scope is the innermost cancel scope the fibre has entered, and is
+ * only touched by the fibre itself.  While the fibre waits in
+ * fibre_wait_cancellable, f_cancel_hook is how whoever cancels it can get it
+ * woken up, and f_cancel_lock keeps it from being called after the wait is
+ * over.
  */
 struct fibre {
 	struct fibre_ctx f_ctx;
@@ -83,17 +104,56 @@ struct fibre {
 	unsigned reserved[1];
 #endif
 	char *f_stack;
+	size_t f_stack_class;
+	void (*f_func)(void *);
+	void *(*f_jfunc)(void *);
+	struct fibre_join *f_join;
+	struct fibre_worker *f_pin;
+	int f_oncpu;
+	int f_cancel_lock;
+	long f_ready_at;
+	long f_run_ns;
+	long f_switches;
+	long f_max_slice_ns;
+	struct fibre_cancel_scope *f_cancel_scope;
+	void (*f_cancel_hook)(void *);
+	void *f_cancel_arg;
 };
 
+static
+void
+fibre_run_stats_reset(struct fibre *fibre)
+{
+	fibre->f_ready_at = 0;
+	fibre->f_run_ns = 0;
+	fibre->f_switches = 0;
+	fibre->f_max_slice_ns = 0;
+}
+
 static
 void
 fibre_setup(struct fibre *fibre)
 {
+	size_t i;
+
 	/* f_ctx is invalid when f_state = EMPTY */
 	fibre->f_state = FS_EMPTY;
 	/* f_prio is invalid when f_state = EMPTY */
 	/* f_valgrind_id is initialised when needed */
 	fibre->f_stack = NULL;
+	fibre->f_func = NULL;
+	fibre->f_jfunc = NULL;
+	fibre->f_join = NULL;
+	fibre->f_pin = NULL;
+	fibre->f_oncpu = 0;
+	fibre->f_cancel_lock = 0;
+	fibre->f_cancel_scope = NULL;
+	fibre->f_cancel_hook = NULL;
+	fibre->f_cancel_arg = NULL;
+	fibre_run_stats_reset(fibre);
+	for (i = 0; i < FIBRE_LOCAL_SLOTS; i++) {
+		fibre->f_ctx.fc_local[i] = NULL;
+	}
 }
 
 /*
@@ -121,6 +181,14 @@ fibre_store_list_init(struct fibre_store_list *list)
 	list->fsl_start = list->fsl_end = NULL;
 }
 
+static
+int
+fibre_store_list_is_empty(struct fibre_store_list *list)
+{
+	assertiff(list->fsl_start == NULL, list->fsl_end == NULL);
+	return list->fsl_start == NULL;
+}
+
 /* adds a fibre to the start of the list */
 static
 void
@@ -186,12 +254,188 @@ try_fibre_store_list_dequeue(struct fibre_store_list *list)
 	return &node->fsn_fibre;
 }
 
+/*
+ * This is a Chase-Lev work-stealing deque of ready fibres.  Only the worker
+ * that owns the deque may push onto it, at the bottom, but anyone may take from
+ * the top.  The owner takes from the top too, so that a deque is a queue as far
+ * as its owner is concerned: a fibre that yields goes to the back of the line
+ * rather than being run again immediately.
+ *
+ * fd_top and fd_bottom are kept on different cache lines, as thieves only ever
+ * write fd_top and the owner mostly writes fd_bottom.
+ *
+ * When the array fills up it is replaced by one twice the size.  A thief may
+ * still be reading the old array, so old arrays are kept on a list and only
+ * freed by fibre_finish.
+ */
+struct fibre_deque_array {
+	struct fibre_deque_array *fda_prev;
+	long fda_size;
+	struct fibre *fda_buf[1];
+};
+
+#define FIBRE_DEQUE_INITIAL_SIZE 256
+#define CACHE_LINE_SIZE 64
+
+struct fibre_deque {
+	long fd_top;
+	char fd_pad[CACHE_LINE_SIZE - sizeof(long)];
+	long fd_bottom;
+	struct fibre_deque_array *fd_array;
+};
+
+static
+struct fibre_deque_array *
+fibre_deque_array_create(struct alloc *alloc, long size)
+{
+	struct fibre_deque_array *array = allocate_with(alloc,
+		sizeof *array + (size_t)(size - 1) * sizeof array->fda_buf[0]);
+
+	array->fda_prev = NULL;
+	array->fda_size = size;
+
+	return array;
+}
+
+static
+void
+fibre_deque_array_destroy(struct alloc *alloc, struct fibre_deque_array *array)
+{
+	deallocate_with(alloc, array,
+		sizeof *array + (size_t)(array->fda_size - 1) * sizeof array->fda_buf[0]);
+}
+
+static
+void
+fibre_deque_init(struct fibre_deque *deque, struct alloc *alloc)
+{
+	deque->fd_top = 0;
+	deque->fd_bottom = 0;
+	deque->fd_array = fibre_deque_array_create(alloc, FIBRE_DEQUE_INITIAL_SIZE);
+}
+
+static
+void
+fibre_deque_finish(struct fibre_deque *deque, struct alloc *alloc)
+{
+	struct fibre_deque_array *array = deque->fd_array;
+
+	while (array != NULL) {
+		struct fibre_deque_array *prev = array->fda_prev;
+		fibre_deque_array_destroy(alloc, array);
+		array = prev;
+	}
+	deque->fd_array = NULL;
+}
+
+static
+long
+fibre_deque_size(struct fibre_deque *deque)
+{
+	long t = __atomic_load_n(&deque->fd_top, __ATOMIC_ACQUIRE);
+	long b = __atomic_load_n(&deque->fd_bottom, __ATOMIC_ACQUIRE);
+
+	return b - t;
+}
+
+static
+struct fibre_deque_array *
+fibre_deque_grow(struct fibre_deque *deque, struct alloc *alloc, long t, long b)
+{
+	struct fibre_deque_array *old = deque->fd_array;
+	struct fibre_deque_array *new = fibre_deque_array_create(alloc,
+		old->fda_size * 2);
+	long i;
+
+	for (i = t; i < b; i++) {
+		new->fda_buf[i & (new->fda_size - 1)] = __atomic_load_n(
+			&old->fda_buf[i & (old->fda_size - 1)], __ATOMIC_RELAXED);
+	}
+	new->fda_prev = old;
+	__atomic_store_n(&deque->fd_array, new, __ATOMIC_RELEASE);
+
+	return new;
+}
+
+/* may only be called by the owner of the deque */
+static
+void
+fibre_deque_push(struct fibre_deque *deque, struct alloc *alloc, struct fibre *fibre)
+{
+	long b = __atomic_load_n(&deque->fd_bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque->fd_top, __ATOMIC_ACQUIRE);
+	struct fibre_deque_array *array = deque->fd_array;
+
+	if (b - t > array->fda_size - 1) {
+		array = fibre_deque_grow(deque, alloc, t, b);
+	}
+	__atomic_store_n(&array->fda_buf[b & (array->fda_size - 1)], fibre,
+		__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->fd_bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes the fibre at the top of the deque.  Returns NULL if the deque is
+ * empty, and also if we lost a race with someone else taking the same fibre,
+ * in which case *lost is set.
+ */
+static
+struct fibre *
+fibre_deque_steal(struct fibre_deque *deque, int *lost)
+{
+	long t = __atomic_load_n(&deque->fd_top, __ATOMIC_ACQUIRE);
+	long b = __atomic_load_n(&deque->fd_bottom, __ATOMIC_ACQUIRE);
+	struct fibre_deque_array *array;
+	struct fibre *fibre;
+
+	/*
+	 * Most deques are empty most of the time, so look before paying for
+	 * the fence.  Seeing an old fd_bottom only means missing a fibre that
+	 * was only just pushed, which is no different to losing a race for it.
+	 */
+	if (t >= b) {
+		return NULL;
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->fd_bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return NULL;
+	}
+
+	array = __atomic_load_n(&deque->fd_array, __ATOMIC_ACQUIRE);
+	fibre = __atomic_load_n(&array->fda_buf[t & (array->fda_size - 1)],
+		__ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->fd_top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		*lost = 1;
+		return NULL;
+	}
+
+	return fibre;
+}
+
+static
+struct fibre *
+fibre_deque_take(struct fibre_deque *deque)
+{
+	struct fibre *fibre;
+	int lost;
+
+	do {
+		lost = 0;
+		fibre = fibre_deque_steal(deque, &lost);
+	} while (lost);
+
+	return fibre;
+}
+
 /*
  * This value is calculated so that each fibre_store_block should be page-sized.
- * Currently, sizeof(fibre_store_node) is 160 bytes, so this value should be 25.
- * The block takes up 4008 bytes.
+ * Currently, sizeof(fibre_store_node) is 264 bytes, so this value should be 15.
+ * The block takes up 3968 bytes.
  */
-#define FIBRE_STORE_NODES_PER_BLOCK 25
+#define FIBRE_STORE_NODES_PER_BLOCK 15
 
 /*
  * struct fibres are allocated in page-sized blocks, which at the moment are
@@ -203,15 +447,86 @@ struct fibre_store_block {
 };
 
 /*
- * there is a list of ready fibres for each priority level plus a list of
- * empty fibres.
+ * The store owns every struct fibre and the list of empty fibres.  It is
+ * shared by all workers, so fs_lock must be held while touching fs_blocks or
+ * fs_empties.  Empty fibres do not have stacks: a fibre gets one from the
+ * fs_stacks pool for its size class when it starts and gives it back when it
+ * returns.  Class i holds stacks of FIBRE_MIN_STACK_SIZE << i bytes.
  */
 struct fibre_store {
-	size_t fs_stack_size;
+	size_t fs_default_class;
 	struct alloc *fs_alloc;
+	struct stack_pool fs_stacks[FIBRE_STACK_CLASSES];
 	struct fibre_store_block *fs_blocks;
-	/* the last list is for FS_EMPTY fibres */
-	struct fibre_store_list fs_lists[FP_NUM_PRIOS + 1];
+	struct fibre_store_list fs_empties;
+	pthread_mutex_t fs_lock;
+};
+
+/*
+ * A worker is a kernel thread that runs fibres.  Each worker has its own ready
+ * deque for each priority level.  When a worker runs out of ready fibres it
+ * steals from the other workers, and when there is nothing to steal it
+ * switches to its idle fibre, which parks the thread on fw_cond.
+ *
+ * Fibres pinned to a worker never go on a deque, where they could be stolen.
+ * They go on the worker's fw_pinned lists, protected by fw_lock, instead.
+ *
+ * Worker 0 is the thread that called fibre_init.  Its idle fibre needs a stack
+ * of its own, as the thread's stack belongs to the main fibre.  The other
+ * workers' idle fibres run on their pthread stacks.
+ */
+struct fibre_worker {
+	struct fibre *fw_current;
+	struct fibre *fw_idle;
+	/* the fibre switched away from, see fibre_after_switch */
+	struct fibre *fw_prev;
+	int fw_prev_action;
+	int fw_parked;
+	/* parked in fibre_io_poll rather than on fw_cond */
+	int fw_polling;
+	/* fibre_yield calls, for polling for I/O every so often */
+	unsigned int fw_yields;
+	/* when fibre_should_yield last polled, in fibre_clock_ns time */
+	long fw_polled_at;
+	/*
+	 * How many times in a row a fibre of each priority has been passed
+	 * over for one of a higher priority, see fibre_worker_get_next_ready.
+	 */
+	unsigned int fw_passed[FP_NUM_PRIOS];
+	size_t fw_id;
+	/* where to start looking for a victim the next time we steal */
+	size_t fw_victim;
+	pthread_t fw_thread;
+	pthread_mutex_t fw_lock;
+	pthread_cond_t fw_cond;
+	struct fibre_store_list fw_pinned[FP_NUM_PRIOS];
+	struct fibre_deque fw_deques[FP_NUM_PRIOS];
+	/*
+	 * Statistics, written only by this worker, with relaxed atomics so that
+	 * fibre_get_stats can read them at any time.  fw_switched_at is when
+	 * this worker last switched fibres.
+	 */
+	long fw_switched_at;
+	long fw_switches;
+	long fw_max_slice_ns;
+	long fw_queue_wait_ns[FP_NUM_PRIOS];
+	long fw_queue_waits[FP_NUM_PRIOS];
+	long fw_queue_wait_max_ns[FP_NUM_PRIOS];
+	long fw_depths[FIBRE_DEPTH_BUCKETS];
+	long fw_aged;
+	long fw_budget_misses;
+};
+
+/*
+ * What to do with the previous fibre once we are off its stack.
+ */
+enum fibre_switch_action {
+	/* nothing: someone else is responsible for waking it */
+	FSA_NONE,
+	/* it yielded: put it back on a ready list */
+	FSA_REQUEUE,
+	/* it returned: give it back to the store */
+	FSA_RELEASE
 };
 
 static
@@ -230,7 +545,7 @@ fibre_store_block_create(struct fibre_store *store)
 		fibre_setup(&block->fsb_nodes[i].fsn_fibre);
 	}
 #undef MAX
-	
+
 	block->fsb_next = store->fs_blocks;
 	store->fs_blocks = block;
 
@@ -245,9 +560,11 @@ static
 struct fibre *
 fibre_store_get_first_empty(struct fibre_store *store)
 {
-	struct fibre_store_list *empties_list = &store->fs_lists[FP_NUM_PRIOS];
+	struct fibre_store_list *empties_list = &store->fs_empties;
 	struct fibre_store_node *node;
 
+	pthread_mutex_lock(&store->fs_lock);
+
 	if (empties_list->fsl_start == NULL || empties_list->fsl_end == NULL) {
 		struct fibre_store_block *block;
 
@@ -280,233 +597,1899 @@ fibre_store_get_first_empty(struct fibre_store *store)
 		node->fsn_next = NULL;
 	}
 
+	pthread_mutex_unlock(&store->fs_lock);
+
 	return &node->fsn_fibre;
 }
 
 static
-struct fibre *
-fibre_store_get_next_ready(struct fibre_store *store)
+void
+fibre_store_release(struct fibre_store *store, struct fibre *fibre)
 {
-	struct fibre *fibre;
-	size_t i;
-
-	for (i = 0; i < FP_NUM_PRIOS; i++) {
-		fibre = try_fibre_store_list_dequeue(&store->fs_lists[i]);
-		if (fibre != NULL) {
-			return fibre;
-		}
-	}
-
-	return NULL;
+	pthread_mutex_lock(&store->fs_lock);
+	fibre_store_list_enqueue(&store->fs_empties, fibre);
+	pthread_mutex_unlock(&store->fs_lock);
 }
 
-static struct fibre *current_fibre;
 static struct fibre *main_fibre;
 static struct fibre_store global_fibre_store;
 
+/*
+ * Returns the smallest stack size class that holds 'size' bytes.
+ */
+static
+size_t
+fibre_stack_class(size_t size)
+{
+	size_t class = 0;
+
+	while ((FIBRE_MIN_STACK_SIZE << class) < size) {
+		if (++class == FIBRE_STACK_CLASSES) {
+			abort_with_error("No fibre stack size class holds %lu bytes\n",
+				size);
+		}
+	}
+	return class;
+}
+
+static
+char *
+fibre_stack_get(struct fibre *fibre, size_t class)
+{
+	fibre->f_stack_class = class;
+	return stack_pool_get(&global_fibre_store.fs_stacks[class]);
+}
 
+static
 void
-fibre_init(struct alloc *alloc, size_t stack_size)
+fibre_stack_put(struct fibre *fibre)
 {
-	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
-	size_t i;
+	stack_pool_put(&global_fibre_store.fs_stacks[fibre->f_stack_class],
+		fibre->f_stack);
+	fibre->f_stack = NULL;
+}
+static struct fibre_worker *workers;
+static size_t num_workers;
+static int parked_workers;
+static int workers_shutdown;
+/* see fibre_set_latency_budget */
+static long fibre_latency_budget = FIBRE_DEFAULT_LATENCY_BUDGET;
+/* the number of fibres started by fibre_go that have not yet returned */
+static long int live_fibres;
+/* the fibre waiting for live_fibres to drop to zero, if any */
+static struct fibre *fibre_joiner;
+
+static __thread struct fibre_worker *this_worker;
 
-	log_info("fibre",
-		"Initialising fibre system with %luKiB-sized stacks\n",
-	        stack_size / 1024);
+/*
+ * A fibre can be suspended on one worker and resumed on another, so anything
+ * that can switch fibres must read the current worker through this function
+ * rather than directly.  Otherwise the compiler is entitled to reuse the
+ * address of this_worker that it computed on the old thread.
+ */
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static
+struct fibre_worker *
+fibre_worker_self(void)
+{
+	return this_worker;
+}
 
-#define BLOCK_SIZE (sizeof(struct fibre_store_block))
-#define NODE_SIZE (sizeof(struct fibre_store_node))
-	if (BLOCK_SIZE > page_size) {
-		log_warning("fibre",
-			"fibre_store_block is too big to fit in a page: "
-			"lower FIBRE_STORE_NODES_PER_BLOCK (%lu)\n",
-			BLOCK_SIZE);
-	} else if (BLOCK_SIZE + NODE_SIZE <= page_size) {
-		log_notice("fibre",
-			"fibre_store_block could be bigger: "
-			"raise FIBRE_STORE_NODES_PER_BLOCK (%lu)\n",
-			BLOCK_SIZE);
-	} else {
-		log_info("fibre",
-			"fibre_store_block fits perfectly in a page (%lu)\n",
-			BLOCK_SIZE);
-	}
-#undef BLOCK_SIZE
-#undef NODE_SIZE
+/*
+ * The most fibres we take from another worker in one go.
+ */
+#define FIBRE_STEAL_MAX 32
 
-	global_fibre_store.fs_stack_size = stack_size;
-	global_fibre_store.fs_alloc = alloc;
-	global_fibre_store.fs_blocks = NULL;
+/*
+ * How many times fibre_yield is called on a worker between checks for I/O and
+ * expired timers.
+ */
+#define FIBRE_POLL_INTERVAL 64
 
-	/* not a bug: "<=" because there is one more list than priorities */
-	for (i = 0; i <= FP_NUM_PRIOS; i++) {
-		fibre_store_list_init(&global_fibre_store.fs_lists[i]);
-	}
+/*
+ * How many times fibre_local_destroy goes round the destructors before giving
+ * up on destructors that keep setting values.
+ */
+#define FIBRE_LOCAL_DESTRUCTOR_ROUNDS 4
 
-	main_fibre = fibre_store_get_first_empty(&global_fibre_store);
-	main_fibre->f_state = FS_ACTIVE;
-	main_fibre->f_prio = FP_NORMAL; /* is this right? */
-	main_fibre->f_stack = NULL;
+/*
+ * How many times in a row a ready fibre can be passed over for fibres of
+ * higher priority before it is run anyway.
+ */
+#define FIBRE_AGING_LIMIT 8
 
-	current_fibre = main_fibre;
-}
+/*
+ * How many times fibre_should_yield polls for I/O and timers per latency
+ * budget, when the fibre calling it is not yielding and nothing else polls.
+ */
+#define FIBRE_POLLS_PER_BUDGET 16
 
-/* This should be further up, but the assertion requires it to be after the
- * declaration of main_fibre */
+/*
+ * Looks for a fibre of the given priority on the other workers' deques and,
+ * having found a victim, takes up to half of its fibres.  All but the first go
+ * on our own deque.
+ */
 static
-void
-fibre_store_destroy(struct fibre_store *store)
+struct fibre *
+fibre_worker_steal(struct fibre_worker *worker, size_t prio)
 {
 	size_t i;
-	while (store->fs_blocks != NULL) {
-		struct fibre_store_block *next = store->fs_blocks->fsb_next;
-		for (i = 0; i < FIBRE_STORE_NODES_PER_BLOCK; i++) {
-			if (&store->fs_blocks->fsb_nodes[i].fsn_fibre == main_fibre)
-				continue;
-			if (store->fs_blocks->fsb_nodes[i].fsn_fibre.f_stack == NULL)
-				continue;
-			deallocate_with(store->fs_alloc,
-				store->fs_blocks->fsb_nodes[i].fsn_fibre.f_stack,
-				store->fs_stack_size);
+
+	for (i = 1; i < num_workers; i++) {
+		struct fibre_worker *victim =
+			&workers[(worker->fw_id + worker->fw_victim + i) % num_workers];
+		struct fibre_deque *deque = &victim->fw_deques[prio];
+		struct fibre *first, *fibre;
+		long n = fibre_deque_size(deque) / 2;
+		long stolen = 1;
+
+		first = fibre_deque_take(deque);
+		if (first == NULL) {
+			continue;
 		}
-		deallocate_with(store->fs_alloc,
-			store->fs_blocks,
-			sizeof *store->fs_blocks);
-		store->fs_blocks = next;
+		if (n > FIBRE_STEAL_MAX) {
+			n = FIBRE_STEAL_MAX;
+		}
+		for (; stolen < n; stolen++) {
+			fibre = fibre_deque_take(deque);
+			if (fibre == NULL) {
+				break;
+			}
+			fibre_deque_push(&worker->fw_deques[prio],
+				global_fibre_store.fs_alloc, fibre);
+		}
+		worker->fw_victim += i;
+		__atomic_add_fetch(&fibre_stats.fstat_steals, stolen,
+			__ATOMIC_RELAXED);
+		return first;
 	}
-}
 
+	return NULL;
+}
 
+/*
+ * Statistics are only ever written by one thread at a time, so they need no
+ * read-modify-write, only to be readable from other threads while they are
+ * being written.
+ */
+static
 void
-fibre_finish(void)
+fibre_stat_add(long *stat, long n)
 {
-	log_info("fibre", "Deinitialising fibre system\n");
-
-	log_info("fibre",
-		"Fibre stat stack_allocs: %ld\n", fibre_stats.fstat_stack_allocs);
-	log_info("fibre",
-		"Fibre stat fibre_go_calls: %ld\n", fibre_stats.fstat_fibre_go_calls);
-
-	fibre_store_destroy(&global_fibre_store);
+	__atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + n,
+		__ATOMIC_RELAXED);
 }
 
+static
 void
-fibre_return(void)
+fibre_stat_max(long *stat, long n)
 {
-	log_debug("fibre", "Returning from fibre %p\n", (void *)current_fibre);
-
-	if (current_fibre != main_fibre) {
-		current_fibre->f_state = FS_EMPTY;
-		fibre_store_list_enqueue(
-			&global_fibre_store.fs_lists[FP_NUM_PRIOS],
-			current_fibre);
-		/* TODO: When we finish with a fibre, we should mark its stack
-		 * as no longer needed.  For now we will deallocate it, but
-		 * constantly allocating and deallocating stacks might be
-		 * wasteful.  It it does turn out to be, then we should reuse
-		 * stacks.  However, reusing stacks has the potential for
-		 * information leakage.  MADV_DONTNEED should zero-fill the
-		 * pages if they're ever reused, however.  We need an
-		 * allocator-dependent equivalent of:
-		 *
-		 * madvise(current_fibre->stack, MADV_DONTNEED);
-		 *
-		 * Or we need to hardcode the use of the mmap allocator for
-		 * allocating stacks.
-		 */
-#ifdef USE_VALGRIND
-		VALGRIND_STACK_DEREGISTER(current_fibre->f_valgrind_id);
-#endif
-		fibre_yield();
-		/* unreachable */
+	if (n > __atomic_load_n(stat, __ATOMIC_RELAXED)) {
+		__atomic_store_n(stat, n, __ATOMIC_RELAXED);
 	}
-	while (fibre_yield())
-		;
-	fibre_finish();
 }
 
+/*
+ * Records that 'fibre' has just finished running for 'ns' nanoseconds on the
+ * worker.  The idle fibre's slices include the time spent parked, so they do
+ * not count towards the longest slice.
+ */
 static
 void
-fibre_enqueue(struct fibre *fibre)
-{
-	fibre_store_list_enqueue(&global_fibre_store.fs_lists[fibre->f_prio], fibre);
-}
-
-int
-fibre_yield(void)
+fibre_stat_slice(struct fibre_worker *worker, struct fibre *fibre, long ns)
 {
-	struct fibre_ctx *old, *new;
-	struct fibre *old_fibre;
-	struct fibre *fibre = fibre_store_get_next_ready(&global_fibre_store);
-
-	if (fibre == NULL) {
-		log_debug("fibre", "Yielding from fibre %p, finishing\n",
-		                   (void *)current_fibre);
-		return 0;
-	}
-
-	if (current_fibre->f_state != FS_EMPTY) {
-		current_fibre->f_state = FS_READY;
-		fibre_enqueue(current_fibre);
+	fibre_stat_add(&fibre->f_run_ns, ns);
+	fibre_stat_max(&fibre->f_max_slice_ns, ns);
+	fibre_stat_add(&worker->fw_switches, 1);
+	if (fibre != worker->fw_idle) {
+		fibre_stat_max(&worker->fw_max_slice_ns, ns);
 	}
-	fibre->f_state = FS_ACTIVE;
-	old = &current_fibre->f_ctx;
-	new = &fibre->f_ctx;
-	old_fibre = current_fibre;
-	current_fibre = fibre;
-	log_debug("fibre", "Yielding from fibre %p to fibre %p.\n",
-	                   (void *)old_fibre,
-	                   (void *)current_fibre);
-#ifdef USE_VALGRIND
-	current_fibre->f_valgrind_id = VALGRIND_STACK_REGISTER(
-		current_fibre->f_stack,
-		current_fibre->f_stack + global_fibre_store.fs_stack_size);
-#endif
-	fibre_switch(old, new);
-#ifdef USE_VALGRIND
-	VALGRIND_STACK_DEREGISTER(old_fibre->f_valgrind_id);
-#endif
-	return 1;
 }
 
-#define FMTREG "0x%010llx"
-
-static void
-fibre_stop(void)
+static
+void
+fibre_stat_queue_wait(struct fibre_worker *worker, short prio, long ns)
 {
-	fibre_return();
+	fibre_stat_add(&worker->fw_queue_wait_ns[prio], ns);
+	fibre_stat_add(&worker->fw_queue_waits[prio], 1);
+	fibre_stat_max(&worker->fw_queue_wait_max_ns[prio], ns);
 }
 
+/*
+ * Depths go in power-of-two buckets: bucket i counts depths from 2^i up to
+ * but not including 2^(i+1), and the last bucket counts everything deeper.
+ */
+static
 void
-/* fibre_go(void (*f)(void *), void *data) */
-fibre_go(void (*f)(void))
+fibre_stat_depth(struct fibre_worker *worker, long depth)
 {
-	char *stack;
-	size_t size = global_fibre_store.fs_stack_size;
-	struct fibre *fibre = fibre_store_get_first_empty(&global_fibre_store);
+	size_t bucket;
 
-	fibre_stats.fstat_fibre_go_calls++;
-	if (fibre->f_stack == NULL) {
-		fibre_stats.fstat_stack_allocs++;
-		stack = allocate_with(global_fibre_store.fs_alloc, size);
-	} else {
-		stack = fibre->f_stack;
+	if (depth <= 0) {
+		return;
 	}
-#ifdef USE_VALGRIND
-	fibre->f_valgrind_id = VALGRIND_STACK_REGISTER(stack, stack + size);
-#endif
+	bucket = (size_t)(8 * sizeof(long) - 1) -
+		(size_t)__builtin_clzl((unsigned long)depth);
+	if (bucket >= FIBRE_DEPTH_BUCKETS) {
+		bucket = FIBRE_DEPTH_BUCKETS - 1;
+	}
+	fibre_stat_add(&worker->fw_depths[bucket], 1);
+}
 
-	*(uint64_t *)&stack[size -  8] = (uint64_t)fibre_stop;
-	*(uint64_t *)&stack[size - 16] = (uint64_t)f;
-	fibre->f_ctx.fc_rsp = (uint64_t)&stack[size - 16];
-	/* Obviously this doesn't actually work! OBVIOUSLY! We need to use an
-	 * assembly function to put this pointer into rsi before the first call
-	 * to this fibre.
-	 *     fibre->f_ctx.rsi = (uint64_t)data;
-	 */
+/*
+ * Takes a ready fibre of priority 'prio' for the worker to run, from the
+ * worker's pinned list, its own deque, or another worker's deque.
+ */
+static
+struct fibre *
+fibre_worker_take(struct fibre_worker *worker, size_t prio)
+{
+	struct fibre *fibre;
+
+	if (__atomic_load_n(&worker->fw_pinned[prio].fsl_start,
+			__ATOMIC_ACQUIRE) != NULL) {
+		pthread_mutex_lock(&worker->fw_lock);
+		fibre = try_fibre_store_list_dequeue(&worker->fw_pinned[prio]);
+		pthread_mutex_unlock(&worker->fw_lock);
+		if (fibre != NULL) {
+			return fibre;
+		}
+	}
+	fibre = fibre_deque_take(&worker->fw_deques[prio]);
+	if (fibre != NULL) {
+		return fibre;
+	}
+	return fibre_worker_steal(worker, prio);
+}
+
+/*
+ * Returns 1 if there is a ready fibre with a priority higher than 'prio' that
+ * the worker could run.  This only looks, so it might be wrong by the time it
+ * returns, which is fine for deciding whether to yield.
+ */
+static
+int
+fibre_worker_ready_above(struct fibre_worker *worker, size_t prio)
+{
+	size_t i, j;
+
+	for (i = 0; i < prio; i++) {
+		if (__atomic_load_n(&worker->fw_pinned[i].fsl_start,
+				__ATOMIC_RELAXED) != NULL) {
+			return 1;
+		}
+		for (j = 0; j < num_workers; j++) {
+			if (fibre_deque_size(&workers[j].fw_deques[i]) > 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Fibres are run in order of priority, except that a fibre that has been
+ * passed over FIBRE_AGING_LIMIT times in a row for fibres of higher priority
+ * goes first, so that FP_NORMAL and FP_BACKGROUND work keeps making progress
+ * however busy the priorities above them are.  Nothing goes ahead of a ready
+ * FP_HIGH fibre, whose latency budget comes first.
+ */
+static
+struct fibre *
+fibre_worker_get_next_ready(struct fibre_worker *worker)
+{
+	struct fibre *fibre = NULL;
+	size_t i;
+
+	for (i = FP_NUM_PRIOS - 1; i > FP_HIGH; i--) {
+		if (worker->fw_passed[i] >= FIBRE_AGING_LIMIT &&
+		    !fibre_worker_ready_above(worker, FP_HIGH + 1)) {
+			worker->fw_passed[i] = 0;
+			fibre = fibre_worker_take(worker, i);
+			if (fibre != NULL) {
+				fibre_stat_add(&worker->fw_aged, 1);
+				return fibre;
+			}
+		}
+	}
+
+	for (i = 0; i < FP_NUM_PRIOS; i++) {
+		fibre = fibre_worker_take(worker, i);
+		if (fibre != NULL) {
+			break;
+		}
+	}
+	if (fibre == NULL) {
+		return NULL;
+	}
+
+	/* only count what this worker is passing over, which is cheap to see */
+	worker->fw_passed[i] = 0;
+	for (i++; i < FP_NUM_PRIOS; i++) {
+		if (fibre_deque_size(&worker->fw_deques[i]) > 0 ||
+		    __atomic_load_n(&worker->fw_pinned[i].fsl_start,
+				__ATOMIC_RELAXED) != NULL) {
+			worker->fw_passed[i]++;
+		}
+	}
+	return fibre;
+}
+
+/* the caller must hold the worker's fw_lock */
+static
+int
+fibre_worker_has_work(struct fibre_worker *worker)
+{
+	size_t i, j;
+
+	for (i = 0; i < FP_NUM_PRIOS; i++) {
+		if (!fibre_store_list_is_empty(&worker->fw_pinned[i])) {
+			return 1;
+		}
+		for (j = 0; j < num_workers; j++) {
+			if (fibre_deque_size(&workers[j].fw_deques[i]) > 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A worker that wants to park sets fw_parked and then looks for work one last
+ * time, while anyone who makes a fibre ready publishes it and then looks for a
+ * parked worker.  Either way round, one of them sees the other.  Whoever
+ * clears fw_parked is responsible for decrementing parked_workers.
+ */
+static
+int
+fibre_worker_unpark(struct fibre_worker *worker)
+{
+	if (!__atomic_load_n(&worker->fw_parked, __ATOMIC_SEQ_CST)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&worker->fw_lock);
+	if (!__atomic_exchange_n(&worker->fw_parked, 0, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_unlock(&worker->fw_lock);
+		return 0;
+	}
+	__atomic_sub_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+	if (worker->fw_polling) {
+		fibre_io_interrupt();
+	} else {
+		pthread_cond_signal(&worker->fw_cond);
+	}
+	pthread_mutex_unlock(&worker->fw_lock);
+
+	return 1;
+}
+
+/*
+ * Wakes up one parked worker, if there are any, to come and steal the fibre
+ * we just pushed.
+ */
+static
+void
+fibre_workers_notify(struct fibre_worker *self)
+{
+	size_t i;
+
+	if (__atomic_load_n(&parked_workers, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	for (i = 1; i < num_workers; i++) {
+		if (fibre_worker_unpark(&workers[(self->fw_id + i) % num_workers])) {
+			return;
+		}
+	}
+}
+
+/*
+ * All timers are kept in one wheel, shared by every worker, that ticks once a
+ * millisecond of fibre_clock.  Their callbacks run on whichever worker next
+ * polls after they expire.  fibre_poll_deadline is the tick that the worker
+ * blocked in fibre_io_poll, if there is one, is going to wake up at, so that
+ * starting a timer that expires sooner can wake it up early.
+ */
+static struct timer_wheel fibre_timers;
+static pthread_mutex_t fibre_timers_lock;
+static int fibre_poll_blocked;
+static unsigned long fibre_poll_deadline;
+
+enum fibre_timer_state {
+	FT_IDLE,
+	FT_PENDING,
+	FT_FIRING
+};
+
+long
+fibre_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The same clock in nanoseconds, for the statistics.  It is never zero, which
+ * is what f_ready_at uses to mean 'not queued'.
+ */
+static
+long
+fibre_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+void
+fibre_timers_init(void)
+{
+	timer_wheel_init(&fibre_timers, (unsigned long)fibre_clock());
+	pthread_mutex_init(&fibre_timers_lock, NULL);
+	fibre_poll_blocked = 0;
+	fibre_poll_deadline = ULONG_MAX;
+}
+
+static
+void
+fibre_timers_finish(void)
+{
+	if (fibre_timers.tw_count != 0) {
+		log_warning("fibre", "%lu timers still pending\n",
+			fibre_timers.tw_count);
+	}
+	pthread_mutex_destroy(&fibre_timers_lock);
+}
+
+static
+int
+fibre_timers_pending(void)
+{
+	return __atomic_load_n(&fibre_timers.tw_count, __ATOMIC_RELAXED) != 0;
+}
+
+void
+fibre_timer_init(struct fibre_timer *timer)
+{
+	timer->ft_state = FT_IDLE;
+}
+
+/*
+ * Calls 'func(arg)' from the scheduler at 'deadline', unless the timer is
+ * cancelled first.  The callback must not block.  The timer must not already
+ * be running, and must stay put until it has fired or been cancelled.
+ */
+void
+fibre_timer_start(struct fibre_timer *timer, long deadline,
+	void (*func)(void *), void *arg)
+{
+	int polling;
+
+	assert1(timer->ft_state != FT_PENDING);
+
+	timer->ft_func = func;
+	timer->ft_arg = arg;
+	timer->ft_timer.tm_expires = deadline < 0 ? 0 : (unsigned long)deadline;
+
+	pthread_mutex_lock(&fibre_timers_lock);
+	timer->ft_state = FT_PENDING;
+	timer_wheel_add(&fibre_timers, &timer->ft_timer);
+	polling = fibre_poll_blocked;
+	if (polling && timer->ft_timer.tm_expires < fibre_poll_deadline) {
+		fibre_io_interrupt();
+	}
+	pthread_mutex_unlock(&fibre_timers_lock);
+
+	/* if nobody is polling, get a parked worker to */
+	if (!polling) {
+		fibre_workers_notify(fibre_worker_self());
+	}
+}
+
+/*
+ * Returns 1 if the timer was stopped before it fired.  Otherwise it has fired,
+ * or is firing, in which case this waits for the callback to finish, so that
+ * either way the timer can be reused or thrown away once this returns.
+ */
+int
+fibre_timer_cancel(struct fibre_timer *timer)
+{
+	pthread_mutex_lock(&fibre_timers_lock);
+	if (timer->ft_state == FT_PENDING) {
+		timer_wheel_remove(&fibre_timers, &timer->ft_timer);
+		timer->ft_state = FT_IDLE;
+		pthread_mutex_unlock(&fibre_timers_lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&fibre_timers_lock);
+
+	while (__atomic_load_n(&timer->ft_state, __ATOMIC_ACQUIRE) == FT_FIRING) {
+#ifdef __GNUC__
+		__builtin_ia32_pause();
+#endif
+	}
+	return 0;
+}
+
+/*
+ * Runs the callbacks of every timer that has expired.  They are run after the
+ * lock is dropped, so that they can start timers of their own.
+ */
+static
+void
+fibre_timers_run(void)
+{
+	struct fibre_timer *timer;
+	struct timer *expired, *next;
+
+	if (!fibre_timers_pending()) {
+		return;
+	}
+
+	pthread_mutex_lock(&fibre_timers_lock);
+	expired = timer_wheel_advance(&fibre_timers, (unsigned long)fibre_clock());
+	for (next = expired; next != NULL; next = next->tm_next) {
+		timer = container_of(struct fibre_timer, ft_timer, next);
+		timer->ft_state = FT_FIRING;
+	}
+	pthread_mutex_unlock(&fibre_timers_lock);
+
+	while (expired != NULL) {
+		next = expired->tm_next;
+		timer = container_of(struct fibre_timer, ft_timer, expired);
+		timer->ft_func(timer->ft_arg);
+		__atomic_store_n(&timer->ft_state, FT_IDLE, __ATOMIC_RELEASE);
+		expired = next;
+	}
+}
+
+/*
+ * Works out how long the poller may sleep for before the next timer expires,
+ * in milliseconds, or -1 for as long as it likes.
+ */
+static
+int
+fibre_timers_poll_timeout(void)
+{
+	unsigned long next, now;
+	int timeout = -1;
+
+	pthread_mutex_lock(&fibre_timers_lock);
+	if (timer_wheel_next(&fibre_timers, &next)) {
+		now = (unsigned long)fibre_clock();
+		if (next <= now) {
+			timeout = 0;
+		} else if (next - now < INT_MAX) {
+			timeout = (int)(next - now);
+		} else {
+			timeout = INT_MAX;
+		}
+		fibre_poll_deadline = next;
+	}
+	fibre_poll_blocked = 1;
+	pthread_mutex_unlock(&fibre_timers_lock);
+
+	return timeout;
+}
+
+static
+void
+fibre_timers_poll_done(void)
+{
+	pthread_mutex_lock(&fibre_timers_lock);
+	fibre_poll_blocked = 0;
+	fibre_poll_deadline = ULONG_MAX;
+	pthread_mutex_unlock(&fibre_timers_lock);
+}
+
+static
+int
+fibre_worker_should_poll(void)
+{
+	return fibre_io_waiting() || fibre_timers_pending();
+}
+
+/*
+ * Called by a worker that has stopped polling to go and run fibres.  If fibres
+ * are still waiting for I/O or timers, then a parked worker should take over,
+ * so that they are not left waiting until this one next has nothing to do.
+ */
+static
+void
+fibre_worker_handoff_poll(struct fibre_worker *worker)
+{
+	if (fibre_worker_should_poll()) {
+		fibre_workers_notify(worker);
+	}
+}
+
+/*
+ * Checks for I/O and timers without blocking, for a worker that is too busy
+ * to park.
+ */
+static
+void
+fibre_worker_poll_busy(struct fibre_worker *worker)
+{
+	if (!fibre_worker_should_poll()) {
+		return;
+	}
+	if (fibre_io_waiting() && fibre_io_claim_poller()) {
+		fibre_io_poll(0);
+		fibre_io_release_poller();
+	}
+	fibre_timers_run();
+	fibre_worker_handoff_poll(worker);
+}
+
+/*
+ * Blocks the calling thread until there might be a fibre for its worker to
+ * run.  Returns zero if the worker should exit instead.
+ *
+ * If any fibres are waiting for I/O or timers, then one parked worker waits
+ * in fibre_io_poll, until the next timer is due, instead of on its condition
+ * variable, and is woken up by fibre_io_interrupt instead.
+ */
+static
+int
+fibre_worker_park(struct fibre_worker *worker)
+{
+	int keep_going, polled = 0;
+
+	pthread_mutex_lock(&worker->fw_lock);
+	__atomic_store_n(&worker->fw_parked, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+	if (!fibre_worker_has_work(worker)) {
+		__atomic_add_fetch(&fibre_stats.fstat_parks, 1, __ATOMIC_RELAXED);
+		if (fibre_worker_should_poll() && fibre_io_claim_poller()) {
+			worker->fw_polling = 1;
+			pthread_mutex_unlock(&worker->fw_lock);
+			fibre_io_poll(fibre_timers_poll_timeout());
+			fibre_timers_poll_done();
+			pthread_mutex_lock(&worker->fw_lock);
+			worker->fw_polling = 0;
+			fibre_io_release_poller();
+			polled = 1;
+		} else {
+			while (__atomic_load_n(&worker->fw_parked, __ATOMIC_SEQ_CST) &&
+			       !workers_shutdown) {
+				pthread_cond_wait(&worker->fw_cond, &worker->fw_lock);
+			}
+		}
+	}
+	if (__atomic_exchange_n(&worker->fw_parked, 0, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&parked_workers, 1, __ATOMIC_SEQ_CST);
+	}
+	keep_going = !workers_shutdown;
+	pthread_mutex_unlock(&worker->fw_lock);
+
+	if (polled && keep_going) {
+		fibre_timers_run();
+		fibre_worker_handoff_poll(worker);
+	}
+
+	return keep_going;
+}
+
+/*
+ * Ready fibres go back to the worker they are pinned to if they are pinned,
+ * and otherwise onto the deque of the worker that made them ready, from where
+ * they can be stolen.  'now' is the time from fibre_clock_ns, for working out
+ * how long the fibre waits to run.
+ */
+static
+void
+fibre_enqueue_at(struct fibre *fibre, long now)
+{
+	struct fibre_worker *worker = fibre->f_pin;
+	struct fibre_deque *deque;
+
+	fibre->f_ready_at = now;
+	if (worker != NULL) {
+		pthread_mutex_lock(&worker->fw_lock);
+		fibre_store_list_enqueue(&worker->fw_pinned[fibre->f_prio], fibre);
+		pthread_mutex_unlock(&worker->fw_lock);
+		fibre_worker_unpark(worker);
+		return;
+	}
+
+	worker = fibre_worker_self();
+	deque = &worker->fw_deques[fibre->f_prio];
+	fibre_deque_push(deque, global_fibre_store.fs_alloc, fibre);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	fibre_stat_depth(worker, fibre_deque_size(deque));
+	fibre_workers_notify(worker);
+}
+
+static
+void
+fibre_enqueue(struct fibre *fibre)
+{
+	fibre_enqueue_at(fibre, fibre_clock_ns());
+}
+
+/*
+ * This must be called immediately after every fibre_switch, and at the start
+ * of every new fibre, to finish with the fibre that was switched away from.
+ * Until now we were still on its stack, so it was not safe for anyone else to
+ * run it or reuse it.
+ */
+static
+void
+fibre_after_switch(void)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+	struct fibre *prev = worker->fw_prev;
+	int action = worker->fw_prev_action;
+
+	worker->fw_prev = NULL;
+	if (prev == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&prev->f_oncpu, 0, __ATOMIC_RELEASE);
+
+	switch (action) {
+	case FSA_NONE:
+		break;
+	case FSA_REQUEUE:
+		/* it stopped running at the switch, just now */
+		fibre_enqueue_at(prev, worker->fw_switched_at);
+		break;
+	case FSA_RELEASE:
+		fibre_stack_put(prev);
+		fibre_store_release(&global_fibre_store, prev);
+		break;
+	default:
+		abort_with_error("invalid fibre switch action %d\n", action);
+	}
+}
+
+/*
+ * Switches from the current fibre of the worker to 'next'.  When this returns
+ * we are back in the original fibre, though possibly on a different worker.
+ */
+static
+void
+fibre_run(struct fibre_worker *worker, struct fibre *next, int action)
+{
+	struct fibre *prev = worker->fw_current;
+	long now = fibre_clock_ns();
+
+	if (next->f_ready_at != 0) {
+		long wait = now - next->f_ready_at;
+		fibre_stat_queue_wait(worker, next->f_prio, wait);
+		if (next->f_prio == FP_HIGH && wait >
+		    __atomic_load_n(&fibre_latency_budget, __ATOMIC_RELAXED)) {
+			fibre_stat_add(&worker->fw_budget_misses, 1);
+		}
+		next->f_ready_at = 0;
+	}
+
+	if (next == prev) {
+		/* we were woken up before we managed to go to sleep */
+		assert1(action == FSA_NONE);
+		prev->f_state = FS_ACTIVE;
+		return;
+	}
+
+	fibre_stat_slice(worker, prev, now - worker->fw_switched_at);
+	worker->fw_switched_at = now;
+	fibre_stat_add(&next->f_switches, 1);
+
+	while (__atomic_load_n(&next->f_oncpu, __ATOMIC_ACQUIRE)) {
+#ifdef __GNUC__
+		__builtin_ia32_pause();
+#endif
+	}
+	next->f_oncpu = 1;
+	next->f_state = FS_ACTIVE;
+
+	worker->fw_current = next;
+	worker->fw_prev = prev;
+	worker->fw_prev_action = action;
+
+	fibre_switch(&prev->f_ctx, &next->f_ctx);
+	fibre_after_switch();
+}
+
+/*
+ * Gives up the worker without putting the current fibre on a ready list.  The
+ * caller must already have arranged for someone to call fibre_wake on it.
+ */
+static
+void
+fibre_block(void)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+	struct fibre *next = fibre_worker_get_next_ready(worker);
+
+	if (next == NULL) {
+		next = worker->fw_idle;
+	}
+	fibre_run(worker, next, FSA_NONE);
+}
+
+/*
+ * Makes a fibre that is waiting in fibre_wait ready to run again.  It goes on
+ * the ready queues, and runs whenever the scheduler gets around to it.
+ */
+void
+fibre_wake(struct fibre *fibre)
+{
+	fibre->f_state = FS_READY;
+	fibre_enqueue(fibre);
+}
+
+/*
+ * This is the body of every worker's idle fibre.  It runs whatever is ready,
+ * and sleeps when nothing is.
+ */
+static
+void
+fibre_worker_idle(struct fibre_worker *worker)
+{
+	for (;;) {
+		struct fibre *next = fibre_worker_get_next_ready(worker);
+
+		if (next != NULL) {
+			fibre_run(worker, next, FSA_NONE);
+		} else if (!fibre_worker_park(worker)) {
+			return;
+		}
+	}
+}
+
+static
+void
+fibre_idle_start(void *arg)
+{
+	(void)arg;
+	fibre_worker_idle(fibre_worker_self());
+	abort_with_error("idle fibre of worker 0 returned\n");
+}
+
+static
+void *
+fibre_worker_main(void *arg)
+{
+	struct fibre_worker *worker = arg;
+
+	this_worker = worker;
+	fibre_worker_idle(worker);
+
+	return NULL;
+}
+
+/*
+ * Every fibre starts here, called from fibre_entry with the argument that was
+ * given to fibre_go.
+ */
+static
+void
+fibre_start(void *arg, struct fibre *self)
+{
+	fibre_after_switch();
+	if (self->f_join != NULL) {
+		self->f_join->fj_result = self->f_jfunc(arg);
+	} else {
+		self->f_func(arg);
+	}
+	fibre_return();
+}
+
+/*
+ * Sets up a fibre's context so that switching to it 'returns' into
+ * fibre_entry, which calls fibre_start(arg, fibre) from the registers set up
+ * here.  The stack pointer is left where fibre_entry needs it to be to make a
+ * properly aligned call.
+ */
+static
+void
+fibre_prepare(struct fibre *fibre, char *stack, size_t size, void *arg)
+{
+	*(uint64_t *)&stack[size - 8] = (uint64_t)fibre_entry;
+	fibre->f_ctx.fc_rsp = (uint64_t)&stack[size - 8];
+	fibre->f_ctx.fc_rbx = (uint64_t)fibre_start;
+	fibre->f_ctx.fc_r12 = (uint64_t)arg;
+	fibre->f_ctx.fc_r13 = (uint64_t)fibre;
+	fibre->f_ctx.fc_rbp = 0;
+	/* new fibres start with the floating-point modes of their creator */
+	fibre_save_fpu(&fibre->f_ctx);
+	fibre->f_stack = stack;
+}
+
+static
+void
+fibre_worker_init(struct fibre_worker *worker, size_t id)
+{
+	struct fibre *idle = fibre_store_get_first_empty(&global_fibre_store);
+	size_t i;
+
+	worker->fw_id = id;
+	worker->fw_prev = NULL;
+	worker->fw_prev_action = FSA_NONE;
+	worker->fw_parked = 0;
+	worker->fw_victim = 0;
+	worker->fw_polling = 0;
+	worker->fw_yields = 0;
+	worker->fw_switched_at = fibre_clock_ns();
+	worker->fw_polled_at = worker->fw_switched_at;
+	worker->fw_aged = 0;
+	worker->fw_budget_misses = 0;
+	worker->fw_switches = 0;
+	worker->fw_max_slice_ns = 0;
+	for (i = 0; i < FIBRE_DEPTH_BUCKETS; i++) {
+		worker->fw_depths[i] = 0;
+	}
+	pthread_mutex_init(&worker->fw_lock, NULL);
+	pthread_cond_init(&worker->fw_cond, NULL);
+	for (i = 0; i < FP_NUM_PRIOS; i++) {
+		fibre_store_list_init(&worker->fw_pinned[i]);
+		fibre_deque_init(&worker->fw_deques[i],
+			global_fibre_store.fs_alloc);
+		worker->fw_queue_wait_ns[i] = 0;
+		worker->fw_queue_waits[i] = 0;
+		worker->fw_queue_wait_max_ns[i] = 0;
+		worker->fw_passed[i] = 0;
+	}
+
+	idle->f_prio = FP_BACKGROUND;
+	idle->f_pin = worker;
+	worker->fw_idle = idle;
+
+	if (id == 0) {
+		/* the main fibre is running on this thread's stack */
+		size_t class = global_fibre_store.fs_default_class;
+		idle->f_state = FS_READY;
+		idle->f_func = fibre_idle_start;
+		fibre_prepare(idle, fibre_stack_get(idle, class),
+			global_fibre_store.fs_stacks[class].stp_size, NULL);
+	} else {
+		idle->f_state = FS_ACTIVE;
+		idle->f_oncpu = 1;
+		worker->fw_current = idle;
+	}
+}
+
+void
+fibre_init(struct alloc *alloc, size_t stack_size, size_t nworkers)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if (nworkers == 0) {
+		nworkers = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	log_info("fibre",
+		"Initialising fibre system with %luKiB-sized stacks "
+		"on %lu workers\n",
+	        stack_size / 1024, nworkers);
+
+#define BLOCK_SIZE (sizeof(struct fibre_store_block))
+#define NODE_SIZE (sizeof(struct fibre_store_node))
+	if (BLOCK_SIZE > page_size) {
+		log_warning("fibre",
+			"fibre_store_block is too big to fit in a page: "
+			"lower FIBRE_STORE_NODES_PER_BLOCK (%lu)\n",
+			BLOCK_SIZE);
+	} else if (BLOCK_SIZE + NODE_SIZE <= page_size) {
+		log_notice("fibre",
+			"fibre_store_block could be bigger: "
+			"raise FIBRE_STORE_NODES_PER_BLOCK (%lu)\n",
+			BLOCK_SIZE);
+	} else {
+		log_info("fibre",
+			"fibre_store_block fits perfectly in a page (%lu)\n",
+			BLOCK_SIZE);
+	}
+#undef BLOCK_SIZE
+#undef NODE_SIZE
+
+	global_fibre_store.fs_alloc = alloc;
+	/* the pools' free lists are small and grow often, which suits malloc */
+	for (i = 0; i < FIBRE_STACK_CLASSES; i++) {
+		stack_pool_init(&global_fibre_store.fs_stacks[i], &sys_alloc,
+			FIBRE_MIN_STACK_SIZE << i);
+	}
+	global_fibre_store.fs_default_class = fibre_stack_class(stack_size);
+	global_fibre_store.fs_blocks = NULL;
+	fibre_store_list_init(&global_fibre_store.fs_empties);
+	pthread_mutex_init(&global_fibre_store.fs_lock, NULL);
+
+	num_workers = nworkers;
+	parked_workers = 0;
+	workers_shutdown = 0;
+	fibre_stats_reset();
+	fibre_io_init();
+	fibre_timers_init();
+	live_fibres = 0;
+	fibre_joiner = NULL;
+	workers = allocarray_with(alloc, sizeof *workers, nworkers);
+	for (i = 0; i < nworkers; i++) {
+		fibre_worker_init(&workers[i], i);
+	}
+
+	main_fibre = fibre_store_get_first_empty(&global_fibre_store);
+	main_fibre->f_state = FS_ACTIVE;
+	main_fibre->f_prio = FP_NORMAL; /* is this right? */
+	main_fibre->f_stack = NULL;
+	main_fibre->f_oncpu = 1;
+	/* fibre_finish must be called on the thread that called fibre_init */
+	main_fibre->f_pin = &workers[0];
+
+	workers[0].fw_current = main_fibre;
+	this_worker = &workers[0];
+
+	for (i = 1; i < nworkers; i++) {
+		if (pthread_create(&workers[i].fw_thread, NULL,
+				fibre_worker_main, &workers[i]) != 0) {
+			abort_with_error("Could not start fibre worker %lu\n", i);
+		}
+	}
+}
+
+static
+void
+fibre_store_destroy(struct fibre_store *store)
+{
+	size_t i;
+
+	while (store->fs_blocks != NULL) {
+		struct fibre_store_block *next = store->fs_blocks->fsb_next;
+		deallocate_with(store->fs_alloc,
+			store->fs_blocks,
+			sizeof *store->fs_blocks);
+		store->fs_blocks = next;
+	}
+	for (i = 0; i < FIBRE_STACK_CLASSES; i++) {
+		stack_pool_finish(&store->fs_stacks[i]);
+	}
+	pthread_mutex_destroy(&store->fs_lock);
+}
+
+static
+void
+fibre_workers_stop(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_lock(&workers[i].fw_lock);
+		workers_shutdown = 1;
+		if (workers[i].fw_polling) {
+			fibre_io_interrupt();
+		}
+		pthread_cond_signal(&workers[i].fw_cond);
+		pthread_mutex_unlock(&workers[i].fw_lock);
+	}
+
+	for (i = 1; i < num_workers; i++) {
+		pthread_join(workers[i].fw_thread, NULL);
+	}
+	fibre_stack_put(workers[0].fw_idle);
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_destroy(&workers[i].fw_lock);
+		pthread_cond_destroy(&workers[i].fw_cond);
+		for (j = 0; j < FP_NUM_PRIOS; j++) {
+			fibre_deque_finish(&workers[i].fw_deques[j],
+				global_fibre_store.fs_alloc);
+		}
+	}
+	deallocarray_with(global_fibre_store.fs_alloc,
+		workers, sizeof *workers, num_workers);
+	workers = NULL;
+}
+
+void
+fibre_finish(void)
+{
+	struct fibre_stats stats;
+	size_t i;
+
+	log_info("fibre", "Deinitialising fibre system\n");
+
+	fibre_get_stats(&stats);
+	log_info("fibre",
+		"Fibre stat stack_allocs: %ld\n", stats.fstat_stack_allocs);
+	log_info("fibre",
+		"Fibre stat stack_reuses: %ld\n", stats.fstat_stack_reuses);
+	log_info("fibre",
+		"Fibre stat fibre_go_calls: %ld\n", stats.fstat_fibre_go_calls);
+	log_info("fibre",
+		"Fibre stat steals: %ld\n", stats.fstat_steals);
+	log_info("fibre",
+		"Fibre stat parks: %ld\n", stats.fstat_parks);
+	log_info("fibre",
+		"Fibre stat switches: %ld\n", stats.fstat_switches);
+	log_info("fibre",
+		"Fibre stat max_slice_ns: %ld\n", stats.fstat_max_slice_ns);
+	log_info("fibre",
+		"Fibre stat aged: %ld\n", stats.fstat_aged);
+	log_info("fibre",
+		"Fibre stat budget_misses: %ld\n", stats.fstat_budget_misses);
+	for (i = 0; i < FP_NUM_PRIOS; i++) {
+		log_info("fibre",
+			"Fibre stat queue_waits[%lu]: %ld, %ld ns total, %ld ns max\n",
+			i, stats.fstat_queue_waits[i], stats.fstat_queue_wait_ns[i],
+			stats.fstat_queue_wait_max_ns[i]);
+	}
+	for (i = 0; i < FIBRE_STACK_CLASSES; i++) {
+		if (stats.fstat_stack_high_water[i] != 0) {
+			log_info("fibre",
+				"Fibre stat stack_high_water[%luKiB]: %ld\n",
+				(FIBRE_MIN_STACK_SIZE << i) / 1024,
+				stats.fstat_stack_high_water[i]);
+		}
+	}
+
+	fibre_workers_stop();
+	fibre_io_finish();
+	fibre_timers_finish();
+	fibre_store_destroy(&global_fibre_store);
+}
+
+/*
+ * Waits for every fibre started with fibre_go to return.  Only the main fibre
+ * ever waits like this, so there is a single fibre_joiner slot.  Whoever swaps
+ * it back to NULL owns the wakeup: if that is the last fibre to return, then
+ * we must block to consume the wakeup, even if it has already happened.
+ */
+static
+void
+fibre_wait_all(void)
+{
+	struct fibre *self = fibre_worker_self()->fw_current;
+
+	self->f_state = FS_WAITING;
+	__atomic_store_n(&fibre_joiner, self, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&live_fibres, __ATOMIC_SEQ_CST) != 0 ||
+	    __atomic_exchange_n(&fibre_joiner, NULL, __ATOMIC_SEQ_CST) == NULL) {
+		fibre_block();
+	}
+	self->f_state = FS_ACTIVE;
+}
+
+/*
+ * Keys are handed out in order and never given back, so the destructor for
+ * a key is set once, before anyone can use the key.
+ */
+static size_t fibre_local_nkeys;
+static void (*fibre_local_destructors[FIBRE_LOCAL_SLOTS])(void *);
+
+/*
+ * Returns a new key for fibre-local storage.  Every fibre starts with the
+ * value for every key set to NULL.  When a fibre returns, 'destructor', which
+ * may be NULL, is called on its value for the key if that value is not NULL.
+ */
+size_t
+fibre_local_key_create(void (*destructor)(void *))
+{
+	size_t key = __atomic_fetch_add(&fibre_local_nkeys, 1, __ATOMIC_RELAXED);
+
+	if (key >= FIBRE_LOCAL_SLOTS) {
+		abort_with_error("Out of fibre-local storage keys (%d)\n",
+			FIBRE_LOCAL_SLOTS);
+	}
+	fibre_local_destructors[key] = destructor;
+	return key;
+}
+
+void *
+fibre_local_get(size_t key)
+{
+	assert1(key < FIBRE_LOCAL_SLOTS);
+	return fibre_worker_self()->fw_current->f_ctx.fc_local[key];
+}
+
+void
+fibre_local_set(size_t key, void *value)
+{
+	assert1(key < FIBRE_LOCAL_SLOTS);
+	fibre_worker_self()->fw_current->f_ctx.fc_local[key] = value;
+}
+
+/*
+ * Runs the destructors for a fibre's fibre-local storage, leaving every slot
+ * empty for whoever reuses the fibre.  Each value is cleared before its
+ * destructor is called.  A destructor may set other values, so this goes
+ * round again until they are all empty, but gives up eventually.
+ */
+static
+void
+fibre_local_destroy(struct fibre *fibre)
+{
+	void **local = fibre->f_ctx.fc_local;
+	int rounds, again = 1;
+	size_t i;
+
+	for (rounds = 0; again && rounds < FIBRE_LOCAL_DESTRUCTOR_ROUNDS; rounds++) {
+		again = 0;
+		for (i = 0; i < FIBRE_LOCAL_SLOTS; i++) {
+			void *value = local[i];
+			if (value == NULL) {
+				continue;
+			}
+			local[i] = NULL;
+			if (fibre_local_destructors[i] != NULL) {
+				fibre_local_destructors[i](value);
+				again = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < FIBRE_LOCAL_SLOTS; i++) {
+		if (local[i] != NULL) {
+			log_warning("fibre", "fibre-local value for key %lu "
+				"still set after destructors ran\n", i);
+			local[i] = NULL;
+		}
+	}
+}
+
+void
+fibre_return(void)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+	struct fibre *current_fibre = worker->fw_current;
+
+	log_debug("fibre", "Returning from fibre %p\n", (void *)current_fibre);
+
+	if (current_fibre != main_fibre) {
+		struct fibre *next;
+
+		if (current_fibre->f_cancel_scope != NULL) {
+			abort_with_error("fibre %p returned inside a cancel scope\n",
+				(void *)current_fibre);
+		}
+		fibre_local_destroy(current_fibre);
+
+		/* the stack goes back to the pool in fibre_after_switch */
+		current_fibre->f_state = FS_EMPTY;
+#ifdef USE_VALGRIND
+		VALGRIND_STACK_DEREGISTER(current_fibre->f_valgrind_id);
+#endif
+		if (current_fibre->f_join != NULL) {
+			fibre_join_complete(current_fibre->f_join);
+			current_fibre->f_join = NULL;
+		}
+		if (__atomic_sub_fetch(&live_fibres, 1, __ATOMIC_SEQ_CST) == 0) {
+			struct fibre *joiner = __atomic_exchange_n(
+				&fibre_joiner, NULL, __ATOMIC_SEQ_CST);
+			if (joiner != NULL) {
+				fibre_wake(joiner);
+			}
+		}
+
+		next = fibre_worker_get_next_ready(worker);
+		if (next == NULL) {
+			next = worker->fw_idle;
+		}
+		fibre_run(worker, next, FSA_RELEASE);
+		abort_with_error("returned fibre %p was resumed\n",
+			(void *)current_fibre);
+	}
+	fibre_wait_all();
+	fibre_finish();
+}
+
+/*
+ * Lets other fibres run.  Returns 1 if it switched to one, zero if there was
+ * nothing else to run, and FIBRE_CANCELLED either way if the current fibre
+ * has been cancelled.
+ */
+int
+fibre_yield(void)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+	struct fibre *fibre;
+
+	/* busy workers never park, so check for I/O every so often instead */
+	if (++worker->fw_yields % FIBRE_POLL_INTERVAL == 0) {
+		fibre_worker_poll_busy(worker);
+	}
+
+	/* this is the hot path, so there is no logging here */
+	fibre = fibre_worker_get_next_ready(worker);
+	if (fibre == NULL) {
+		return fibre_cancelled() ? FIBRE_CANCELLED : 0;
+	}
+
+	worker->fw_current->f_state = FS_READY;
+	fibre_run(worker, fibre, FSA_REQUEUE);
+	return fibre_cancelled() ? FIBRE_CANCELLED : 1;
+}
+
+struct fibre *
+fibre_self(void)
+{
+	return fibre_worker_self()->fw_current;
+}
+
+/*
+ * Suspends the current fibre until another fibre passes it to fibre_wake or
+ * fibre_yield_to.  Each call must be matched by exactly one of those: a wakeup
+ * that arrives before the fibre gets around to waiting is not lost, but two
+ * wakeups for one wait will corrupt the ready queues.
+ */
+void
+fibre_wait(void)
+{
+	struct fibre *self = fibre_worker_self()->fw_current;
+
+	self->f_state = FS_WAITING;
+	fibre_block();
+	self->f_state = FS_ACTIVE;
+}
+
+/*
+ * A sleeping fibre is woken either by its timer or by being cancelled, and
+ * whichever claims it first does the waking.
+ */
+struct fibre_sleeper {
+	struct fibre *fsl_fibre;
+	int fsl_claimed;
+	int fsl_cancelled;
+};
+
+static
+int
+fibre_sleeper_claim(struct fibre_sleeper *sleeper)
+{
+	int expected = 0;
+
+	return __atomic_compare_exchange_n(&sleeper->fsl_claimed, &expected, 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static
+void
+fibre_sleep_done(void *arg)
+{
+	struct fibre_sleeper *sleeper = arg;
+
+	if (fibre_sleeper_claim(sleeper)) {
+		fibre_wake(sleeper->fsl_fibre);
+	}
+}
+
+static
+void
+fibre_sleep_cancel(void *arg)
+{
+	struct fibre_sleeper *sleeper = arg;
+
+	if (fibre_sleeper_claim(sleeper)) {
+		sleeper->fsl_cancelled = 1;
+		fibre_wake(sleeper->fsl_fibre);
+	}
+}
+
+/*
+ * Waits until fibre_clock reaches 'deadline', while other fibres run.  Returns
+ * FIBRE_CANCELLED if the sleep was cut short by cancellation, and otherwise
+ * zero.
+ */
+int
+fibre_sleep_until(long deadline)
+{
+	struct fibre_sleeper sleeper;
+	struct fibre_timer timer;
+
+	if (fibre_cancelled()) {
+		return FIBRE_CANCELLED;
+	}
+
+	sleeper.fsl_fibre = fibre_self();
+	sleeper.fsl_claimed = 0;
+	sleeper.fsl_cancelled = 0;
+	fibre_timer_init(&timer);
+	fibre_timer_start(&timer, deadline, fibre_sleep_done, &sleeper);
+	fibre_wait_cancellable(fibre_sleep_cancel, &sleeper);
+	/* wait for the callback to be finished with the timer */
+	fibre_timer_cancel(&timer);
+
+	return sleeper.fsl_cancelled ? FIBRE_CANCELLED : 0;
+}
+
+int
+fibre_sleep(long ms)
+{
+	return fibre_sleep_until(fibre_clock() + ms);
+}
+
+/*
+ * Wakes a fibre that is waiting in fibre_wait and switches straight to it on
+ * this worker, without passing it through the ready queues.  The current fibre
+ * is made ready and queued as if it had called fibre_yield.  This is what lets
+ * a fibre that has just handed something to a waiting fibre get it running in
+ * a single switch.
+ *
+ * If the target has not quite finished going to sleep on some other worker,
+ * this spins until it has.  A fibre pinned to some other worker cannot run
+ * here, so it is woken normally instead, and zero is returned.
+ */
+int
+fibre_yield_to(struct fibre *fibre)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+
+	assert1(fibre != worker->fw_current);
+	if (fibre->f_pin != NULL && fibre->f_pin != worker) {
+		fibre_wake(fibre);
+		return 0;
+	}
+
+	worker->fw_current->f_state = FS_READY;
+	fibre_run(worker, fibre, FSA_REQUEUE);
+	return 1;
+}
+
+/*
+ * Sets the priority of the current fibre, which takes effect the next time it
+ * is made ready.
+ */
+void
+fibre_set_prio(enum fibre_prio prio)
+{
+	assert1(prio < FP_NUM_PRIOS);
+	fibre_worker_self()->fw_current->f_prio = (short)prio;
+}
+
+/*
+ * Sets how long an FP_HIGH fibre may be kept waiting to run, in nanoseconds,
+ * which is the latency that fibre_should_yield aims for.  Going over it is
+ * counted in fstat_budget_misses.
+ */
+void
+fibre_set_latency_budget(long ns)
+{
+	assert1(ns > 0);
+	__atomic_store_n(&fibre_latency_budget, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * This is the preemption point for fibres that run for a long time without
+ * waiting.  It returns 1 if the current fibre ought to yield: either a fibre
+ * of higher priority is ready to run, or the current fibre has run for longer
+ * than the latency budget while another of the same priority is ready.
+ *
+ * While a fibre like that is running, nobody else on its worker is checking
+ * for input or timers, so this does that too, a few times per budget.  It
+ * costs about as much as reading the clock.
+ */
+int
+fibre_should_yield(void)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+	size_t prio = (size_t)worker->fw_current->f_prio;
+	long budget = __atomic_load_n(&fibre_latency_budget, __ATOMIC_RELAXED);
+	long now = fibre_clock_ns();
+
+	if (now - worker->fw_polled_at >= budget / FIBRE_POLLS_PER_BUDGET) {
+		worker->fw_polled_at = now;
+		fibre_worker_poll_busy(worker);
+	}
+
+	if (fibre_worker_ready_above(worker, prio)) {
+		return 1;
+	}
+	return now - worker->fw_switched_at >= budget &&
+		fibre_worker_ready_above(worker, prio + 1);
+}
+
+/*
+ * Yields if fibre_should_yield says so.  Returns what fibre_yield would, or
+ * zero if it did not yield, or FIBRE_CANCELLED either way if the current
+ * fibre has been cancelled.
+ */
+int
+fibre_maybe_yield(void)
+{
+	if (fibre_should_yield()) {
+		return fibre_yield();
+	}
+	return fibre_cancelled() ? FIBRE_CANCELLED : 0;
+}
+
+static
+void
+fibre_spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+#ifdef __GNUC__
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+}
+
+static
+void
+fibre_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static
+void
+fibre_cancel_scope_expire(void *arg)
+{
+	fibre_cancel(arg);
+}
+
+/*
+ * 'deadline' is when the scope cancels itself, or FIBRE_NO_DEADLINE.  A scope
+ * may be cancelled before it is entered, in which case everything inside it
+ * is cancelled from the start.
+ */
+void
+fibre_cancel_scope_init(struct fibre_cancel_scope *scope, long deadline)
+{
+	scope->fcs_parent = NULL;
+	scope->fcs_fibre = NULL;
+	scope->fcs_deadline = deadline;
+	scope->fcs_cancelled = 0;
+	scope->fcs_lock = 0;
+	fibre_timer_init(&scope->fcs_timer);
+}
+
+/*
+ * Makes the scope the innermost one of the current fibre.  Scopes are exited
+ * in the reverse of the order they were entered in, and a fibre must have
+ * exited all of them before it returns.
+ */
+void
+fibre_cancel_scope_enter(struct fibre_cancel_scope *scope)
+{
+	struct fibre *self = fibre_self();
+
+	scope->fcs_parent = self->f_cancel_scope;
+	self->f_cancel_scope = scope;
+
+	fibre_spin_lock(&scope->fcs_lock);
+	scope->fcs_fibre = self;
+	fibre_spin_unlock(&scope->fcs_lock);
+
+	if (scope->fcs_deadline != FIBRE_NO_DEADLINE) {
+		fibre_timer_start(&scope->fcs_timer, scope->fcs_deadline,
+			fibre_cancel_scope_expire, scope);
+	}
+}
+
+/*
+ * Returns 1 if the scope was cancelled, whether by fibre_cancel or by its
+ * deadline passing.  Once this returns, the scope is no longer attached to
+ * the fibre, and cancelling it again has no effect on it.
+ */
+int
+fibre_cancel_scope_exit(struct fibre_cancel_scope *scope)
+{
+	struct fibre *self = fibre_self();
+
+	assert1(self->f_cancel_scope == scope);
+
+	if (scope->fcs_deadline != FIBRE_NO_DEADLINE) {
+		fibre_timer_cancel(&scope->fcs_timer);
+	}
+
+	fibre_spin_lock(&scope->fcs_lock);
+	scope->fcs_fibre = NULL;
+	fibre_spin_unlock(&scope->fcs_lock);
+
+	self->f_cancel_scope = scope->fcs_parent;
+	return __atomic_load_n(&scope->fcs_cancelled, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Cancels everything inside the scope, from any fibre or from a timer
+ * callback.  If the fibre inside it is waiting at a cancellation point, it is
+ * woken up, and every cancellation point it reaches until it leaves the scope
+ * returns straight away.  Cancelling a scope twice does nothing more.
+ */
+void
+fibre_cancel(struct fibre_cancel_scope *scope)
+{
+	struct fibre *fibre;
+
+	fibre_spin_lock(&scope->fcs_lock);
+	__atomic_store_n(&scope->fcs_cancelled, 1, __ATOMIC_SEQ_CST);
+	fibre = scope->fcs_fibre;
+	if (fibre != NULL) {
+		fibre_spin_lock(&fibre->f_cancel_lock);
+		if (fibre->f_cancel_hook != NULL) {
+			fibre->f_cancel_hook(fibre->f_cancel_arg);
+		}
+		fibre_spin_unlock(&fibre->f_cancel_lock);
+	}
+	fibre_spin_unlock(&scope->fcs_lock);
+}
+
+/*
+ * Returns 1 if any scope the current fibre is in has been cancelled.  This is
+ * what long-running fibres check between pieces of work.
+ */
+int
+fibre_cancelled(void)
+{
+	struct fibre_cancel_scope *scope = fibre_self()->f_cancel_scope;
+
+	for (; scope != NULL; scope = scope->fcs_parent) {
+		if (__atomic_load_n(&scope->fcs_cancelled, __ATOMIC_SEQ_CST)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Like fibre_wait, except that if the fibre is or becomes cancelled while it
+ * is waiting, 'hook(arg)' is called to get it woken up.  The hook races with
+ * whatever else would have woken the fibre, and must make sure that only one
+ * of them calls fibre_wake.  It may be called more than once, from any thread,
+ * and must not block.  It is never called after this returns.
+ */
+void
+fibre_wait_cancellable(void (*hook)(void *), void *arg)
+{
+	struct fibre *self = fibre_self();
+
+	fibre_spin_lock(&self->f_cancel_lock);
+	self->f_cancel_hook = hook;
+	self->f_cancel_arg = arg;
+	/* if the cancellation came first, it missed the hook */
+	if (fibre_cancelled()) {
+		hook(arg);
+	}
+	fibre_spin_unlock(&self->f_cancel_lock);
+
+	fibre_wait();
+
+	fibre_spin_lock(&self->f_cancel_lock);
+	self->f_cancel_hook = NULL;
+	self->f_cancel_arg = NULL;
+	fibre_spin_unlock(&self->f_cancel_lock);
+}
+
+#define FMTREG "0x%010llx"
+
+static
+struct fibre *
+fibre_create(void *arg, size_t class)
+{
+	char *stack;
+	size_t size = global_fibre_store.fs_stacks[class].stp_size;
+	struct fibre *fibre = fibre_store_get_first_empty(&global_fibre_store);
+
+	__atomic_add_fetch(&fibre_stats.fstat_fibre_go_calls, 1, __ATOMIC_RELAXED);
+	stack = fibre_stack_get(fibre, class);
+#ifdef USE_VALGRIND
+	fibre->f_valgrind_id = VALGRIND_STACK_REGISTER(stack, stack + size);
+#endif
+
+	fibre_prepare(fibre, stack, size, arg);
 	fibre->f_state = FS_READY;
 	fibre->f_prio = FP_NORMAL;
-	fibre->f_stack = stack;
+	fibre_run_stats_reset(fibre);
+
+	return fibre;
+}
+
+static
+void
+fibre_start_ready(struct fibre *fibre)
+{
+	__atomic_add_fetch(&live_fibres, 1, __ATOMIC_SEQ_CST);
 	fibre_enqueue(fibre);
 }
+
+void
+fibre_go(void (*f)(void *), void *arg)
+{
+	struct fibre *fibre = fibre_create(arg,
+		global_fibre_store.fs_default_class);
+
+	fibre->f_func = f;
+	fibre_start_ready(fibre);
+}
+
+/*
+ * Like fibre_go, but the fibre's stack holds at least 'stack_size' bytes
+ * instead of the size given to fibre_init.  Stacks only take memory for the
+ * pages that are touched, so the size is about how deep the fibre might go
+ * rather than how deep it usually goes, but a smaller class packs more stacks
+ * into each mapping.
+ */
+void
+fibre_go_sized(void (*f)(void *), void *arg, size_t stack_size)
+{
+	struct fibre *fibre = fibre_create(arg, fibre_stack_class(stack_size));
+
+	fibre->f_func = f;
+	fibre_start_ready(fibre);
+}
+
+static
+void
+fibre_go_join_class(struct fibre_join *join, void *(*f)(void *), void *arg,
+	size_t class)
+{
+	struct fibre *fibre = fibre_create(arg, class);
+
+	join->fj_result = NULL;
+	join->fj_waiter = NULL;
+	fibre->f_jfunc = f;
+	fibre->f_join = join;
+	fibre_start_ready(fibre);
+}
+
+/*
+ * Like fibre_go, but the result of 'f' can be collected with fibre_join.  The
+ * join handle belongs to the caller and can live on its stack, as long as it
+ * is joined before it goes out of scope.
+ */
+void
+fibre_go_join(struct fibre_join *join, void *(*f)(void *), void *arg)
+{
+	fibre_go_join_class(join, f, arg, global_fibre_store.fs_default_class);
+}
+
+void
+fibre_go_join_sized(struct fibre_join *join, void *(*f)(void *), void *arg,
+	size_t stack_size)
+{
+	fibre_go_join_class(join, f, arg, fibre_stack_class(stack_size));
+}
+
+/*
+ * fj_waiter is NULL while the fibre is running and nobody is waiting, the
+ * waiting fibre once someone is, and &fibre_join_done once the result is in.
+ * The fibre being joined must not touch the join handle after it has swapped
+ * in &fibre_join_done, because the joiner may return and free it straight
+ * away.
+ */
+static struct fibre fibre_join_done;
+
+static
+void
+fibre_join_complete(struct fibre_join *join)
+{
+	struct fibre *waiter = __atomic_exchange_n(&join->fj_waiter,
+		&fibre_join_done, __ATOMIC_ACQ_REL);
+
+	if (waiter != NULL) {
+		fibre_wake(waiter);
+	}
+}
+
+/*
+ * This is not a cancellation point: the joined fibre is still using whatever
+ * it was given, so the joiner must wait for it however long it takes.  Cancel
+ * the joined fibre's scope instead.
+ */
+void *
+fibre_join(struct fibre_join *join)
+{
+	struct fibre *self = fibre_worker_self()->fw_current;
+	struct fibre *expected = NULL;
+
+	if (__atomic_load_n(&join->fj_waiter, __ATOMIC_ACQUIRE) != &fibre_join_done) {
+		self->f_state = FS_WAITING;
+		if (__atomic_compare_exchange_n(&join->fj_waiter, &expected, self,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			fibre_block();
+		}
+		self->f_state = FS_ACTIVE;
+	}
+
+	return join->fj_result;
+}
+
+static
+void
+fibre_stats_reset(void)
+{
+	fibre_stats.fstat_fibre_go_calls = 0;
+	fibre_stats.fstat_steals = 0;
+	fibre_stats.fstat_parks = 0;
+}
+
+void
+fibre_get_stats(struct fibre_stats *stats)
+{
+	size_t i, w;
+
+	stats->fstat_stack_allocs = 0;
+	stats->fstat_stack_reuses = 0;
+	for (i = 0; i < FIBRE_STACK_CLASSES; i++) {
+		struct stack_pool *pool = &global_fibre_store.fs_stacks[i];
+		pthread_mutex_lock(&pool->stp_lock);
+		stats->fstat_stack_allocs += pool->stp_maps;
+		stats->fstat_stack_reuses += pool->stp_reuses;
+		stats->fstat_stack_high_water[i] = (long int)pool->stp_high_water;
+		pthread_mutex_unlock(&pool->stp_lock);
+	}
+	stats->fstat_fibre_go_calls =
+		__atomic_load_n(&fibre_stats.fstat_fibre_go_calls, __ATOMIC_RELAXED);
+	stats->fstat_steals =
+		__atomic_load_n(&fibre_stats.fstat_steals, __ATOMIC_RELAXED);
+	stats->fstat_parks =
+		__atomic_load_n(&fibre_stats.fstat_parks, __ATOMIC_RELAXED);
+
+	stats->fstat_switches = 0;
+	stats->fstat_max_slice_ns = 0;
+	stats->fstat_aged = 0;
+	stats->fstat_budget_misses = 0;
+	for (i = 0; i < FP_NUM_PRIOS; i++) {
+		stats->fstat_queue_wait_ns[i] = 0;
+		stats->fstat_queue_waits[i] = 0;
+		stats->fstat_queue_wait_max_ns[i] = 0;
+	}
+	for (i = 0; i < FIBRE_DEPTH_BUCKETS; i++) {
+		stats->fstat_depths[i] = 0;
+	}
+	for (w = 0; workers != NULL && w < num_workers; w++) {
+		struct fibre_worker *worker = &workers[w];
+		stats->fstat_switches +=
+			__atomic_load_n(&worker->fw_switches, __ATOMIC_RELAXED);
+		stats->fstat_aged +=
+			__atomic_load_n(&worker->fw_aged, __ATOMIC_RELAXED);
+		stats->fstat_budget_misses +=
+			__atomic_load_n(&worker->fw_budget_misses, __ATOMIC_RELAXED);
+		fibre_stat_max(&stats->fstat_max_slice_ns,
+			__atomic_load_n(&worker->fw_max_slice_ns, __ATOMIC_RELAXED));
+		for (i = 0; i < FP_NUM_PRIOS; i++) {
+			stats->fstat_queue_wait_ns[i] += __atomic_load_n(
+				&worker->fw_queue_wait_ns[i], __ATOMIC_RELAXED);
+			stats->fstat_queue_waits[i] += __atomic_load_n(
+				&worker->fw_queue_waits[i], __ATOMIC_RELAXED);
+			fibre_stat_max(&stats->fstat_queue_wait_max_ns[i],
+				__atomic_load_n(&worker->fw_queue_wait_max_ns[i],
+					__ATOMIC_RELAXED));
+		}
+		for (i = 0; i < FIBRE_DEPTH_BUCKETS; i++) {
+			stats->fstat_depths[i] += __atomic_load_n(
+				&worker->fw_depths[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Gets the statistics of a single fibre, which must not return while this is
+ * running.  The current fibre is counted as having run up until now.  The
+ * main fibre runs on the thread's own stack, which is not counted.
+ */
+void
+fibre_get_run_stats(struct fibre *fibre, struct fibre_run_stats *stats)
+{
+	struct fibre_worker *worker = fibre_worker_self();
+
+	stats->frs_run_ns = __atomic_load_n(&fibre->f_run_ns, __ATOMIC_RELAXED);
+	stats->frs_switches =
+		__atomic_load_n(&fibre->f_switches, __ATOMIC_RELAXED);
+	stats->frs_max_slice_ns =
+		__atomic_load_n(&fibre->f_max_slice_ns, __ATOMIC_RELAXED);
+	if (fibre == worker->fw_current) {
+		long slice = fibre_clock_ns() - worker->fw_switched_at;
+		stats->frs_run_ns += slice;
+		fibre_stat_max(&stats->frs_max_slice_ns, slice);
+	}
+	stats->frs_stack_used = fibre->f_stack == NULL ? 0 :
+		(long int)stack_pool_used(
+			&global_fibre_store.fs_stacks[fibre->f_stack_class],
+			fibre->f_stack);
+}
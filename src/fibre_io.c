@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "abort.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "timer_wheel.h"
+#include "fibre.h"
+#include "fibre_io.h"
+
+#define FIBRE_IO_MAX_EVENTS 64
+
+/*
+ * A fibre waiting for a file descriptor.  These live on the stack of the
+ * waiting fibre.  Whoever claims it, either the poller that gets an event for
+ * it from epoll_wait or its being cancelled, wakes the fibre.
+ */
+struct fibre_io_waiter {
+	struct fibre *fiw_fibre;
+	int fiw_claimed;
+	int fiw_cancelled;
+};
+
+/*
+ * epoll has one registration per file descriptor, so one fibre reading and
+ * another writing, like both ends of a conversation over a socket, share it.
+ * Each file descriptor has a record of who is waiting to read it and who is
+ * waiting to write it, which is what is registered with epoll, as a one-shot
+ * event for everything either of them is waiting for.  The registration is
+ * left in place, disabled, after the event fires, so that waiting on the same
+ * file descriptor again only needs EPOLL_CTL_MOD.
+ *
+ * Records are made when a file descriptor is first waited on and kept until
+ * fibre_io_finish, in chunks that never move, so that the poller can use them
+ * without looking them up.  A waiter is only ever looked at or unlinked under
+ * its record's lock, so once a waiter has unlinked itself nothing else can
+ * reach it.
+ */
+struct fibre_io_fd {
+	pthread_mutex_t fif_lock;
+	int fif_fd;
+	struct fibre_io_waiter *fif_read, *fif_write;
+};
+
+#define FIBRE_IO_FD_CHUNK 256
+#define FIBRE_IO_FD_CHUNKS 4096
+
+static int fibre_io_epfd = -1;
+/* written to wake up whoever is blocked in epoll_wait */
+static int fibre_io_eventfd = -1;
+static int fibre_io_nwaiting;
+/* only whoever holds this calls epoll_wait, see fibre_io_claim_poller */
+static int fibre_io_poller;
+static struct fibre_io_fd *fibre_io_fds[FIBRE_IO_FD_CHUNKS];
+static pthread_mutex_t fibre_io_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+fibre_io_init(void)
+{
+	struct epoll_event ev;
+
+	fibre_io_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (fibre_io_epfd == -1) {
+		abort_with_error("Could not create epoll instance: %s\n",
+			strerror(errno));
+	}
+	fibre_io_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fibre_io_eventfd == -1) {
+		abort_with_error("Could not create eventfd: %s\n",
+			strerror(errno));
+	}
+
+	/* level-triggered, so it stays ready until the poller drains it */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(fibre_io_epfd, EPOLL_CTL_ADD, fibre_io_eventfd, &ev) == -1) {
+		abort_with_error("Could not add eventfd to epoll: %s\n",
+			strerror(errno));
+	}
+
+	fibre_io_nwaiting = 0;
+	fibre_io_poller = 0;
+}
+
+void
+fibre_io_finish(void)
+{
+	size_t i, j;
+
+	if (fibre_io_nwaiting != 0) {
+		log_warning("fibre_io",
+			"%d fibres still waiting for I/O\n", fibre_io_nwaiting);
+	}
+	for (i = 0; i < FIBRE_IO_FD_CHUNKS; i++) {
+		if (fibre_io_fds[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < FIBRE_IO_FD_CHUNK; j++) {
+			pthread_mutex_destroy(&fibre_io_fds[i][j].fif_lock);
+		}
+		deallocarray_with(&sys_alloc, fibre_io_fds[i],
+			FIBRE_IO_FD_CHUNK, sizeof(struct fibre_io_fd));
+		fibre_io_fds[i] = NULL;
+	}
+	close(fibre_io_eventfd);
+	close(fibre_io_epfd);
+	fibre_io_eventfd = -1;
+	fibre_io_epfd = -1;
+}
+
+int
+fibre_io_waiting(void)
+{
+	return __atomic_load_n(&fibre_io_nwaiting, __ATOMIC_SEQ_CST) != 0;
+}
+
+/*
+ * Only one worker at a time polls, so that the interrupt sent by
+ * fibre_io_interrupt reaches the one it was meant for.  Returns zero if
+ * somebody else is already polling.
+ */
+int
+fibre_io_claim_poller(void)
+{
+	int expected = 0;
+
+	return __atomic_compare_exchange_n(&fibre_io_poller, &expected, 1,
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+fibre_io_release_poller(void)
+{
+	__atomic_store_n(&fibre_io_poller, 0, __ATOMIC_RELEASE);
+}
+
+static
+int
+fibre_io_waiter_claim(struct fibre_io_waiter *w)
+{
+	int expected = 0;
+
+	return __atomic_compare_exchange_n(&w->fiw_claimed, &expected, 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static
+struct fibre_io_fd *
+fibre_io_fd_get(int fd)
+{
+	size_t chunk = (size_t)fd / FIBRE_IO_FD_CHUNK;
+	struct fibre_io_fd *fifs;
+	size_t i;
+
+	if (fd < 0 || chunk >= FIBRE_IO_FD_CHUNKS) {
+		abort_with_error("Cannot wait for fd %d\n", fd);
+	}
+	fifs = __atomic_load_n(&fibre_io_fds[chunk], __ATOMIC_ACQUIRE);
+	if (fifs != NULL) {
+		return &fifs[(size_t)fd % FIBRE_IO_FD_CHUNK];
+	}
+
+	pthread_mutex_lock(&fibre_io_fds_lock);
+	fifs = fibre_io_fds[chunk];
+	if (fifs == NULL) {
+		fifs = allocarray_with(&sys_alloc, FIBRE_IO_FD_CHUNK,
+			sizeof *fifs);
+		for (i = 0; i < FIBRE_IO_FD_CHUNK; i++) {
+			pthread_mutex_init(&fifs[i].fif_lock, NULL);
+			fifs[i].fif_fd = (int)(chunk * FIBRE_IO_FD_CHUNK + i);
+			fifs[i].fif_read = NULL;
+			fifs[i].fif_write = NULL;
+		}
+		__atomic_store_n(&fibre_io_fds[chunk], fifs, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fibre_io_fds_lock);
+	return &fifs[(size_t)fd % FIBRE_IO_FD_CHUNK];
+}
+
+/*
+ * Registers what the waiters of a record are waiting for, or disables the
+ * registration if there are none.  Must be called with the record locked.
+ * Returns -1 with errno set if epoll would not have it.
+ */
+static
+int
+fibre_io_fd_arm(struct fibre_io_fd *fif)
+{
+	struct epoll_event ev;
+
+	ev.events = 0;
+	if (fif->fif_read != NULL) {
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	}
+	if (fif->fif_write != NULL) {
+		ev.events |= EPOLLOUT;
+	}
+	if (ev.events != 0) {
+		ev.events |= EPOLLONESHOT;
+	}
+	ev.data.ptr = fif;
+	if (epoll_ctl(fibre_io_epfd, EPOLL_CTL_MOD, fif->fif_fd, &ev) == -1) {
+		if (errno != ENOENT || ev.events == 0) {
+			return -1;
+		}
+		return epoll_ctl(fibre_io_epfd, EPOLL_CTL_ADD, fif->fif_fd, &ev);
+	}
+	return 0;
+}
+
+/*
+ * Unlinks the waiter in '*slot', if there is one, and wakes it unless it has
+ * been cancelled already.
+ */
+static
+void
+fibre_io_fd_wake(struct fibre_io_waiter **slot)
+{
+	struct fibre_io_waiter *w = *slot;
+
+	if (w == NULL) {
+		return;
+	}
+	*slot = NULL;
+	if (fibre_io_waiter_claim(w)) {
+		__atomic_sub_fetch(&fibre_io_nwaiting, 1, __ATOMIC_SEQ_CST);
+		fibre_wake(w->fiw_fibre);
+	}
+}
+
+/*
+ * Wakes up every fibre whose file descriptor is ready, waiting for as long as
+ * 'timeout_ms' for at least one to be, or forever if it is -1.  The caller
+ * must hold the poller.  An error or hangup wakes both waiters, so that they
+ * find out about it from read or write.
+ */
+void
+fibre_io_poll(int timeout_ms)
+{
+	struct epoll_event events[FIBRE_IO_MAX_EVENTS];
+	int i, n;
+
+	do {
+		n = epoll_wait(fibre_io_epfd, events, FIBRE_IO_MAX_EVENTS,
+			timeout_ms);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		abort_with_error("epoll_wait failed: %s\n", strerror(errno));
+	}
+
+	for (i = 0; i < n; i++) {
+		struct fibre_io_fd *fif = events[i].data.ptr;
+		u32 revents = events[i].events;
+
+		if (fif == NULL) {
+			u64 count;
+			if (read(fibre_io_eventfd, &count, sizeof count) == -1 &&
+			    errno != EAGAIN) {
+				abort_with_error("Could not read eventfd: %s\n",
+					strerror(errno));
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&fif->fif_lock);
+		if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			fibre_io_fd_wake(&fif->fif_read);
+		}
+		if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+			fibre_io_fd_wake(&fif->fif_write);
+		}
+		/* the event was one-shot, so whoever is left needs it again,
+		 * and if the file descriptor was closed they will have to
+		 * find out for themselves */
+		if (fif->fif_read != NULL || fif->fif_write != NULL) {
+			(void)fibre_io_fd_arm(fif);
+		}
+		pthread_mutex_unlock(&fif->fif_lock);
+	}
+}
+
+/*
+ * Makes the worker blocked in fibre_io_poll, if there is one, return.
+ */
+void
+fibre_io_interrupt(void)
+{
+	u64 one = 1;
+
+	if (write(fibre_io_eventfd, &one, sizeof one) == -1 && errno != EAGAIN) {
+		abort_with_error("Could not write eventfd: %s\n",
+			strerror(errno));
+	}
+}
+
+static
+void
+fibre_io_wait_cancel(void *arg)
+{
+	struct fibre_io_waiter *w = arg;
+
+	if (fibre_io_waiter_claim(w)) {
+		w->fiw_cancelled = 1;
+		fibre_wake(w->fiw_fibre);
+	}
+}
+
+/*
+ * Files that epoll does not support, like regular files, are always ready.
+ * Only one fibre may wait to read a file descriptor at a time, and only one
+ * to write it.
+ */
+static
+int
+fibre_io_wait(int fd, int write)
+{
+	struct fibre_io_fd *fif;
+	struct fibre_io_waiter w, **slot;
+
+	if (fibre_cancelled()) {
+		return FIBRE_CANCELLED;
+	}
+
+	w.fiw_fibre = fibre_self();
+	w.fiw_claimed = 0;
+	w.fiw_cancelled = 0;
+
+	fif = fibre_io_fd_get(fd);
+	slot = write ? &fif->fif_write : &fif->fif_read;
+	pthread_mutex_lock(&fif->fif_lock);
+	if (*slot != NULL) {
+		abort_with_error("Two fibres waiting to %s fd %d\n",
+			write ? "write" : "read", fd);
+	}
+	*slot = &w;
+	__atomic_add_fetch(&fibre_io_nwaiting, 1, __ATOMIC_SEQ_CST);
+	if (fibre_io_fd_arm(fif) == -1) {
+		int err = errno;
+		*slot = NULL;
+		(void)fibre_io_fd_arm(fif);
+		pthread_mutex_unlock(&fif->fif_lock);
+		__atomic_sub_fetch(&fibre_io_nwaiting, 1, __ATOMIC_SEQ_CST);
+		if (err == EPERM) {
+			return 0;
+		}
+		abort_with_error("Could not wait for fd %d: %s\n",
+			fd, strerror(err));
+	}
+	pthread_mutex_unlock(&fif->fif_lock);
+
+	fibre_wait_cancellable(fibre_io_wait_cancel, &w);
+	if (!w.fiw_cancelled) {
+		return 0;
+	}
+
+	/* the poller might not have got round to unlinking it yet */
+	pthread_mutex_lock(&fif->fif_lock);
+	if (*slot == &w) {
+		*slot = NULL;
+		/* this fails if the file descriptor has been closed, which is
+		 * fine */
+		(void)fibre_io_fd_arm(fif);
+	}
+	pthread_mutex_unlock(&fif->fif_lock);
+	__atomic_sub_fetch(&fibre_io_nwaiting, 1, __ATOMIC_SEQ_CST);
+	return FIBRE_CANCELLED;
+}
+
+/*
+ * errno is thread-local, and __errno_location is declared const, so once a
+ * fibre has waited, and might have moved to another worker, the compiler is
+ * entitled to reuse the address of errno that it computed on the old thread.
+ * Anything that uses errno after waiting must go through these instead.
+ */
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static
+int
+fibre_io_errno(void)
+{
+	return errno;
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static
+void
+fibre_io_set_errno(int err)
+{
+	errno = err;
+}
+
+/*
+ * Returns FIBRE_CANCELLED if the fibre was cancelled before the file
+ * descriptor became ready, and otherwise zero.
+ */
+int
+fibre_wait_readable(int fd)
+{
+	return fibre_io_wait(fd, 0);
+}
+
+int
+fibre_wait_writable(int fd)
+{
+	return fibre_io_wait(fd, 1);
+}
+
+/*
+ * Like read(2) on a non-blocking file descriptor, except that instead of
+ * failing with EAGAIN it waits for there to be something to read.  If the
+ * fibre is cancelled while it waits, it fails with ECANCELED.
+ */
+ssize_t
+fibre_read(int fd, void *buf, size_t len)
+{
+	for (;;) {
+		ssize_t n = read(fd, buf, len);
+		int err;
+
+		if (n != -1) {
+			return n;
+		}
+		err = fibre_io_errno();
+		/* EWOULDBLOCK is the same as EAGAIN on Linux */
+		if (err == EAGAIN) {
+			if (fibre_wait_readable(fd) == FIBRE_CANCELLED) {
+				fibre_io_set_errno(ECANCELED);
+				return -1;
+			}
+		} else if (err != EINTR) {
+			return -1;
+		}
+	}
+}
+
+ssize_t
+fibre_write(int fd, const void *buf, size_t len)
+{
+	for (;;) {
+		ssize_t n = write(fd, buf, len);
+		int err;
+
+		if (n != -1) {
+			return n;
+		}
+		err = fibre_io_errno();
+		/* EWOULDBLOCK is the same as EAGAIN on Linux */
+		if (err == EAGAIN) {
+			if (fibre_wait_writable(fd) == FIBRE_CANCELLED) {
+				fibre_io_set_errno(ECANCELED);
+				return -1;
+			}
+		} else if (err != EINTR) {
+			return -1;
+		}
+	}
+}
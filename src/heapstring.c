@@ -24,9 +24,11 @@ heapstring_create(size_t cap, struct alloc *a)
 struct heapstring *
 heapstring_expand(struct heapstring *str, struct alloc *a, size_t newcap)
 {
-	return reallocate_with(a, str,
+	str = reallocate_with(a, str,
 		sizeof *str + str->hs_cap - 1,
 		sizeof *str + newcap - 1);
+	str->hs_cap = newcap;
+	return str;
 }
 
 void
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -16,12 +17,14 @@
 #define LEVEL_COLUMN_WIDTH 10
 #define SYSTEM_COLUMN_WIDTH 12
 #define SYSTEM_TABLE_SIZE 16
+#define FINISH_HOOKS 16
 
 static
 int
 g_loglevel = 8;
 
-static
+/* per-thread, as it only exists to stop a thread recursing into itself */
+static __thread
 int
 g_logging_enabled = 1;
 
@@ -29,24 +32,113 @@ static
 struct table
 g_system_loglevels = {0};
 
+/*
+ * The most verbose level that anything is logged at, whether globally or for
+ * some system, so that messages that nobody wants can be thrown away without
+ * looking up their system.  Logging at debug level in a hot path then costs
+ * next to nothing unless debug logging is on.  System levels are only ever
+ * counted as going up, which errs on the side of looking them up.
+ */
+static
+int
+g_max_loglevel = 8;
+
+static
+int
+g_max_system_loglevel = -1;
+
+static
+void
+update_max_loglevel(void)
+{
+	if (g_loglevel > g_max_system_loglevel) {
+		g_max_loglevel = g_loglevel;
+	} else {
+		g_max_loglevel = g_max_system_loglevel;
+	}
+}
+
 void
 log_set_loglevel(int level)
 {
 	g_loglevel = level;
+	update_max_loglevel();
 }
 
+/*
+ * Things to report on just before logging is shut down, like statistics that
+ * are only interesting once everything else has finished.
+ */
+struct finish_hook {
+	void (*fh_func)(void *);
+	void *fh_arg;
+};
+
+static
+struct finish_hook
+g_finish_hooks[FINISH_HOOKS];
+
+static
+size_t
+g_nfinish_hooks = 0;
+
+static
+pthread_mutex_t
+g_finish_hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void
 log_init(void)
 {
 	table_init(&g_system_loglevels, &sys_alloc, SYSTEM_TABLE_SIZE);
 }
 
+/*
+ * The hooks are called in the reverse of the order they were added in.
+ */
 void
 log_finish(void)
 {
+	while (g_nfinish_hooks > 0) {
+		struct finish_hook *hook = &g_finish_hooks[--g_nfinish_hooks];
+		hook->fh_func(hook->fh_arg);
+	}
 	table_finish(&g_system_loglevels);
 }
 
+void
+log_at_finish(void (*func)(void *), void *arg)
+{
+	pthread_mutex_lock(&g_finish_hooks_lock);
+	if (g_nfinish_hooks == FINISH_HOOKS) {
+		abort_with_error("Too many log_finish hooks (%d)\n", FINISH_HOOKS);
+	}
+	g_finish_hooks[g_nfinish_hooks].fh_func = func;
+	g_finish_hooks[g_nfinish_hooks].fh_arg = arg;
+	g_nfinish_hooks++;
+	pthread_mutex_unlock(&g_finish_hooks_lock);
+}
+
+/*
+ * Removes a hook added with the same function and argument, if there is one.
+ */
+void
+log_cancel_at_finish(void (*func)(void *), void *arg)
+{
+	size_t i;
+
+	pthread_mutex_lock(&g_finish_hooks_lock);
+	for (i = g_nfinish_hooks; i-- > 0;) {
+		if (g_finish_hooks[i].fh_func == func &&
+				g_finish_hooks[i].fh_arg == arg) {
+			memmove(&g_finish_hooks[i], &g_finish_hooks[i + 1],
+				(g_nfinish_hooks - i - 1) * sizeof *g_finish_hooks);
+			g_nfinish_hooks--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_finish_hooks_lock);
+}
+
 void
 log_set_system_loglevel(const char *system, int level)
 {
@@ -54,6 +146,10 @@ log_set_system_loglevel(const char *system, int level)
 	g_logging_enabled = 0;
 
 	table_set_int(&g_system_loglevels, table_key_cstr(system), level);
+	if (level > g_max_system_loglevel) {
+		g_max_system_loglevel = level;
+	}
+	update_max_loglevel();
 
 	g_logging_enabled = 1;
 }
@@ -82,7 +178,7 @@ vlogf(int level, const char *system, const char *fmt, va_list args)
 {
 	int err, system_max;
 
-	if (!g_logging_enabled)
+	if (level > g_max_loglevel || !g_logging_enabled)
 		return;
 
 	g_logging_enabled = 0;
@@ -0,0 +1,772 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "abort.h"
+#include "checked.h"
+#include "alloc.h"
+#include "types.h"
+#include "hash.h"
+#include "object.h"
+#include "table.h"
+#include "map.h"
+
+/*
+ * Each level of the trie picks out MAP_BITS bits of a key's hash, lowest
+ * first.  A node has a bitmap of which of its MAP_FANOUT slots hold a pair
+ * and another of which hold a child node, and only stores what is there:
+ * mn_npairs pairs followed by mn_nchildren child pointers, in slot order.
+ *
+ * The trie is kept in the canonical form of CHAMP: a child node always has at
+ * least two pairs in it, and a node left with a single pair is pulled up into
+ * its parent.  So two maps with the same keys have the same shape, and can be
+ * compared node by node, skipping any nodes they share.
+ *
+ * Keys whose hashes are the same all the way down end up in a collision node
+ * at MAP_MAX_DEPTH, which has no bitmaps and keeps its pairs in no order.  The
+ * 64 bits of a hash last 13 levels, the last of which only gets 4 of them.
+ */
+#define MAP_BITS 5
+#define MAP_FANOUT 32
+#define MAP_MAX_DEPTH 13
+
+struct map_node {
+	long int mn_refs;
+	u32 mn_datamap, mn_nodemap;
+	u32 mn_npairs, mn_nchildren;
+};
+
+static
+struct tpair *
+map_node_pairs(struct map_node *mn)
+{
+	return (struct tpair *)(void *)(mn + 1);
+}
+
+static
+struct map_node **
+map_node_children(struct map_node *mn)
+{
+	return (struct map_node **)(void *)(map_node_pairs(mn) + mn->mn_npairs);
+}
+
+static
+size_t
+map_node_size(u32 npairs, u32 nchildren)
+{
+	return sizeof(struct map_node) + npairs * sizeof(struct tpair) +
+		nchildren * sizeof(struct map_node *);
+}
+
+static
+struct map_node *
+map_node_create(struct alloc *alloc, u32 datamap, u32 nodemap, u32 npairs,
+	u32 nchildren)
+{
+	struct map_node *mn = allocate_with(alloc,
+		map_node_size(npairs, nchildren));
+
+	mn->mn_refs = 1;
+	mn->mn_datamap = datamap;
+	mn->mn_nodemap = nodemap;
+	mn->mn_npairs = npairs;
+	mn->mn_nchildren = nchildren;
+	return mn;
+}
+
+static
+void
+map_node_retain(struct map_node *mn)
+{
+	__atomic_add_fetch(&mn->mn_refs, 1, __ATOMIC_RELAXED);
+}
+
+static
+void
+map_node_release(struct alloc *alloc, struct map_node *mn)
+{
+	u32 i;
+
+	if (mn == NULL ||
+			__atomic_sub_fetch(&mn->mn_refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	for (i = 0; i < mn->mn_nchildren; i++) {
+		map_node_release(alloc, map_node_children(mn)[i]);
+	}
+	deallocate_with(alloc, mn, map_node_size(mn->mn_npairs, mn->mn_nchildren));
+}
+
+static
+struct map_node *
+map_node_clone(struct alloc *alloc, struct map_node *mn)
+{
+	struct map_node *copy = map_node_create(alloc, mn->mn_datamap,
+		mn->mn_nodemap, mn->mn_npairs, mn->mn_nchildren);
+	u32 i;
+
+	for (i = 0; i < mn->mn_npairs; i++) {
+		map_node_pairs(copy)[i] = map_node_pairs(mn)[i];
+	}
+	for (i = 0; i < mn->mn_nchildren; i++) {
+		map_node_children(copy)[i] = map_node_children(mn)[i];
+		map_node_retain(map_node_children(copy)[i]);
+	}
+	return copy;
+}
+
+static
+u32
+map_bit(u64 hash, unsigned depth)
+{
+	return (u32)1 << ((hash >> (MAP_BITS * depth)) & (MAP_FANOUT - 1));
+}
+
+/*
+ * Where the slot for 'bit' is among the slots in 'bitmap' that are in use.
+ */
+static
+u32
+map_index(u32 bitmap, u32 bit)
+{
+	return (u32)__builtin_popcount(bitmap & (bit - 1));
+}
+
+static
+int
+map_key_equal(struct tkey k1, struct tkey k2)
+{
+	return k1.tk_hash == k2.tk_hash && object_equal(k1.tk_obj, k2.tk_obj);
+}
+
+/*
+ * A node at 'depth' holding two pairs with different keys, which must be
+ * pushed further down for as long as their hashes agree.
+ */
+static
+struct map_node *
+map_node_pair2(struct alloc *alloc, unsigned depth, struct tpair a,
+	struct tpair b)
+{
+	struct map_node *mn;
+	u32 abit, bbit;
+
+	if (depth >= MAP_MAX_DEPTH) {
+		mn = map_node_create(alloc, 0, 0, 2, 0);
+		map_node_pairs(mn)[0] = a;
+		map_node_pairs(mn)[1] = b;
+		return mn;
+	}
+	abit = map_bit(a.tkv_key.tk_hash, depth);
+	bbit = map_bit(b.tkv_key.tk_hash, depth);
+	if (abit == bbit) {
+		mn = map_node_create(alloc, 0, abit, 0, 1);
+		map_node_children(mn)[0] = map_node_pair2(alloc, depth + 1, a, b);
+		return mn;
+	}
+	mn = map_node_create(alloc, abit | bbit, 0, 2, 0);
+	map_node_pairs(mn)[abit < bbit ? 0 : 1] = a;
+	map_node_pairs(mn)[abit < bbit ? 1 : 0] = b;
+	return mn;
+}
+
+static
+struct map_node *
+map_collision_set(struct alloc *alloc, struct map_node *mn, struct tpair pair,
+	int *added)
+{
+	struct map_node *copy;
+	u32 i;
+
+	for (i = 0; i < mn->mn_npairs; i++) {
+		if (map_key_equal(map_node_pairs(mn)[i].tkv_key, pair.tkv_key)) {
+			copy = map_node_clone(alloc, mn);
+			map_node_pairs(copy)[i] = pair;
+			return copy;
+		}
+	}
+	copy = map_node_create(alloc, 0, 0, mn->mn_npairs + 1, 0);
+	for (i = 0; i < mn->mn_npairs; i++) {
+		map_node_pairs(copy)[i] = map_node_pairs(mn)[i];
+	}
+	map_node_pairs(copy)[i] = pair;
+	*added = 1;
+	return copy;
+}
+
+/*
+ * A new node like 'mn' but with 'pair' set, sharing every child of 'mn' that
+ * it does not have to change.
+ */
+static
+struct map_node *
+map_node_set(struct alloc *alloc, struct map_node *mn, unsigned depth,
+	struct tpair pair, int *added)
+{
+	struct map_node *copy, *child;
+	u32 bit, i, j, k;
+
+	if (depth >= MAP_MAX_DEPTH) {
+		return map_collision_set(alloc, mn, pair, added);
+	}
+	bit = map_bit(pair.tkv_key.tk_hash, depth);
+
+	if (mn->mn_datamap & bit) {
+		i = map_index(mn->mn_datamap, bit);
+		if (map_key_equal(map_node_pairs(mn)[i].tkv_key, pair.tkv_key)) {
+			copy = map_node_clone(alloc, mn);
+			map_node_pairs(copy)[i] = pair;
+			return copy;
+		}
+		/* the pair already there and the new one go down a level */
+		child = map_node_pair2(alloc, depth + 1,
+			map_node_pairs(mn)[i], pair);
+		*added = 1;
+		copy = map_node_create(alloc, mn->mn_datamap & ~bit,
+			mn->mn_nodemap | bit, mn->mn_npairs - 1,
+			mn->mn_nchildren + 1);
+		for (k = 0; k < mn->mn_npairs; k++) {
+			if (k != i) {
+				map_node_pairs(copy)[k < i ? k : k - 1] =
+					map_node_pairs(mn)[k];
+			}
+		}
+		j = map_index(mn->mn_nodemap, bit);
+		for (k = 0; k < mn->mn_nchildren; k++) {
+			map_node_children(copy)[k < j ? k : k + 1] =
+				map_node_children(mn)[k];
+			map_node_retain(map_node_children(mn)[k]);
+		}
+		map_node_children(copy)[j] = child;
+		return copy;
+	}
+
+	if (mn->mn_nodemap & bit) {
+		j = map_index(mn->mn_nodemap, bit);
+		child = map_node_set(alloc, map_node_children(mn)[j], depth + 1,
+			pair, added);
+		copy = map_node_clone(alloc, mn);
+		map_node_release(alloc, map_node_children(copy)[j]);
+		map_node_children(copy)[j] = child;
+		return copy;
+	}
+
+	i = map_index(mn->mn_datamap, bit);
+	copy = map_node_create(alloc, mn->mn_datamap | bit, mn->mn_nodemap,
+		mn->mn_npairs + 1, mn->mn_nchildren);
+	for (k = 0; k < mn->mn_npairs; k++) {
+		map_node_pairs(copy)[k < i ? k : k + 1] = map_node_pairs(mn)[k];
+	}
+	map_node_pairs(copy)[i] = pair;
+	for (k = 0; k < mn->mn_nchildren; k++) {
+		map_node_children(copy)[k] = map_node_children(mn)[k];
+		map_node_retain(map_node_children(mn)[k]);
+	}
+	*added = 1;
+	return copy;
+}
+
+/*
+ * A new node like 'mn' but without 'key', or NULL if that leaves it empty,
+ * or 'mn' itself, with another reference, if the key is not there.
+ */
+static
+struct map_node *
+map_node_remove(struct alloc *alloc, struct map_node *mn, unsigned depth,
+	struct tkey key)
+{
+	struct map_node *copy, *child;
+	u32 bit, i, j, k;
+
+	if (depth >= MAP_MAX_DEPTH) {
+		for (i = 0; i < mn->mn_npairs; i++) {
+			if (map_key_equal(map_node_pairs(mn)[i].tkv_key, key)) {
+				break;
+			}
+		}
+		if (i == mn->mn_npairs) {
+			map_node_retain(mn);
+			return mn;
+		}
+		copy = map_node_create(alloc, 0, 0, mn->mn_npairs - 1, 0);
+		for (k = 0; k < mn->mn_npairs; k++) {
+			if (k != i) {
+				map_node_pairs(copy)[k < i ? k : k - 1] =
+					map_node_pairs(mn)[k];
+			}
+		}
+		return copy;
+	}
+
+	bit = map_bit(key.tk_hash, depth);
+	if (mn->mn_datamap & bit) {
+		i = map_index(mn->mn_datamap, bit);
+		if (!map_key_equal(map_node_pairs(mn)[i].tkv_key, key)) {
+			map_node_retain(mn);
+			return mn;
+		}
+		if (mn->mn_npairs == 1 && mn->mn_nchildren == 0) {
+			return NULL;
+		}
+		copy = map_node_create(alloc, mn->mn_datamap & ~bit,
+			mn->mn_nodemap, mn->mn_npairs - 1, mn->mn_nchildren);
+		for (k = 0; k < mn->mn_npairs; k++) {
+			if (k != i) {
+				map_node_pairs(copy)[k < i ? k : k - 1] =
+					map_node_pairs(mn)[k];
+			}
+		}
+		for (k = 0; k < mn->mn_nchildren; k++) {
+			map_node_children(copy)[k] = map_node_children(mn)[k];
+			map_node_retain(map_node_children(mn)[k]);
+		}
+		return copy;
+	}
+
+	if ((mn->mn_nodemap & bit) == 0) {
+		map_node_retain(mn);
+		return mn;
+	}
+
+	j = map_index(mn->mn_nodemap, bit);
+	child = map_node_remove(alloc, map_node_children(mn)[j], depth + 1, key);
+	if (child == map_node_children(mn)[j]) {
+		map_node_release(alloc, child);
+		map_node_retain(mn);
+		return mn;
+	}
+	if (child->mn_npairs != 1 || child->mn_nchildren != 0) {
+		copy = map_node_clone(alloc, mn);
+		map_node_release(alloc, map_node_children(copy)[j]);
+		map_node_children(copy)[j] = child;
+		return copy;
+	}
+
+	/* the child is down to one pair, which comes up into this node */
+	i = map_index(mn->mn_datamap, bit);
+	copy = map_node_create(alloc, mn->mn_datamap | bit,
+		mn->mn_nodemap & ~bit, mn->mn_npairs + 1, mn->mn_nchildren - 1);
+	for (k = 0; k < mn->mn_npairs; k++) {
+		map_node_pairs(copy)[k < i ? k : k + 1] = map_node_pairs(mn)[k];
+	}
+	map_node_pairs(copy)[i] = map_node_pairs(child)[0];
+	for (k = 0; k < mn->mn_nchildren; k++) {
+		if (k != j) {
+			map_node_children(copy)[k < j ? k : k - 1] =
+				map_node_children(mn)[k];
+			map_node_retain(map_node_children(mn)[k]);
+		}
+	}
+	map_node_release(alloc, child);
+	return copy;
+}
+
+static
+int
+map_pair_equal(struct tpair *a, struct tpair *b)
+{
+	return map_key_equal(a->tkv_key, b->tkv_key) &&
+		object_equal(a->tkv_value, b->tkv_value);
+}
+
+static
+int
+map_node_equal(struct map_node *a, struct map_node *b, unsigned depth)
+{
+	u32 i, j;
+
+	if (a == b) {
+		return 1;
+	}
+	if (a == NULL || b == NULL || a->mn_datamap != b->mn_datamap ||
+			a->mn_nodemap != b->mn_nodemap ||
+			a->mn_npairs != b->mn_npairs) {
+		return 0;
+	}
+	if (depth >= MAP_MAX_DEPTH) {
+		for (i = 0; i < a->mn_npairs; i++) {
+			for (j = 0; j < b->mn_npairs; j++) {
+				if (map_pair_equal(&map_node_pairs(a)[i],
+						&map_node_pairs(b)[j])) {
+					break;
+				}
+			}
+			if (j == b->mn_npairs) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	for (i = 0; i < a->mn_npairs; i++) {
+		if (!map_pair_equal(&map_node_pairs(a)[i],
+				&map_node_pairs(b)[i])) {
+			return 0;
+		}
+	}
+	for (i = 0; i < a->mn_nchildren; i++) {
+		if (!map_node_equal(map_node_children(a)[i],
+				map_node_children(b)[i], depth + 1)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The hash of a map is the sum of the hashes of its pairs, so that it does not
+ * depend on the order they are in.
+ */
+static
+u64
+map_node_hash(struct map_node *mn)
+{
+	u64 hash = 0;
+	u32 i;
+
+	if (mn == NULL) {
+		return 0;
+	}
+	for (i = 0; i < mn->mn_npairs; i++) {
+		struct tpair *pair = &map_node_pairs(mn)[i];
+		hash += (pair->tkv_key.tk_hash ^
+			(object_hash(pair->tkv_value) * 0x9e3779b97f4a7c15ul)) *
+			0xff51afd7ed558ccdul;
+	}
+	for (i = 0; i < mn->mn_nchildren; i++) {
+		hash += map_node_hash(map_node_children(mn)[i]);
+	}
+	return hash;
+}
+
+void
+map_init(struct map *map, struct alloc *alloc)
+{
+	map->m_root = NULL;
+	map->m_size = 0;
+	map->m_alloc = alloc;
+	map->m_hash = 0;
+	map->m_hashed = 0;
+}
+
+void
+map_finish(struct map *map)
+{
+	map_node_release(map->m_alloc, map->m_root);
+}
+
+/*
+ * Initialises 'dst' as a snapshot of 'src', in O(1).  Changes to either
+ * afterwards do not affect the other, and each must be finished.
+ */
+void
+map_copy(struct map *dst, struct map *src)
+{
+	dst->m_root = src->m_root;
+	dst->m_size = src->m_size;
+	dst->m_alloc = src->m_alloc;
+	dst->m_hashed = __atomic_load_n(&src->m_hashed, __ATOMIC_ACQUIRE);
+	dst->m_hash = __atomic_load_n(&src->m_hash, __ATOMIC_RELAXED);
+	if (dst->m_root != NULL) {
+		map_node_retain(dst->m_root);
+	}
+}
+
+int
+map_equal(struct map *l, struct map *r)
+{
+	return l->m_size == r->m_size && map_node_equal(l->m_root, r->m_root, 0);
+}
+
+/*
+ * Aborts if any value is a mutable object, which cannot be hashed.
+ *
+ * Readers sharing a map may all call this at once, so the cached hash is
+ * published with a release store of m_hashed after m_hash.  Threads that
+ * race to work it out store the same value.
+ */
+u64
+map_hash(struct map *map)
+{
+	u64 hash;
+
+	if (__atomic_load_n(&map->m_hashed, __ATOMIC_ACQUIRE)) {
+		return __atomic_load_n(&map->m_hash, __ATOMIC_RELAXED);
+	}
+	hash = map_node_hash(map->m_root) + map->m_size;
+	__atomic_store_n(&map->m_hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&map->m_hashed, 1, __ATOMIC_RELEASE);
+	return hash;
+}
+
+/*
+ * Returns -1 if the key is not in the map.
+ */
+int
+map_try_get(struct map *map, struct tkey key, union object *value)
+{
+	struct map_node *mn = map->m_root;
+	unsigned depth = 0;
+	u32 i;
+
+	while (mn != NULL) {
+		u32 bit;
+		if (depth >= MAP_MAX_DEPTH) {
+			for (i = 0; i < mn->mn_npairs; i++) {
+				struct tpair *pair = &map_node_pairs(mn)[i];
+				if (map_key_equal(pair->tkv_key, key)) {
+					*value = pair->tkv_value;
+					return 0;
+				}
+			}
+			return -1;
+		}
+		bit = map_bit(key.tk_hash, depth);
+		if (mn->mn_datamap & bit) {
+			struct tpair *pair = &map_node_pairs(mn)
+				[map_index(mn->mn_datamap, bit)];
+			if (!map_key_equal(pair->tkv_key, key)) {
+				return -1;
+			}
+			*value = pair->tkv_value;
+			return 0;
+		}
+		if ((mn->mn_nodemap & bit) == 0) {
+			return -1;
+		}
+		mn = map_node_children(mn)[map_index(mn->mn_nodemap, bit)];
+		depth++;
+	}
+	return -1;
+}
+
+void
+map_set(struct map *map, struct tkey key, union object value)
+{
+	struct map_node *root;
+	struct tpair pair;
+	int added = 0;
+
+	pair.tkv_key = key;
+	pair.tkv_value = value;
+	if (map->m_root == NULL) {
+		root = map_node_create(map->m_alloc, map_bit(key.tk_hash, 0),
+			0, 1, 0);
+		map_node_pairs(root)[0] = pair;
+		added = 1;
+	} else {
+		root = map_node_set(map->m_alloc, map->m_root, 0, pair, &added);
+	}
+	map_node_release(map->m_alloc, map->m_root);
+	map->m_root = root;
+	map->m_size += (size_t)added;
+	map->m_hashed = 0;
+}
+
+/*
+ * Returns -1 if the key is not in the map.
+ */
+int
+map_remove(struct map *map, struct tkey key)
+{
+	struct map_node *root;
+
+	if (map->m_root == NULL) {
+		return -1;
+	}
+	root = map_node_remove(map->m_alloc, map->m_root, 0, key);
+	if (root == map->m_root) {
+		map_node_release(map->m_alloc, root);
+		return -1;
+	}
+	map_node_release(map->m_alloc, map->m_root);
+	map->m_root = root;
+	map->m_size--;
+	map->m_hashed = 0;
+	return 0;
+}
+
+#define DEFINE_MAP_GET_SET(name, type) \
+int \
+map_try_get_##name(struct map *map, struct tkey key, type *value) \
+{ \
+	union object obj; \
+\
+	if (map_try_get(map, key, &obj) != 0) { \
+		return -1; \
+	} \
+	return object_try_as_##name(&obj, value); \
+} \
+type \
+map_get_##name(struct map *map, struct tkey key) \
+{ \
+	type value; \
+	int res = map_try_get_##name(map, key, &value); \
+	if (res != 0) { \
+		abort_with_error("map_get_" #name " failed: %d\n", res); \
+	} \
+	return value; \
+} \
+void \
+map_set_##name(struct map *map, struct tkey key, type value) \
+{ \
+	union object obj; \
+\
+	object_init_from_##name(&obj, value); \
+	map_set(map, key, obj); \
+}
+
+DEFINE_MAP_GET_SET(u8, u8)
+DEFINE_MAP_GET_SET(u16, u16)
+DEFINE_MAP_GET_SET(u32, u32)
+DEFINE_MAP_GET_SET(u64, u64)
+DEFINE_MAP_GET_SET(z8, z8)
+DEFINE_MAP_GET_SET(z16, z16)
+DEFINE_MAP_GET_SET(z32, z32)
+DEFINE_MAP_GET_SET(z64, z64)
+DEFINE_MAP_GET_SET(int, int)
+DEFINE_MAP_GET_SET(cstr, const char *)
+
+static const char *map_object_typename(struct object_vtable **);
+static u64 map_object_hash(struct object_vtable **);
+static int map_object_equal(struct object_vtable **, struct object_vtable **);
+static struct object_vtable **map_object_copy(struct object_vtable **o);
+static void map_object_finish(struct object_vtable **o);
+static void map_object_destroy(struct object_vtable **o, struct alloc *alloc);
+
+static
+struct object_vtable
+map_object_vtable = {
+	&map_object_typename,
+	&map_object_hash,
+	&map_object_equal,
+	&map_object_copy,
+	&map_object_finish,
+	&map_object_destroy
+};
+
+static
+struct map_object *
+map_object_create(struct map *map)
+{
+	struct map_object *mo = allocate_with(map->m_alloc, sizeof *mo);
+
+	mo->mo_vtable = &map_object_vtable;
+	map_copy(&mo->mo_map, map);
+	return mo;
+}
+
+/*
+ * The object holds a snapshot of 'map', so later changes to 'map' do not
+ * change it.  Unlike a table, it can be hashed, and copying it is O(1).
+ */
+void
+object_init_as_map(union object *obj, struct map *map)
+{
+	struct map_object *mo = map_object_create(map);
+
+	obj->o_indirect.io_vtable = &indirect_object_vtable;
+	obj->o_indirect.io_value = &mo->mo_vtable;
+}
+
+static
+const char *
+map_object_typename(struct object_vtable **obj)
+{
+	(void)obj;
+	return "map";
+}
+
+static
+u64
+map_object_hash(struct object_vtable **obj)
+{
+	struct map_object *mo = (struct map_object *)obj;
+	return map_hash(&mo->mo_map);
+}
+
+static
+int
+map_object_equal(struct object_vtable **l, struct object_vtable **r)
+{
+	/* can assume that l is a map_object, but r might be an indirect_object */
+	struct map_object *lo = (struct map_object *)l;
+	struct map *rmap;
+	if (vobject_try_as_map(r, &rmap))
+		return 0;
+	return map_equal(&lo->mo_map, rmap);
+}
+
+static
+struct object_vtable **
+map_object_copy(struct object_vtable **obj)
+{
+	struct map_object *mo = (struct map_object *)obj;
+	return &map_object_create(&mo->mo_map)->mo_vtable;
+}
+
+static
+void
+map_object_finish(struct object_vtable **obj)
+{
+	struct map_object *mo = (struct map_object *)obj;
+	map_finish(&mo->mo_map);
+}
+
+static
+void
+map_object_destroy(struct object_vtable **obj, struct alloc *alloc)
+{
+	map_object_finish(obj);
+	deallocate_with(alloc, obj, sizeof(struct map_object));
+}
+
+int
+vobject_is_map(struct object_vtable **vtable)
+{
+	struct map *map;
+	return vobject_try_as_map(vtable, &map) == 0;
+}
+
+struct map *
+vobject_as_map(struct object_vtable **vtable)
+{
+	struct map *map;
+
+	if (vobject_try_as_map(vtable, &map)) {
+		abort_with_error("vobject_as_map failed");
+	}
+
+	return map;
+}
+
+int
+vobject_try_as_map(struct object_vtable **vtable, struct map **map)
+{
+	/* 'vtable' points at the object, so an indirect one is looked
+	 * through by hand rather than with INDIRECTLY_IS */
+	if (*vtable == &indirect_object_vtable)
+		vtable = INDIRECTLY(vtable);
+	if (*vtable != &map_object_vtable)
+		return 1;
+
+	*map = &((struct map_object *)vtable)->mo_map;
+	return 0;
+}
+
+int
+object_is_map(union object *o)
+{
+	return vobject_is_map(&o->o_vtable);
+}
+
+struct map *
+object_as_map(union object *o)
+{
+	return vobject_as_map(&o->o_vtable);
+}
+
+int
+object_try_as_map(union object *o, struct map **value)
+{
+	return vobject_try_as_map(&o->o_vtable, value);
+}
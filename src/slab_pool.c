@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -6,94 +7,324 @@
 #include <string.h>
 #include <sys/mman.h>
 
-#ifdef VINE_USE_VALGRIND
-#include <valgrind/valgrind.h>
-#endif
-
 #include "abort.h"
 #include "eprintf.h"
 #include "alloc.h"
-#include "alloc_buf.h"
 #include "slab_pool.h"
-#include "memory.h"
 #include "log.h"
-#include "str.h"
 #include "checked.h"
 
-static struct slab *create_slab(struct slab *next, size_t align);
-static void destroy_slab(struct slab *);
-static void destroy_slabs(struct slab **);
+/* a slab is made big enough to hold at least this many objects */
+#define SLAB_MIN_OBJECTS 8
+/* empty slabs kept for reuse, beyond which they are unmapped */
+#define SLAB_POOL_MAX_EMPTY 1
+
+static struct slab *create_slab(struct slab_pool *);
+static void destroy_slab(struct slab_pool *, struct slab *);
+static void destroy_slabs(struct slab_pool *, struct slab **);
+
+/*
+ * The size of each slab of a pool of objects of 'size' bytes, aligned to
+ * 'align', which is the same for every such pool.
+ */
+size_t
+slab_pool_slab_size(size_t align, size_t size)
+{
+	size_t first = align_sz(sizeof(struct slab), align);
+	size_t slab_size = PAGE_SIZE;
+
+	size = align_sz(size, align);
+	while ((slab_size - first) / size < SLAB_MIN_OBJECTS) {
+		slab_size = mul_sz(slab_size, 2);
+	}
+	return slab_size;
+}
 
+/*
+ * Objects of 'size' bytes, aligned to 'align', which must be a power of two.
+ * 'init' is called on each object when it is created and 'finish' when it is
+ * destroyed, and either can be NULL.
+ */
 void
 slab_pool_init(struct slab_pool *sp, size_t align, size_t size,
 	void (*init)(void *), void (*finish)(void *))
 {
+	assert1(size >= sizeof(void *));
+	assert1(align != 0 && (align & (align - 1)) == 0);
+
 	sp->sp_align = align;
-	sp->sp_size = size;
+	sp->sp_size = align_sz(size, align);
 	sp->sp_init = init;
 	sp->sp_finish = finish;
-	sp->sp_slabs = NULL;
+	sp->sp_first = align_sz(sizeof(struct slab), align);
+	sp->sp_slab_size = slab_pool_slab_size(align, size);
+	sp->sp_per_slab = (sp->sp_slab_size - sp->sp_first) / sp->sp_size;
+	sp->sp_partial = NULL;
+	sp->sp_full = NULL;
+	sp->sp_empty = NULL;
+	sp->sp_nempty = 0;
+	sp->sp_remote = NULL;
+	sp->sp_maps = 0;
+	sp->sp_unmaps = 0;
+	sp->sp_remote_frees = 0;
 }
 
+/*
+ * Any objects that have not been destroyed are thrown away without being
+ * finished.
+ */
 void
 slab_pool_finish(struct slab_pool *sp)
 {
-	destroy_slabs(&sp->sp_slabs);
+	destroy_slabs(sp, &sp->sp_partial);
+	destroy_slabs(sp, &sp->sp_full);
+	destroy_slabs(sp, &sp->sp_empty);
+	sp->sp_nempty = 0;
+}
+
+static
+void
+slab_list_remove(struct slab **list, struct slab *slab)
+{
+	if (slab->slab_prev != NULL) {
+		slab->slab_prev->slab_next = slab->slab_next;
+	} else {
+		*list = slab->slab_next;
+	}
+	if (slab->slab_next != NULL) {
+		slab->slab_next->slab_prev = slab->slab_prev;
+	}
+}
+
+static
+void
+slab_list_push(struct slab **list, struct slab *slab)
+{
+	slab->slab_prev = NULL;
+	slab->slab_next = *list;
+	if (*list != NULL) {
+		(*list)->slab_prev = slab;
+	}
+	*list = slab;
 }
 
 void *
 slab_object_create(struct slab_pool *sp)
 {
+	struct slab *slab = sp->sp_partial;
 	void *ptr;
-	size_t size = sp->sp_size;
-	size_t align = sp->sp_align;
 
-	if (sp->sp_slabs == NULL) {
-		sp->sp_slabs = create_slab(sp->sp_slabs, align);
-		ptr = allocate_with(&sp->sp_slabs->slab_ba.ba_alloc, size);
+	if (slab == NULL && slab_pool_collect(sp) != 0) {
+		slab = sp->sp_partial;
+	}
+	if (slab == NULL) {
+		slab = sp->sp_empty;
+		if (slab != NULL) {
+			slab_list_remove(&sp->sp_empty, slab);
+			sp->sp_nempty--;
+		} else {
+			slab = create_slab(sp);
+		}
+		slab_list_push(&sp->sp_partial, slab);
+	}
+
+	if (slab->slab_free != NULL) {
+		ptr = slab->slab_free;
+		slab->slab_free = *(void **)ptr;
 	} else {
-		ptr = try_allocate_with(&sp->sp_slabs->slab_ba.ba_alloc, size);
-		if (ptr == NULL) {
-			sp->sp_slabs = create_slab(sp->sp_slabs, align);
-			ptr = allocate_with(&sp->sp_slabs->slab_ba.ba_alloc, size);
-		} 
+		ptr = slab->slab_fresh;
+		slab->slab_fresh += sp->sp_size;
+	}
+	if (++slab->slab_inuse == sp->sp_per_slab) {
+		slab_list_remove(&sp->sp_partial, slab);
+		slab_list_push(&sp->sp_full, slab);
+	}
+
+	if (sp->sp_init != NULL) {
+		sp->sp_init(ptr);
 	}
-	sp->sp_init(ptr);
 	return ptr;
 }
 
+static
+struct slab *
+slab_of(struct slab_pool *sp, void *ptr)
+{
+	return (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(sp->sp_slab_size - 1));
+}
+
+/*
+ * Puts an object that has been finished back on its slab's free list.
+ */
+static
+void
+slab_object_release(struct slab_pool *sp, struct slab *slab, void *ptr)
+{
+	*(void **)ptr = slab->slab_free;
+	slab->slab_free = ptr;
+
+	if (slab->slab_inuse-- == sp->sp_per_slab) {
+		slab_list_remove(&sp->sp_full, slab);
+		slab_list_push(&sp->sp_partial, slab);
+	}
+	if (slab->slab_inuse == 0) {
+		slab_list_remove(&sp->sp_partial, slab);
+		if (sp->sp_nempty < SLAB_POOL_MAX_EMPTY) {
+			slab_list_push(&sp->sp_empty, slab);
+			sp->sp_nempty++;
+		} else {
+			destroy_slab(sp, slab);
+		}
+	}
+}
+
+/*
+ * Slabs are aligned to their size, so the slab an object belongs to is found
+ * by rounding its address down.
+ */
 void
 slab_object_destroy(struct slab_pool *sp, void *ptr)
 {
-	sp->sp_finish(ptr);
+	struct slab *slab = slab_of(sp, ptr);
+
+	assert1(slab->slab_pool == sp);
+	if (sp->sp_finish != NULL) {
+		sp->sp_finish(ptr);
+	}
+	slab_object_release(sp, slab, ptr);
+}
+
+/*
+ * Destroys an object from a thread other than the one that uses the pool.  The
+ * object is pushed onto its slab's slab_remote list, and the first object
+ * pushed onto an empty list also pushes the slab onto the pool's sp_remote
+ * list, so the pool only has to look at slabs that have something to collect.
+ * Both lists are only ever taken whole, by slab_pool_collect, so a push cannot
+ * be confused by an object or slab that has been taken and pushed again.
+ *
+ * Until the slab is on sp_remote, nothing on its slab_remote list can be
+ * collected, so the slab cannot be emptied and unmapped under the push.
+ */
+void
+slab_object_destroy_remote(struct slab_pool *sp, void *ptr)
+{
+	struct slab *slab = slab_of(sp, ptr);
+	struct slab *first;
+	void *head;
+
+	assert1(slab->slab_pool == sp);
+	if (sp->sp_finish != NULL) {
+		sp->sp_finish(ptr);
+	}
+
+	head = __atomic_load_n(&slab->slab_remote, __ATOMIC_RELAXED);
+	do {
+		*(void **)ptr = head;
+	} while (!__atomic_compare_exchange_n(&slab->slab_remote, &head, ptr,
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head != NULL) {
+		return;
+	}
+
+	first = __atomic_load_n(&sp->sp_remote, __ATOMIC_RELAXED);
+	do {
+		slab->slab_remote_next = first;
+	} while (!__atomic_compare_exchange_n(&sp->sp_remote, &first, slab,
+		1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Takes back the objects destroyed by other threads, and returns how many
+ * there were.  Only the thread that uses the pool may call this, and it is
+ * called by slab_object_create whenever the pool runs out of partial slabs.
+ */
+size_t
+slab_pool_collect(struct slab_pool *sp)
+{
+	struct slab *slab;
+	size_t n = 0;
+
+	if (__atomic_load_n(&sp->sp_remote, __ATOMIC_RELAXED) == NULL) {
+		return 0;
+	}
+	slab = __atomic_exchange_n(&sp->sp_remote, NULL, __ATOMIC_ACQUIRE);
+	while (slab != NULL) {
+		/* once slab_remote is taken, the slab can be pushed again */
+		struct slab *next = slab->slab_remote_next;
+		void *ptr = __atomic_exchange_n(&slab->slab_remote, NULL,
+			__ATOMIC_ACQUIRE);
+		while (ptr != NULL) {
+			/* releasing the last object might unmap the slab */
+			void *next_ptr = *(void **)ptr;
+			slab_object_release(sp, slab, ptr);
+			ptr = next_ptr;
+			n++;
+		}
+		slab = next;
+	}
+	sp->sp_remote_frees += (long int)n;
+	return n;
 }
 
+/*
+ * Maps a slab aligned to its own size.  A slab bigger than a page is mapped
+ * with room to spare, and the spare is unmapped on either side.
+ */
 static
 struct slab *
-create_slab(struct slab *next, size_t align)
+create_slab(struct slab_pool *sp)
 {
-	char *ptr = allocate_with(&mmap_alloc, PAGE_SIZE);
-	char *buf = align_ptr(ptr + SLAB_HEADER_SIZE, align);
-	struct slab *slab = (struct slab *)ptr;
-	slab->slab_next = next;
-	buf_alloc_init(&slab->slab_ba, buf, (size_t)(ptr + PAGE_SIZE - buf));
+	size_t size = sp->sp_slab_size;
+	size_t extra = size - PAGE_SIZE;
+	char *ptr, *aligned;
+	struct slab *slab;
+
+	ptr = mmap(NULL, size + extra, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		abort_with_error("Could not map a %lu byte slab: %s\n",
+			size, strerror(errno));
+	}
+	aligned = align_ptr(ptr, size);
+	if (aligned != ptr) {
+		munmap(ptr, (size_t)(aligned - ptr));
+	}
+	if (aligned + size != ptr + size + extra) {
+		munmap(aligned + size, (size_t)(ptr + extra - aligned));
+	}
+	log_debug("slab_pool", "Mapped a %lu byte slab at %p\n",
+		size, (void *)aligned);
+
+	slab = (struct slab *)aligned;
+	slab->slab_pool = sp;
+	slab->slab_free = NULL;
+	slab->slab_fresh = aligned + sp->sp_first;
+	slab->slab_inuse = 0;
+	slab->slab_remote = NULL;
+	slab->slab_remote_next = NULL;
+	sp->sp_maps++;
 	return slab;
 }
 
 static
 void
-destroy_slabs(struct slab **slabs)
+destroy_slabs(struct slab_pool *sp, struct slab **slabs)
 {
 	while (*slabs) {
 		struct slab *next = (*slabs)->slab_next;
-		destroy_slab(*slabs);
+		destroy_slab(sp, *slabs);
 		*slabs = next;
 	}
 }
 
 static
 void
-destroy_slab(struct slab *slab)
+destroy_slab(struct slab_pool *sp, struct slab *slab)
 {
-	deallocate_with(&mmap_alloc, slab, PAGE_SIZE);
+	log_debug("slab_pool", "Unmapping the slab at %p\n", (void *)slab);
+	if (munmap(slab, sp->sp_slab_size) != 0) {
+		abort_with_error("munmap failed with arguments %p and %lu\n",
+			(void *)slab, sp->sp_slab_size);
+	}
+	sp->sp_unmaps++;
 }
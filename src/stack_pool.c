@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "abort.h"
+#include "checked.h"
+#include "eprintf.h"
+#include "log.h"
+#include "alloc.h"
+#include "stack_pool.h"
+
+#define STACK_POOL_MIN_FREE 16
+/* the address space reserved at a time, which many small stacks share */
+#define STACK_POOL_CHUNK_SIZE (64ul * 1024 * 1024)
+/* how many pages stack_pool_used asks about at a time */
+#define STACK_POOL_MINCORE_PAGES 256
+/* measuring a stack costs about as much as the rest of a fibre's life, so
+ * stack_pool_put only measures one stack in this many */
+#define STACK_POOL_SAMPLE_EVERY 16
+
+/*
+ * Lightweight guard regions, which are new in Linux 6.13, fault like PROT_NONE
+ * pages without splitting the mapping they are in.  A guard page made with
+ * mprotect costs a mapping of its own, so the two mappings per stack would run
+ * into vm.max_map_count at around 32000 fibres.
+ */
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+struct stack_chunk {
+	struct stack_chunk *stc_next;
+	char *stc_base;
+	size_t stc_size;
+};
+
+/*
+ * 'size' is the usable size of each stack, and is rounded up to a whole number
+ * of pages.  The free list is allocated with 'alloc'.  The stacks themselves
+ * are always mapped directly, as nothing else can give us guard pages.
+ */
+void
+stack_pool_init(struct stack_pool *pool, struct alloc *alloc, size_t size)
+{
+	pool->stp_size = align_sz(size, PAGE_SIZE);
+	pool->stp_guard = PAGE_SIZE;
+	pool->stp_alloc = alloc;
+	pool->stp_free = NULL;
+	pool->stp_nfree = 0;
+	pool->stp_capfree = 0;
+	pool->stp_chunks = NULL;
+	pool->stp_next = NULL;
+	pool->stp_end = NULL;
+	pool->stp_maps = 0;
+	pool->stp_reuses = 0;
+	pool->stp_high_water = 0;
+	pool->stp_puts = 0;
+	pthread_mutex_init(&pool->stp_lock, NULL);
+}
+
+/*
+ * Every stack must have been given back to the pool by now.
+ */
+void
+stack_pool_finish(struct stack_pool *pool)
+{
+	if ((long int)pool->stp_nfree != pool->stp_maps) {
+		log_warning("stack_pool", "%ld stacks still in use\n",
+			pool->stp_maps - (long int)pool->stp_nfree);
+	}
+
+	while (pool->stp_chunks != NULL) {
+		struct stack_chunk *chunk = pool->stp_chunks;
+		if (munmap(chunk->stc_base, chunk->stc_size) != 0) {
+			abort_with_error("munmap failed with arguments %p and %lu\n",
+				(void *)chunk->stc_base, chunk->stc_size);
+		}
+		pool->stp_chunks = chunk->stc_next;
+		deallocate_with(pool->stp_alloc, chunk, sizeof *chunk);
+	}
+	if (pool->stp_free != NULL) {
+		deallocarray_with(pool->stp_alloc,
+			pool->stp_free, pool->stp_capfree, sizeof(char *));
+	}
+	pthread_mutex_destroy(&pool->stp_lock);
+}
+
+/*
+ * Reserves address space for as many stacks as fit in STACK_POOL_CHUNK_SIZE,
+ * or for one stack if it is bigger than that.  Nothing is committed until it
+ * is touched.  Must be called with stp_lock held.
+ */
+static
+void
+stack_pool_map_chunk(struct stack_pool *pool)
+{
+	size_t each = pool->stp_guard + pool->stp_size;
+	size_t size = STACK_POOL_CHUNK_SIZE / each * each;
+	struct stack_chunk *chunk;
+	char *base;
+
+	if (size == 0) {
+		size = each;
+	}
+	base = mmap(NULL, size,
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+		-1, 0);
+	if (base == MAP_FAILED) {
+		abort_with_error("Could not map %lu bytes for stacks: %s\n",
+			size, strerror(errno));
+	}
+	/* a huge page would commit 2MiB of a stack that uses a few KiB */
+	if (madvise(base, size, MADV_NOHUGEPAGE) != 0) {
+		log_debug("stack_pool", "MADV_NOHUGEPAGE failed: %s\n",
+			strerror(errno));
+	}
+	log_debug("stack_pool", "Mapped %lu stacks at %p\n",
+		size / each, (void *)base);
+
+	chunk = allocate_with(pool->stp_alloc, sizeof *chunk);
+	chunk->stc_next = pool->stp_chunks;
+	chunk->stc_base = base;
+	chunk->stc_size = size;
+	pool->stp_chunks = chunk;
+	pool->stp_next = base;
+	pool->stp_end = base + size;
+}
+
+/*
+ * Turns the page at 'base' into the guard page of the stack above it.
+ */
+static
+void
+stack_pool_guard(struct stack_pool *pool, char *base)
+{
+	if (madvise(base, pool->stp_guard, MADV_GUARD_INSTALL) == 0) {
+		return;
+	}
+	if (errno != EINVAL) {
+		abort_with_error("Could not install stack guard page at %p: %s\n",
+			(void *)base, strerror(errno));
+	}
+	/* an older kernel: each stack costs two mappings, against
+	 * vm.max_map_count, so this is the call that fails first */
+	if (mprotect(base, pool->stp_guard, PROT_NONE) != 0) {
+		abort_with_error("Could not protect stack guard page at %p: %s\n",
+			(void *)base, strerror(errno));
+	}
+}
+
+/*
+ * Returns the lowest address of a stack of the pool's size.  Stacks grow down,
+ * so the initial stack pointer is the address plus the size.
+ */
+char *
+stack_pool_get(struct stack_pool *pool)
+{
+	char *stack = NULL;
+	char *base = NULL;
+
+	pthread_mutex_lock(&pool->stp_lock);
+	if (pool->stp_nfree > 0) {
+		stack = pool->stp_free[--pool->stp_nfree];
+		pool->stp_reuses++;
+	} else {
+		if (pool->stp_next == pool->stp_end) {
+			stack_pool_map_chunk(pool);
+		}
+		base = pool->stp_next;
+		pool->stp_next += pool->stp_guard + pool->stp_size;
+		pool->stp_maps++;
+	}
+	pthread_mutex_unlock(&pool->stp_lock);
+
+	if (base != NULL) {
+		stack_pool_guard(pool, base);
+		stack = base + pool->stp_guard;
+	}
+
+	return stack;
+}
+
+/*
+ * Returns how much of a stack has been used, from the top down to the deepest
+ * page that has been touched since it was last put back in the pool.  Pages
+ * that have been swapped out are not counted.
+ */
+size_t
+stack_pool_used(struct stack_pool *pool, char *stack)
+{
+	unsigned char vec[STACK_POOL_MINCORE_PAGES];
+	size_t offset = 0;
+
+	while (offset < pool->stp_size) {
+		size_t pages = (pool->stp_size - offset) / PAGE_SIZE;
+		size_t i;
+
+		if (pages > STACK_POOL_MINCORE_PAGES) {
+			pages = STACK_POOL_MINCORE_PAGES;
+		}
+		if (mincore(stack + offset, pages * PAGE_SIZE, vec) != 0) {
+			log_warning("stack_pool", "mincore failed on stack at %p\n",
+				(void *)stack);
+			return pool->stp_size;
+		}
+		for (i = 0; i < pages; i++) {
+			if (vec[i] & 1) {
+				return pool->stp_size - offset - i * PAGE_SIZE;
+			}
+		}
+		offset += pages * PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+/*
+ * The pages of the stack are dropped with MADV_DONTNEED before the stack goes
+ * back on the free list.  They read as zero if the stack is used again, so one
+ * fibre cannot see what was left on the stack by another, and an idle stack
+ * costs nothing but address space.  The guard page stays as it is.
+ *
+ * Every so often the stack is measured first, for stp_high_water.  Fibres that
+ * share a stack size tend to do the same things, so a sample finds the
+ * deepest of them soon enough.
+ */
+void
+stack_pool_put(struct stack_pool *pool, char *stack)
+{
+	size_t used = 0;
+
+	if (__atomic_fetch_add(&pool->stp_puts, 1, __ATOMIC_RELAXED)
+			% STACK_POOL_SAMPLE_EVERY == 0) {
+		used = stack_pool_used(pool, stack);
+	}
+	if (madvise(stack, pool->stp_size, MADV_DONTNEED) != 0) {
+		log_warning("stack_pool", "madvise failed on stack at %p\n",
+			(void *)stack);
+	}
+
+	pthread_mutex_lock(&pool->stp_lock);
+	if (used > pool->stp_high_water) {
+		pool->stp_high_water = used;
+	}
+	if (pool->stp_nfree == pool->stp_capfree) {
+		size_t cap = pool->stp_capfree == 0 ?
+			STACK_POOL_MIN_FREE : mul_sz(pool->stp_capfree, 2);
+		if (pool->stp_free == NULL) {
+			pool->stp_free = allocarray_with(pool->stp_alloc,
+				cap, sizeof(char *));
+		} else {
+			pool->stp_free = reallocarray_with(pool->stp_alloc,
+				pool->stp_free, sizeof(char *),
+				pool->stp_capfree, cap);
+		}
+		pool->stp_capfree = cap;
+	}
+	pool->stp_free[pool->stp_nfree++] = stack;
+	pthread_mutex_unlock(&pool->stp_lock);
+}
@@ -1,6 +1,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "abort.h"
 #include "checked.h"
@@ -19,6 +23,299 @@ static void table_object_destroy(struct object_vtable **o, struct alloc *alloc);
 
 static int tkey_equal(struct tkey, struct tkey);
 
+/*
+ * Tables are open-addressed, with linear probing, in the style of SwissTable.
+ * Beside each slot is a control byte, which is TABLE_EMPTY if the slot is
+ * empty and otherwise the low seven bits of the hash of its key.  Probing
+ * starts at the slot given by the top of the hash and compares a group of
+ * TABLE_GROUP control bytes at once, only comparing keys whose control byte
+ * matches, and stops at the first group with an empty slot in it.
+ *
+ * Because probing is linear, a key is always somewhere between the slot it
+ * hashes to and the next empty slot.  Removal keeps it that way by shifting
+ * the keys after the removed one back into the hole, so there are no
+ * tombstones and lookups do not get slower as keys come and go.
+ *
+ * The first TABLE_GROUP - 1 control bytes are repeated after the last, so a
+ * group can be loaded from any slot without wrapping around.
+ */
+#define TABLE_GROUP 16
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
+#define TABLE_MIN_CAPACITY TABLE_GROUP
+/* old slots moved by each change to a table that is being resized */
+#define TABLE_MIGRATE_SLOTS 64
+
+static
+size_t
+table_max_load(size_t capacity)
+{
+	return capacity - capacity / 8;
+}
+
+static
+size_t
+table_capacity_for(size_t n)
+{
+	size_t capacity = TABLE_MIN_CAPACITY;
+
+	while (table_max_load(capacity) < n) {
+		capacity = mul_sz(capacity, 2);
+	}
+	return capacity;
+}
+
+/*
+ * The slot a key hashes to is given by the top bits of its hash, so keys are
+ * in much the same order as their hashes whatever the capacity, which is what
+ * lets a cursor carry on through a resize.
+ */
+static
+size_t
+table_home(size_t capacity, u64 hash)
+{
+	return (size_t)(hash >> (64 - __builtin_ctzl(capacity)));
+}
+
+static
+u8
+table_h2(u64 hash)
+{
+	return (u8)(hash & 0x7f);
+}
+
+/*
+ * A mask with bit i set if control byte i of the group starting at 'ctrl'
+ * is 'h2'.
+ */
+static
+unsigned
+table_group_match(const u8 *ctrl, u8 h2)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+	return (unsigned)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+#else
+	unsigned mask = 0;
+	unsigned i;
+
+	for (i = 0; i < TABLE_GROUP; i++) {
+		mask |= (unsigned)(ctrl[i] == h2) << i;
+	}
+	return mask;
+#endif
+}
+
+static
+unsigned
+table_group_empty(const u8 *ctrl)
+{
+#ifdef __SSE2__
+	/* only empty control bytes have their top bit set */
+	return (unsigned)_mm_movemask_epi8(
+		_mm_loadu_si128((const __m128i *)(const void *)ctrl));
+#else
+	return table_group_match(ctrl, TABLE_EMPTY);
+#endif
+}
+
+static
+void
+table_set_ctrl(u8 *ctrl, size_t capacity, size_t i, u8 c)
+{
+	ctrl[i] = c;
+	if (i < TABLE_GROUP - 1) {
+		ctrl[capacity + i] = c;
+	}
+}
+
+static
+void
+table_alloc_slots(struct table *table, size_t capacity)
+{
+	table->t_capacity = capacity;
+	table->t_ctrl = allocate_with(table->t_alloc,
+		capacity + TABLE_GROUP - 1);
+	memset(table->t_ctrl, TABLE_EMPTY, capacity + TABLE_GROUP - 1);
+	table->t_pairs = allocarray_with(table->t_alloc,
+		capacity, sizeof(struct tpair));
+}
+
+static
+void
+table_free_slots(struct alloc *alloc, u8 *ctrl, struct tpair *pairs,
+	size_t capacity)
+{
+	deallocate_with(alloc, ctrl, capacity + TABLE_GROUP - 1);
+	deallocarray_with(alloc, pairs, capacity, sizeof(struct tpair));
+}
+
+/*
+ * Looks for 'key' in one set of slots.  The old slots of a table that is
+ * being resized have TABLE_DELETED in them, which has its top bit set like
+ * TABLE_EMPTY, so they have to be searched with 'exact' set, which only
+ * stops at a group with a slot that really is empty.
+ */
+static
+struct tpair *
+table_find_in(u8 *ctrl, struct tpair *pairs, size_t capacity,
+	struct tkey key, int exact)
+{
+	size_t mask = capacity - 1;
+	size_t pos = table_home(capacity, key.tk_hash);
+	u8 h2 = table_h2(key.tk_hash);
+
+	for (;;) {
+		unsigned match = table_group_match(ctrl + pos, h2);
+		unsigned empty;
+		while (match != 0) {
+			size_t i = (pos + (size_t)__builtin_ctz(match)) & mask;
+			if (tkey_equal(pairs[i].tkv_key, key)) {
+				return &pairs[i];
+			}
+			match &= match - 1;
+		}
+		if (exact) {
+			empty = table_group_match(ctrl + pos, TABLE_EMPTY);
+		} else {
+			empty = table_group_empty(ctrl + pos);
+		}
+		if (empty != 0) {
+			return NULL;
+		}
+		pos = (pos + TABLE_GROUP) & mask;
+	}
+}
+
+static
+struct tpair *
+table_find(struct table *table, struct tkey key)
+{
+	struct tpair *pair;
+
+	/* the allocator might look something up while a table is set up */
+	if (table->t_size == 0) {
+		return NULL;
+	}
+	pair = table_find_in(table->t_ctrl, table->t_pairs, table->t_capacity,
+		key, 0);
+	if (pair == NULL && table->t_old_ctrl != NULL) {
+		pair = table_find_in(table->t_old_ctrl, table->t_old_pairs,
+			table->t_old_capacity, key, 1);
+	}
+	return pair;
+}
+
+/*
+ * Puts a key that is not in the table into the first empty slot at or after
+ * the one it hashes to.  There must be room for it.  The caller counts it in
+ * t_size.
+ */
+static
+struct tpair *
+table_place(struct table *table, struct tkey key)
+{
+	size_t mask = table->t_capacity - 1;
+	size_t pos = table_home(table->t_capacity, key.tk_hash);
+	unsigned empty;
+	size_t i;
+
+	while ((empty = table_group_empty(table->t_ctrl + pos)) == 0) {
+		pos = (pos + TABLE_GROUP) & mask;
+	}
+	i = (pos + (size_t)__builtin_ctz(empty)) & mask;
+	table_set_ctrl(table->t_ctrl, table->t_capacity, i,
+		table_h2(key.tk_hash));
+	table->t_pairs[i].tkv_key = key;
+	return &table->t_pairs[i];
+}
+
+/*
+ * Moves up to 'n' of the old slots into the new ones, and frees the old slots
+ * once they have all been moved.  A moved slot is marked TABLE_DELETED rather
+ * than TABLE_EMPTY, so that keys after it in the old slots can still be found.
+ */
+static
+void
+table_migrate(struct table *table, size_t n)
+{
+	size_t end = table->t_old_next + n;
+
+	if (end > table->t_old_capacity || end < n) {
+		end = table->t_old_capacity;
+	}
+	for (; table->t_old_next < end; table->t_old_next++) {
+		size_t i = table->t_old_next;
+		struct tpair *pair;
+		if ((table->t_old_ctrl[i] & TABLE_EMPTY) != 0) {
+			continue;
+		}
+		pair = table_place(table, table->t_old_pairs[i].tkv_key);
+		pair->tkv_value = table->t_old_pairs[i].tkv_value;
+		table_set_ctrl(table->t_old_ctrl, table->t_old_capacity, i,
+			TABLE_DELETED);
+	}
+	if (table->t_old_next == table->t_old_capacity) {
+		table_free_slots(table->t_alloc, table->t_old_ctrl,
+			table->t_old_pairs, table->t_old_capacity);
+		table->t_old_ctrl = NULL;
+		table->t_old_pairs = NULL;
+		table->t_old_capacity = 0;
+		table->t_old_next = 0;
+	}
+}
+
+/*
+ * A table with at least t_incremental_min slots is resized a little at a
+ * time: the old slots are kept beside the new ones, and every change to the
+ * table moves TABLE_MIGRATE_SLOTS of them.  The new slots are twice as many,
+ * and at most 7/8 of the old ones were full, so they are all moved well
+ * before the new slots fill up.
+ */
+static
+void
+table_resize(struct table *table, size_t capacity)
+{
+	if (table->t_old_ctrl != NULL) {
+		table_migrate(table, table->t_old_capacity);
+	}
+
+	table->t_old_ctrl = table->t_ctrl;
+	table->t_old_pairs = table->t_pairs;
+	table->t_old_capacity = table->t_capacity;
+	table->t_old_next = 0;
+	table_alloc_slots(table, capacity);
+
+	if (table->t_old_capacity < table->t_incremental_min) {
+		table_migrate(table, table->t_old_capacity);
+	} else {
+		table_migrate(table, TABLE_MIGRATE_SLOTS);
+	}
+}
+
+/*
+ * The pair for 'key', which is added if it is not there, in which case its
+ * value is left for the caller to set.
+ */
+static
+struct tpair *
+table_find_or_add(struct table *table, struct tkey key)
+{
+	struct tpair *pair = table_find(table, key);
+
+	if (pair != NULL) {
+		return pair;
+	}
+	if (table->t_size + 1 > table_max_load(table->t_capacity)) {
+		table_resize(table, mul_sz(table->t_capacity, 2));
+	} else if (table->t_old_ctrl != NULL) {
+		table_migrate(table, TABLE_MIGRATE_SLOTS);
+	}
+	table->t_size++;
+	return table_place(table, key);
+}
+
 struct table *
 table_create(struct alloc *alloc, size_t initial_size)
 {
@@ -37,21 +334,214 @@ table_destroy(struct table *table)
 	deallocate_with(table->t_alloc, table, sizeof(struct table));
 }
 
+/*
+ * 'initial_size' keys can be added before the table needs to grow.
+ */
 void
 table_init(struct table *table, struct alloc *alloc, size_t initial_size)
 {
 	table->t_size = 0;
-	table->t_capacity = initial_size;
-	table->t_pairs = allocarray_with(alloc,
-		sizeof(struct tpair), initial_size);
 	table->t_alloc = alloc;
+	table->t_old_ctrl = NULL;
+	table->t_old_pairs = NULL;
+	table->t_old_capacity = 0;
+	table->t_old_next = 0;
+	table->t_incremental_min = TABLE_INCREMENTAL_MIN;
+	table_alloc_slots(table, table_capacity_for(initial_size));
 }
 
 void
 table_finish(struct table *table)
 {
-	deallocarray_with(table->t_alloc,
-		table->t_pairs, table->t_capacity, sizeof(struct tpair));
+	/* the allocator might look something up in this table while it is
+	 * freed, so it must look empty first */
+	table->t_size = 0;
+	if (table->t_old_ctrl != NULL) {
+		table_free_slots(table->t_alloc, table->t_old_ctrl,
+			table->t_old_pairs, table->t_old_capacity);
+	}
+	table_free_slots(table->t_alloc, table->t_ctrl, table->t_pairs,
+		table->t_capacity);
+}
+
+/*
+ * Returns -1 if the key is not in the table.  Each key after the removed one
+ * up to the next empty slot is moved back into the hole if that does not put
+ * it before the slot it hashes to.  A key that has not yet been moved out of
+ * the old slots of a table being resized is just marked deleted, as the old
+ * slots are going away anyway.
+ */
+int
+table_remove(struct table *table, struct tkey key)
+{
+	size_t mask = table->t_capacity - 1;
+	struct tpair *pair = table_find(table, key);
+	size_t hole, i;
+
+	if (pair == NULL) {
+		return -1;
+	}
+	table->t_size--;
+	if (pair < table->t_pairs || pair >= table->t_pairs + table->t_capacity) {
+		table_set_ctrl(table->t_old_ctrl, table->t_old_capacity,
+			(size_t)(pair - table->t_old_pairs), TABLE_DELETED);
+		table_migrate(table, TABLE_MIGRATE_SLOTS);
+		return 0;
+	}
+
+	hole = i = (size_t)(pair - table->t_pairs);
+	for (;;) {
+		size_t home;
+		i = (i + 1) & mask;
+		if (table->t_ctrl[i] == TABLE_EMPTY) {
+			break;
+		}
+		home = table_home(table->t_capacity,
+			table->t_pairs[i].tkv_key.tk_hash);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table->t_pairs[hole] = table->t_pairs[i];
+			table_set_ctrl(table->t_ctrl, table->t_capacity, hole,
+				table->t_ctrl[i]);
+			hole = i;
+		}
+	}
+	table_set_ctrl(table->t_ctrl, table->t_capacity, hole, TABLE_EMPTY);
+	if (table->t_old_ctrl != NULL) {
+		table_migrate(table, TABLE_MIGRATE_SLOTS);
+	}
+	return 0;
+}
+
+/*
+ * A table of 'n' pairs, made big enough for them up front so that it is never
+ * resized while they are added.  If a key is given more than once, the last
+ * value given for it wins.
+ */
+struct table *
+table_build_from_pairs(struct alloc *alloc, const struct tpair *pairs, size_t n)
+{
+	struct table *table = table_create(alloc, n);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct tpair *pair = table_find_or_add(table, pairs[i].tkv_key);
+		pair->tkv_value = pairs[i].tkv_value;
+	}
+	return table;
+}
+
+/*
+ * A cursor goes through a table one home slot at a time, in order, where a
+ * key's home is the slot it hashes to.  Homes are picked out by the top bits
+ * of hashes, so tc_next, the start of the next home as a hash, means the same
+ * however big the table is, and the cursor neither misses nor repeats keys
+ * when the table grows.  All the keys of a home are taken at once and their
+ * values are looked up as they are handed out, so changes to the table
+ * between calls cannot move a key past the cursor either.
+ *
+ * Every key that is in the table for the whole time the cursor is in use is
+ * handed out exactly once.  Keys that are added or removed meanwhile might or
+ * might not be.
+ */
+void
+table_cursor_init(struct table_cursor *tc, struct table *table)
+{
+	tc->tc_table = table;
+	tc->tc_next = 0;
+	tc->tc_done = 0;
+	tc->tc_keys = NULL;
+	tc->tc_nkeys = tc->tc_capkeys = tc->tc_key = 0;
+}
+
+void
+table_cursor_finish(struct table_cursor *tc)
+{
+	if (tc->tc_keys != NULL) {
+		deallocarray_with(tc->tc_table->t_alloc, tc->tc_keys,
+			tc->tc_capkeys, sizeof(struct tkey));
+	}
+}
+
+static
+void
+table_cursor_push(struct table_cursor *tc, struct tkey key)
+{
+	if (tc->tc_nkeys == tc->tc_capkeys) {
+		size_t capkeys = tc->tc_capkeys == 0 ? 8 : mul_sz(tc->tc_capkeys, 2);
+		if (tc->tc_keys == NULL) {
+			tc->tc_keys = allocarray_with(tc->tc_table->t_alloc,
+				capkeys, sizeof(struct tkey));
+		} else {
+			tc->tc_keys = reallocarray_with(tc->tc_table->t_alloc,
+				tc->tc_keys, sizeof(struct tkey),
+				tc->tc_capkeys, capkeys);
+		}
+		tc->tc_capkeys = capkeys;
+	}
+	tc->tc_keys[tc->tc_nkeys++] = key;
+}
+
+/*
+ * Takes the keys whose home in the new slots is 'home' out of one set of
+ * slots.  They are all between the slot they hash to in that set and the next
+ * empty slot after it.
+ */
+static
+void
+table_cursor_collect(struct table_cursor *tc, u8 *ctrl, struct tpair *pairs,
+	size_t capacity, size_t home)
+{
+	struct table *table = tc->tc_table;
+	size_t mask = capacity - 1;
+	size_t i = table_home(capacity, tc->tc_next);
+
+	for (; ctrl[i] != TABLE_EMPTY; i = (i + 1) & mask) {
+		if (ctrl[i] != TABLE_DELETED && table_home(table->t_capacity,
+				pairs[i].tkv_key.tk_hash) == home) {
+			table_cursor_push(tc, pairs[i].tkv_key);
+		}
+	}
+}
+
+/*
+ * Gives the next key and its value, or returns -1 if there are no more.
+ */
+int
+table_cursor_next(struct table_cursor *tc, struct tkey *key,
+	union object *value)
+{
+	struct table *table = tc->tc_table;
+
+	for (;;) {
+		while (tc->tc_key < tc->tc_nkeys) {
+			struct tpair *pair = table_find(table,
+				tc->tc_keys[tc->tc_key++]);
+			if (pair != NULL) {
+				*key = pair->tkv_key;
+				*value = pair->tkv_value;
+				return 0;
+			}
+		}
+		if (tc->tc_done) {
+			return -1;
+		}
+
+		tc->tc_nkeys = tc->tc_key = 0;
+		if (table->t_size != 0) {
+			size_t home = table_home(table->t_capacity, tc->tc_next);
+			table_cursor_collect(tc, table->t_ctrl, table->t_pairs,
+				table->t_capacity, home);
+			if (table->t_old_ctrl != NULL) {
+				table_cursor_collect(tc, table->t_old_ctrl,
+					table->t_old_pairs,
+					table->t_old_capacity, home);
+			}
+		}
+		/* the start of the next home, which wraps to zero after the
+		 * last one */
+		tc->tc_next += (u64)1 << (64 - __builtin_ctzl(table->t_capacity));
+		tc->tc_done = tc->tc_next == 0;
+	}
 }
 
 int
@@ -207,14 +697,12 @@ object_try_as_table(union object *o, struct table **value)
 int \
 table_try_get_##typename(struct table *table, struct tkey key, typename *value) \
 { \
-	size_t i; \
+	struct tpair *pair = table_find(table, key); \
 \
-	for (i = 0; i < table->t_size; i++) { \
-		if (tkey_equal(table->t_pairs[i].tkv_key, key)) { \
-			return object_try_as_##typename(&table->t_pairs[i].tkv_value, value); \
-		} \
+	if (pair == NULL) { \
+		return -1; \
 	} \
-	return -1; \
+	return object_try_as_##typename(&pair->tkv_value, value); \
 } \
 typename \
 table_get_##typename(struct table *table, struct tkey key) \
@@ -229,29 +717,10 @@ table_get_##typename(struct table *table, struct tkey key) \
 void \
 table_set_##typename(struct table *table, struct tkey key, typename value) \
 { \
-	size_t i; \
+	struct tpair *pair = table_find_or_add(table, key); \
 \
-	for (i = 0; i < table->t_size; i++) { \
-		if (tkey_equal(table->t_pairs[i].tkv_key, key)) { \
-			object_init_from_##typename(&table->t_pairs[i].tkv_value, value); \
-			return; \
-		} \
-	} \
-	if (i == table->t_capacity) { \
-		size_t new_capacity = mul_sz(table->t_capacity, 2); \
-		table->t_pairs = reallocarray_with(table->t_alloc, \
-			table->t_pairs, \
-			sizeof(struct tpair), \
-			table->t_capacity, \
-			new_capacity); \
-		table->t_capacity = new_capacity; \
-	} \
-	table->t_size += 1; \
-	table->t_pairs[i].tkv_key = key; \
-	object_init_from_##typename(&table->t_pairs[i].tkv_value, value); \
-\
-	return; \
-} 
+	object_init_from_##typename(&pair->tkv_value, value); \
+}
 
 DEFINE_SIMPLE_TABLE_GET_SET(u8)
 DEFINE_SIMPLE_TABLE_GET_SET(u16)
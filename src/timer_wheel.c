@@ -0,0 +1,220 @@
+#include <stddef.h>
+
+#include "abort.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* the number of ticks spanned by one slot of 'level' */
+#define LEVEL_SPAN(level) (1ul << ((level) * TIMER_WHEEL_BITS))
+
+void
+timer_wheel_init(struct timer_wheel *tw, unsigned long now)
+{
+	size_t i, j;
+
+	tw->tw_now = now;
+	tw->tw_count = 0;
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		tw->tw_occupied[i] = 0;
+		for (j = 0; j < TIMER_WHEEL_SLOTS; j++) {
+			struct timer *head = &tw->tw_slots[i][j];
+			head->tm_next = head->tm_prev = head;
+		}
+	}
+}
+
+/*
+ * Puts a timer in the slot that will come round at or just before it expires.
+ * A timer that is already due goes in the slot for the current tick, and one
+ * too far away for the wheel goes in the top level, and is put back there
+ * each time the top level comes round to it until it is close enough.
+ */
+static
+void
+timer_wheel_insert(struct timer_wheel *tw, struct timer *timer)
+{
+	unsigned long expires = timer->tm_expires;
+	unsigned long delta;
+	size_t level, slot;
+	struct timer *head;
+
+	if (expires < tw->tw_now) {
+		expires = tw->tw_now;
+	}
+	delta = expires - tw->tw_now;
+	if (delta >= LEVEL_SPAN(TIMER_WHEEL_LEVELS)) {
+		delta = LEVEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+		expires = tw->tw_now + delta;
+	}
+
+	for (level = 0; delta >= LEVEL_SPAN(level + 1); level++)
+		;
+	slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+
+	head = &tw->tw_slots[level][slot];
+	timer->tm_next = head;
+	timer->tm_prev = head->tm_prev;
+	head->tm_prev->tm_next = timer;
+	head->tm_prev = timer;
+	tw->tw_occupied[level] |= 1ul << slot;
+}
+
+/*
+ * Takes everything out of a slot, returning it as a list chained through
+ * tm_next and ending in NULL.
+ */
+static
+struct timer *
+timer_wheel_take_slot(struct timer_wheel *tw, size_t level, size_t slot)
+{
+	struct timer *head = &tw->tw_slots[level][slot];
+	struct timer *first = head->tm_next;
+
+	if (first == head) {
+		return NULL;
+	}
+
+	head->tm_prev->tm_next = NULL;
+	head->tm_next = head->tm_prev = head;
+	tw->tw_occupied[level] &= ~(1ul << slot);
+	return first;
+}
+
+/*
+ * 'timer->tm_expires' is in ticks, and must be set by the caller.
+ */
+void
+timer_wheel_add(struct timer_wheel *tw, struct timer *timer)
+{
+	timer_wheel_insert(tw, timer);
+	tw->tw_count++;
+}
+
+/*
+ * The timer must be in the wheel, and not yet returned by timer_wheel_advance.
+ */
+void
+timer_wheel_remove(struct timer_wheel *tw, struct timer *timer)
+{
+	struct timer *prev = timer->tm_prev;
+
+	prev->tm_next = timer->tm_next;
+	timer->tm_next->tm_prev = prev;
+	timer->tm_next = timer->tm_prev = NULL;
+	tw->tw_count--;
+
+	if (prev->tm_next == prev) {
+		/* the slot is empty, and 'prev' is its head */
+		size_t index = (size_t)(prev - &tw->tw_slots[0][0]);
+		tw->tw_occupied[index / TIMER_WHEEL_SLOTS] &=
+			~(1ul << (index % TIMER_WHEEL_SLOTS));
+	}
+}
+
+/*
+ * Returns the earliest tick at or after 'tick' at which something might
+ * happen: either a timer in the bottom level expires, or a higher level comes
+ * round and has to be moved down.  Returns zero if the wheel is empty.
+ */
+static
+int
+timer_wheel_next_event(struct timer_wheel *tw, unsigned long tick,
+	unsigned long *event)
+{
+	unsigned long later = tw->tw_occupied[0] >> (tick & TIMER_WHEEL_MASK);
+	unsigned long span, boundary;
+	int found = 0;
+	size_t level;
+
+	if (later != 0) {
+		*event = tick + (unsigned long)__builtin_ctzl(later);
+		found = 1;
+	}
+
+	/*
+	 * Higher levels only come round on multiples of their span, but 'tick'
+	 * might be one, so this can still come before the bottom level.
+	 */
+	if (later == 0 && tw->tw_occupied[0] != 0) {
+		level = 1;
+	} else {
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if (tw->tw_occupied[level] != 0) {
+				break;
+			}
+		}
+	}
+	if (level < TIMER_WHEEL_LEVELS) {
+		span = LEVEL_SPAN(level);
+		boundary = (tick + span - 1) & ~(span - 1);
+		if (!found || boundary < *event) {
+			*event = boundary;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Expires every timer due at or before 'now', returning them as a list chained
+ * through tm_next and ending in NULL.  Stretches of time where nothing happens
+ * are skipped over, rather than going through them a tick at a time.
+ */
+struct timer *
+timer_wheel_advance(struct timer_wheel *tw, unsigned long now)
+{
+	struct timer *expired = NULL;
+	struct timer **tail = &expired;
+	unsigned long tick;
+
+	while (tw->tw_now <= now) {
+		size_t level;
+
+		if (!timer_wheel_next_event(tw, tw->tw_now, &tick) || tick > now) {
+			tw->tw_now = now + 1;
+			break;
+		}
+		tw->tw_now = tick;
+
+		/* move down the timers in any levels that have come round */
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			struct timer *timer;
+			if ((tick & (LEVEL_SPAN(level) - 1)) != 0) {
+				break;
+			}
+			timer = timer_wheel_take_slot(tw, level,
+				(tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+			while (timer != NULL) {
+				struct timer *next = timer->tm_next;
+				timer_wheel_insert(tw, timer);
+				timer = next;
+			}
+		}
+
+		*tail = timer_wheel_take_slot(tw, 0, tick & TIMER_WHEEL_MASK);
+		while (*tail != NULL) {
+			(*tail)->tm_prev = NULL;
+			tw->tw_count--;
+			tail = &(*tail)->tm_next;
+		}
+		tw->tw_now = tick + 1;
+	}
+
+	return expired;
+}
+
+/*
+ * Sets '*tick' to a tick no later than the one at which the next timer
+ * expires, for deciding how long to sleep.  Returns zero if there are no
+ * timers at all.
+ */
+int
+timer_wheel_next(struct timer_wheel *tw, unsigned long *tick)
+{
+	if (tw->tw_count == 0) {
+		return 0;
+	}
+	return timer_wheel_next_event(tw, tw->tw_now, tick);
+}
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "types.h"
@@ -13,13 +16,23 @@
 #include "memory.h"
 #include "alloc.h"
 #include "alloc_buf.h"
+#include "alloc_mmap.h"
+#include "alloc_arena.h"
 #include "slab_pool.h"
+#include "alloc_slab.h"
+#include "alloc_stats.h"
 #include "str.h"
 #include "hash.h"
+#include "timer_wheel.h"
 #include "fibre.h"
+#include "channel.h"
+#include "fibre_io.h"
 #include "random.h"
 #include "object.h"
 #include "table.h"
+#include "map.h"
+#include "epoch.h"
+#include "ctable.h"
 #include "heapstring.h"
 
 #define STACK_SIZE (4 * 1024 * 1024)
@@ -59,29 +72,306 @@ test_hash_string(const char *str, size_t len)
 	}
 }
 
-static
-int
-counter;
-
 #define NDO_PRINT
 
+/*
+ * Each fibre starts the next one and returns the sum of its own number and
+ * everything after it.
+ */
 static
-void
-test_fibre(void)
+void *
+test_fibre(void *arg)
 {
-	int i = ++counter;
+	intptr_t i = (intptr_t)arg;
+	intptr_t sum = i;
+	struct fibre_join join;
+	void *result;
 #ifdef DO_PRINT
-	eprintf("Hello, %d!\n", i);
+	eprintf("Hello, %ld!\n", i);
 #endif
 	if (i < 30) {
-		fibre_go(test_fibre);
+		fibre_go_join(&join, test_fibre, (void *)(i + 1));
 		fibre_yield();
+		result = fibre_join(&join);
+		sum += (intptr_t)result;
 	}
 	fibre_yield();
 #ifdef DO_PRINT
-	eprintf("Goodbye, %d!\n", i);
+	eprintf("Goodbye, %ld!\n", i);
 #endif
-	fibre_return();
+	return (void *)sum;
+}
+
+/*
+ * The producer sends the numbers 1 to 1000 down a small bounded channel, and
+ * the consumer receives them in batches and returns their sum.
+ */
+static
+void
+test_channel_producer(void *arg)
+{
+	struct channel *ch = arg;
+	long i;
+
+	for (i = 1; i <= 1000; i++) {
+		channel_send(ch, &i);
+	}
+	channel_close(ch);
+}
+
+static
+void *
+test_channel_consumer(void *arg)
+{
+	struct channel *ch = arg;
+	long buf[16];
+	long sum = 0;
+	size_t i, n;
+
+	while ((n = channel_recv(ch, buf, 16)) != 0) {
+		for (i = 0; i < n; i++) {
+			sum += buf[i];
+		}
+	}
+	return (void *)sum;
+}
+
+/*
+ * Two fibres at either end of a non-blocking pipe, with the writer writing
+ * more than the pipe can hold so that both of them have to wait for it.
+ */
+static
+void
+test_pipe_writer(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[4096];
+	int i;
+
+	memset(buf, 'v', sizeof buf);
+	for (i = 0; i < 64; i++) {
+		if (fibre_write(fd, buf, sizeof buf) != (ssize_t)sizeof buf) {
+			abort_with_error("Could not write to pipe\n");
+		}
+	}
+	close(fd);
+}
+
+static
+void *
+test_pipe_reader(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[1000];
+	intptr_t total = 0;
+	ssize_t n;
+
+	while ((n = fibre_read(fd, buf, sizeof buf)) > 0) {
+		total += n;
+	}
+	close(fd);
+	return (void *)total;
+}
+
+/*
+ * One fibre waits to read a socket while another waits to write to the same
+ * socket, as a language server's connection would, and each must be woken
+ * when its own side is ready.
+ */
+#define TEST_SOCKET_BYTES (64 * 4096)
+
+static
+void *
+test_socket_reader(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char c;
+
+	return (void *)(intptr_t)fibre_read(fd, &c, 1);
+}
+
+static
+void *
+test_socket_writer(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[4096];
+	intptr_t total = 0;
+	ssize_t n;
+
+	memset(buf, 'v', sizeof buf);
+	while (total < TEST_SOCKET_BYTES) {
+		n = fibre_write(fd, buf, sizeof buf);
+		if (n <= 0) {
+			abort_with_error("Could not write to socket\n");
+		}
+		total += n;
+	}
+	return (void *)total;
+}
+
+/*
+ * Stands in for some background work that goes on until it is no longer
+ * wanted, and counts how many passes it got through.
+ */
+static
+void *
+test_cancelled_search(void *arg)
+{
+	struct fibre_cancel_scope *scope = arg;
+	intptr_t passes = 0;
+
+	fibre_cancel_scope_enter(scope);
+	while (fibre_sleep(1) != FIBRE_CANCELLED) {
+		passes++;
+	}
+	fibre_cancel_scope_exit(scope);
+	return (void *)passes;
+}
+
+/*
+ * Each fibre keeps its own number in fibre-local storage across a few
+ * yields, and the destructor adds up the numbers of the fibres that return.
+ */
+static size_t test_local_key;
+static long test_local_sum;
+
+static
+void
+test_local_destructor(void *value)
+{
+	__atomic_add_fetch(&test_local_sum, (long)(intptr_t)value,
+		__ATOMIC_SEQ_CST);
+}
+
+static
+void *
+test_local(void *arg)
+{
+	int i;
+
+	fibre_local_set(test_local_key, arg);
+	for (i = 0; i < 3; i++) {
+		fibre_yield();
+		if (fibre_local_get(test_local_key) != arg) {
+			abort_with_error("fibre-local value changed\n");
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Stands in for laying out a line of text, which needs somewhere to put its
+ * spans only until the frame has been drawn.
+ */
+static
+long
+test_layout_line(long line)
+{
+	struct arena_alloc *arena = arena_fibre_default();
+	struct arena_mark mark;
+	long *spans;
+	long i, sum = 0;
+
+	arena_mark(arena, &mark);
+	spans = allocarray_with(&arena->aa_alloc, 20, sizeof *spans);
+	for (i = 0; i < 20; i++) {
+		spans[i] = line + i;
+		sum += spans[i];
+	}
+	arena_rewind(arena, &mark);
+	return sum;
+}
+
+static
+void *
+test_arena_frames(void *arg)
+{
+	struct arena_alloc arena;
+	long frame, line, sum = 0;
+
+	(void)arg;
+	arena_alloc_init(&arena, 16 * 1024);
+	arena_set_fibre_default(&arena);
+	for (frame = 0; frame < 100; frame++) {
+		/* a frame's worth of highlight spans, all thrown away at once */
+		for (line = 0; line < 50; line++) {
+			long *span = allocate_with(&arena.aa_alloc, sizeof *span);
+			*span = test_layout_line(line);
+			sum += *span;
+		}
+		arena_reset(&arena);
+	}
+	arena_set_fibre_default(NULL);
+	arena_alloc_finish(&arena);
+	return (void *)(intptr_t)sum;
+}
+
+/*
+ * Negative keys all have the same hash, so they end up together in a
+ * collision node at the bottom of a map's trie.
+ */
+static
+struct tkey
+test_map_key(z64 k)
+{
+	struct tkey key = table_key_z64(k);
+	if (k < 0) {
+		key.tk_hash = 0x5555555555555555ul;
+	}
+	return key;
+}
+
+/*
+ * Sets keys 'from' to 'to' - 1 of 'map', and then removes those from 'keep'
+ * on, checking that each is only removed once.
+ */
+static
+void
+test_map_fill(struct map *map, z64 from, z64 to, z64 keep)
+{
+	z64 k;
+
+	for (k = from; k < to; k++) {
+		map_set_z64(map, test_map_key(k), k);
+	}
+	for (k = keep; k < to; k++) {
+		if (map_remove(map, test_map_key(k)) != 0) {
+			abort_with_error("map lost %ld\n", (long)k);
+		}
+		if (map_remove(map, test_map_key(k)) == 0) {
+			abort_with_error("map removed %ld twice\n", (long)k);
+		}
+	}
+}
+
+/*
+ * Readers look keys up without locks while the main thread sets, overwrites
+ * and removes them.  The value of key k is always k * 1000 plus something
+ * less than 1000, so a reader that got hold of another key's node, or of one
+ * that had been freed and reused, would notice.
+ */
+#define TEST_CTABLE_KEYS 16384
+static struct ctable test_ctable;
+static int test_ctable_stop;
+
+static
+void *
+test_ctable_reader(void *arg)
+{
+	unsigned long seed = (unsigned long)(intptr_t)arg;
+	z64 key, value;
+
+	while (!__atomic_load_n(&test_ctable_stop, __ATOMIC_ACQUIRE)) {
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		key = (z64)((seed >> 33) % TEST_CTABLE_KEYS);
+		if (ctable_try_get_z64(&test_ctable, table_key_z64(key),
+				&value) == 0 && value / 1000 != key) {
+			abort_with_error("ctable gave %ld for key %ld\n",
+				(long)value, (long)key);
+		}
+	}
+	return NULL;
 }
 
 static void test_slab(void);
@@ -90,7 +380,6 @@ int
 main(void)
 {
 	size_t page_size;
-	counter = 0;
 
 	log_init();
 	log_set_loglevel(LOG_INFO);
@@ -137,10 +426,174 @@ main(void)
 	}
 
 	{
+		struct stats_alloc stats;
 		union object t;
-		object_init_as_table(&t, &sys_alloc, 16);
+		stats_alloc_init(&stats, &sys_alloc, "table", 1);
+		object_init_as_table(&t, &stats.sta_alloc, 16);
 		eprintf("table: %s\n", object_typename(t));
-		object_destroy(t, &sys_alloc);
+		object_destroy(t, &stats.sta_alloc);
+		stats_alloc_finish(&stats);
+	}
+
+	{
+		static const char *const names[] = {"tab-width", "fill-column", "indent"};
+		struct tpair pairs[3];
+		struct table *config;
+		struct table_cursor tc;
+		struct tkey key;
+		union object value;
+		size_t i;
+		for (i = 0; i < 3; i++) {
+			pairs[i].tkv_key = table_key_cstr(names[i]);
+			object_init_from_int(&pairs[i].tkv_value, (int)(8 * i + 4));
+		}
+		config = table_build_from_pairs(&sys_alloc, pairs, 3);
+		table_remove(config, table_key_cstr("indent"));
+		table_cursor_init(&tc, config);
+		while (table_cursor_next(&tc, &key, &value) == 0) {
+			eprintf("config: %s = %d\n", object_as_cstr(&key.tk_obj),
+				object_as_int(&value));
+		}
+		table_cursor_finish(&tc);
+		table_destroy(config);
+	}
+
+	{
+		struct map config, snapshot;
+		struct table *keyed;
+		union object o1, o2, o3;
+		map_init(&config, &sys_alloc);
+		map_set_int(&config, table_key_cstr("tab-width"), 8);
+		map_set_int(&config, table_key_cstr("fill-column"), 72);
+		map_set_cstr(&config, table_key_cstr("indent"), "tabs");
+		map_copy(&snapshot, &config);
+		map_set_int(&config, table_key_cstr("tab-width"), 4);
+		map_set_cstr(&config, table_key_cstr("indent"), "spaces");
+		eprintf("map: tab-width is %d, and was %d in the snapshot\n",
+			map_get_int(&config, table_key_cstr("tab-width")),
+			map_get_int(&snapshot, table_key_cstr("tab-width")));
+		eprintf("map: indent is %s, and was %s in the snapshot\n",
+			map_get_cstr(&config, table_key_cstr("indent")),
+			map_get_cstr(&snapshot, table_key_cstr("indent")));
+		map_set_int(&config, table_key_cstr("tab-width"), 8);
+		map_set_cstr(&config, table_key_cstr("indent"), "tabs");
+		object_init_as_map(&o1, &config);
+		object_init_as_map(&o2, &snapshot);
+		eprintf("map: equal again: %d, with equal hashes: %d\n",
+			object_equal(o1, o2), object_hash(o1) == object_hash(o2));
+		/* a map object is a value, so it can be copied and used as a key */
+		o3 = object_copy(o1);
+		keyed = table_create(&sys_alloc, 4);
+		table_set_int(keyed, table_key(o1), 1);
+		eprintf("map: copy is equal: %d, with equal hashes: %d, and finds "
+			"the original's value: %d\n", object_equal(o1, o3),
+			object_hash(o1) == object_hash(o3),
+			table_get_int(keyed, table_key(o3)));
+		table_destroy(keyed);
+		object_destroy(o3, &sys_alloc);
+		object_destroy(o1, &sys_alloc);
+		object_destroy(o2, &sys_alloc);
+		map_finish(&snapshot);
+		map_finish(&config);
+	}
+
+	{
+		/*
+		 * A map that had keys added and then removed must have the
+		 * same shape as one that only ever had the keys left, or
+		 * map_equal would tell them apart.
+		 */
+		struct map direct, removed;
+		z64 k, v;
+		map_init(&direct, &sys_alloc);
+		map_init(&removed, &sys_alloc);
+		test_map_fill(&direct, -2, 1000, 1000);
+		test_map_fill(&removed, -3, 2000, 1000);
+		map_remove(&removed, test_map_key(-3));
+		for (k = -2; k < 1000; k++) {
+			if (map_try_get_z64(&removed, test_map_key(k), &v) != 0 ||
+					v != k) {
+				abort_with_error("map lost %ld\n", (long)k);
+			}
+		}
+		if (map_try_get_z64(&removed, test_map_key(-3), &v) == 0 ||
+				map_try_get_z64(&removed, test_map_key(1000), &v) == 0) {
+			abort_with_error("map kept a key it removed\n");
+		}
+		eprintf("map: %lu keys, built both ways: equal %d, with equal "
+			"hashes %d\n", removed.m_size, map_equal(&direct, &removed),
+			map_hash(&direct) == map_hash(&removed));
+
+		/* the collision node goes when it is down to one key */
+		map_remove(&removed, test_map_key(-2));
+		map_finish(&direct);
+		map_init(&direct, &sys_alloc);
+		test_map_fill(&direct, -1, 1000, 1000);
+		eprintf("map: %lu keys, built both ways: equal %d\n",
+			removed.m_size, map_equal(&direct, &removed));
+
+		/* and so do the nodes above it once the rest are removed */
+		test_map_fill(&removed, 0, 1000, 0);
+		map_finish(&direct);
+		map_init(&direct, &sys_alloc);
+		map_set_z64(&direct, test_map_key(-1), -1);
+		eprintf("map: %lu keys, built both ways: equal %d\n",
+			removed.m_size, map_equal(&direct, &removed));
+		map_finish(&removed);
+		map_finish(&direct);
+	}
+
+	{
+		struct ctable *ct = &test_ctable;
+		pthread_t readers[2];
+		size_t expected = 0;
+		struct tkey key;
+		z64 k, v;
+		int i, res;
+		ctable_init(ct, &thread_alloc);
+		for (i = 0; i < 2; i++) {
+			pthread_create(&readers[i], NULL, test_ctable_reader,
+				(void *)(intptr_t)(i + 1));
+		}
+		/* enough keys for each shard to double its buckets a few times */
+		for (k = 0; k < TEST_CTABLE_KEYS; k++) {
+			ctable_set_z64(ct, table_key_z64(k), k * 1000);
+		}
+		for (k = 0; k < TEST_CTABLE_KEYS; k += 2) {
+			ctable_set_z64(ct, table_key_z64(k), k * 1000 + 1);
+		}
+		for (k = 0; k < TEST_CTABLE_KEYS; k += 3) {
+			if (ctable_remove(ct, table_key_z64(k)) != 0) {
+				abort_with_error("ctable lost %ld\n", (long)k);
+			}
+		}
+		__atomic_store_n(&test_ctable_stop, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < 2; i++) {
+			pthread_join(readers[i], NULL);
+		}
+		for (k = 0; k < TEST_CTABLE_KEYS; k++) {
+			key = table_key_z64(k);
+			res = ctable_try_get_z64(ct, key, &v);
+			if (k % 3 == 0) {
+				if (res == 0 || ctable_remove(ct, key) == 0) {
+					abort_with_error("ctable kept %ld\n",
+						(long)k);
+				}
+			} else if (res != 0 || v != k * 1000 + (k % 2 == 0)) {
+				abort_with_error("ctable has %ld wrong\n", (long)k);
+			} else {
+				expected++;
+			}
+		}
+		if (ctable_size(ct) != expected) {
+			abort_with_error("ctable has %lu keys, not %lu\n",
+				ctable_size(ct), expected);
+		}
+		ctable_set_cstr(ct, table_key_cstr("mode"), "insert");
+		ctable_set_cstr(ct, table_key_cstr("mode"), "normal");
+		eprintf("ctable: %lu keys left, and the mode is %s\n",
+			ctable_size(ct), ctable_get_cstr(ct, table_key_cstr("mode")));
+		ctable_finish(ct);
 	}
 
 	{
@@ -149,6 +602,18 @@ main(void)
 		heapstring_destroy(hs1, &mmap_alloc);
 	}
 
+	{
+		struct page_alloc huge;
+		struct heapstring *hs;
+		page_alloc_init(&huge, PAGE_ALLOC_THP, HUGE_PAGE_SIZE);
+		hs = heapstring_create(HEAPSTRING_PAGE_CAP, &huge.pa_alloc);
+		hs->hs_str[0] = 'v';
+		hs = heapstring_expand(hs, &huge.pa_alloc, 64 * HUGE_PAGE_SIZE);
+		eprintf("heapstring: %lu bytes, starting with %c\n",
+			hs->hs_cap, hs->hs_str[0]);
+		heapstring_destroy(hs, &huge.pa_alloc);
+	}
+
 	{
 		char buf[4096];
 		struct buf_alloc buf_alloc;
@@ -177,9 +642,133 @@ main(void)
 
 	{
 		const char *data = "I'd just like to interject for a moment";
+		struct fibre_join join;
+		void *sum;
 		test_hash_string(data, strlen(data));
-		fibre_init(&mmap_alloc, STACK_SIZE);
-		fibre_go(test_fibre);
+		fibre_init(&mmap_alloc, STACK_SIZE, 0);
+		fibre_go_join(&join, test_fibre, (void *)1);
+		sum = fibre_join(&join);
+		eprintf("fibres summed to %ld\n", (intptr_t)sum);
+		{
+			struct channel ch;
+			channel_init(&ch, sizeof(long), 8);
+			fibre_go_join(&join, test_channel_consumer, &ch);
+			fibre_go(test_channel_producer, &ch);
+			sum = fibre_join(&join);
+			eprintf("channel carried a sum of %ld\n", (long)sum);
+			channel_finish(&ch);
+		}
+		{
+			int fds[2];
+			if (pipe2(fds, O_NONBLOCK) == -1) {
+				abort_with_error("Could not create pipe\n");
+			}
+			fibre_go_join(&join, test_pipe_reader, (void *)(intptr_t)fds[0]);
+			fibre_go(test_pipe_writer, (void *)(intptr_t)fds[1]);
+			sum = fibre_join(&join);
+			eprintf("read %ld bytes from a pipe\n", (long)sum);
+		}
+		{
+			struct fibre_join reader, writer;
+			void *sent;
+			char buf[4096];
+			long total = 0;
+			ssize_t n;
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+					fds) == -1) {
+				abort_with_error("Could not create socket pair\n");
+			}
+			fibre_go_join(&reader, test_socket_reader,
+				(void *)(intptr_t)fds[0]);
+			fibre_go_join(&writer, test_socket_writer,
+				(void *)(intptr_t)fds[0]);
+			/* until the writer has filled the socket and is waiting too */
+			fibre_sleep(5);
+			if (fibre_write(fds[1], "v", 1) != 1) {
+				abort_with_error("Could not write to socket\n");
+			}
+			sum = fibre_join(&reader);
+			while (total < TEST_SOCKET_BYTES &&
+					(n = fibre_read(fds[1], buf, sizeof buf)) > 0) {
+				total += n;
+			}
+			sent = fibre_join(&writer);
+			eprintf("socket reader got %ld byte while the writer "
+				"waited, and %ld of %ld bytes written were read\n",
+				(long)sum, total, (long)sent);
+			close(fds[0]);
+			close(fds[1]);
+		}
+		{
+			struct channel ch;
+			long msg, start = fibre_clock();
+			size_t n;
+			int status;
+			channel_init(&ch, sizeof(long), 1);
+			fibre_sleep(5);
+			status = channel_recv_until(&ch, &msg, 1, &n, fibre_clock() + 10);
+			eprintf("receiving from an empty channel %s after at least 15ms: %d\n",
+				status == CHANNEL_TIMEDOUT ? "timed out" : "did not time out",
+				fibre_clock() - start >= 15);
+			channel_finish(&ch);
+		}
+		{
+			struct fibre_join joins[10];
+			intptr_t i;
+			test_local_key = fibre_local_key_create(test_local_destructor);
+			for (i = 0; i < 10; i++) {
+				fibre_go_join(&joins[i], test_local, (void *)(i + 1));
+			}
+			for (i = 0; i < 10; i++) {
+				fibre_join(&joins[i]);
+			}
+			eprintf("fibre-local destructors summed to %ld\n",
+				test_local_sum);
+		}
+		{
+			struct fibre_cancel_scope scope;
+			struct channel ch;
+			long msg;
+			size_t n;
+			int status, cancelled;
+			fibre_cancel_scope_init(&scope, FIBRE_NO_DEADLINE);
+			fibre_go_join(&join, test_cancelled_search, &scope);
+			fibre_sleep(10);
+			fibre_cancel(&scope);
+			sum = fibre_join(&join);
+			eprintf("background search was cancelled after %ld passes\n",
+				(long)sum);
+
+			channel_init(&ch, sizeof(long), 1);
+			fibre_cancel_scope_init(&scope, fibre_clock() + 10);
+			fibre_cancel_scope_enter(&scope);
+			status = channel_recv_until(&ch, &msg, 1, &n, FIBRE_NO_DEADLINE);
+			cancelled = fibre_cancel_scope_exit(&scope);
+			eprintf("receiving inside a scope with a deadline was %s: %d\n",
+				status == CHANNEL_CANCELLED ? "cancelled" : "not cancelled",
+				cancelled);
+
+			/* a cancelled fibre gets nowhere even without waiting */
+			fibre_cancel_scope_init(&scope, FIBRE_NO_DEADLINE);
+			fibre_cancel_scope_enter(&scope);
+			fibre_cancel(&scope);
+			msg = 1;
+			status = channel_send_until(&ch, &msg, FIBRE_NO_DEADLINE);
+			cancelled = channel_recv_until(&ch, &msg, 1, &n,
+				FIBRE_NO_DEADLINE) == CHANNEL_CANCELLED;
+			fibre_cancel_scope_exit(&scope);
+			eprintf("sending and receiving on a channel with room when "
+				"cancelled were both cancelled: %d\n",
+				status == CHANNEL_CANCELLED && cancelled);
+			channel_finish(&ch);
+		}
+		{
+			fibre_go_join(&join, test_arena_frames, NULL);
+			sum = fibre_join(&join);
+			eprintf("per-frame arenas laid out lines summing to %ld\n",
+				(long)sum);
+		}
 		fibre_return();
 		test_hash_string(data, strlen(data) - 5);
 		/* fibre_finish(); */
@@ -234,6 +823,25 @@ test_slab(void)
 	slab_object_destroy(&sa, f[0]);
 	slab_object_destroy(&sa, f[1]);
 	slab_object_destroy(&sa, f[2]);
+	f[0] = slab_object_create(&sa);
+	slab_object_destroy(&sa, f[0]);
+	eprintf("slabs mapped: %ld\n", sa.sp_maps);
 
 	slab_pool_finish(&sa);
+
+	{
+		struct slab_alloc salloc;
+		struct string str;
+		int i;
+
+		slab_alloc_init(&salloc, &mmap_alloc);
+		string_init_with(&str, &salloc.sa_alloc, 16);
+		for (i = 0; i < 100; i++) {
+			string_append_cstring(&str, "slab ");
+		}
+		eprintf("string grown through slab_alloc: %lu bytes\n",
+			str.str_len);
+		string_finish(&str);
+		slab_alloc_finish(&salloc);
+	}
 }